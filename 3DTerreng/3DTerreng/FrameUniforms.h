@@ -0,0 +1,50 @@
+#ifndef FRAMEUNIFORMS_H
+#define FRAMEUNIFORMS_H
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+// Uniform buffer binding point of the FrameUniforms block, the same in every program
+const GLuint FRAME_UNIFORMS_BINDING = 0;
+
+// Layout of the block in the shaders (std140, so vectors are padded to vec4):
+//   layout (std140) uniform FrameUniforms
+//   {
+//       mat4 projection;
+//       mat4 view;
+//       mat4 viewProjection;
+//       vec4 cameraPosition;  // xyz, w = 1
+//       vec4 viewport;        // width, height, 1 / width, 1 / height in pixels
+//   };
+struct FrameUniformData
+{
+    glm::mat4 projection;
+    glm::mat4 view;
+    glm::mat4 viewProjection;
+    glm::vec4 cameraPosition;
+    glm::vec4 viewport;
+};
+
+// Camera data for the whole frame in one uniform buffer
+// The buffer stays bound at FRAME_UNIFORMS_BINDING and Shader points the FrameUniforms block of
+// every program there when it links, so one upload per frame reaches all programs. Only the
+// uniforms that change per draw (model, material) are set on the programs
+class FrameUniforms
+{
+public:
+	FrameUniforms();
+	~FrameUniforms();
+
+	void update(const glm::mat4& projection, const glm::mat4& view, const glm::vec3& cameraPosition, const glm::vec2& viewportSize);
+
+	const FrameUniformData& getData() const { return data; }
+
+private:
+    FrameUniforms(const FrameUniforms&);
+    FrameUniforms& operator=(const FrameUniforms&);
+
+    GLuint UBO = 0;
+    FrameUniformData data;
+};
+
+#endif // !FRAMEUNIFORMS_H
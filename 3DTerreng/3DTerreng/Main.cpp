@@ -5,10 +5,20 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include <vector>
+#include <cfloat>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
 
 #include "shaderClass.h"
 #include "Camera.h"
 #include "Box.h"
+#include "FrameUniforms.h"
+#include "JobSystem.h"
+#include "StartupGraph.h"
+#include "UploadService.h"
 
 
 using namespace std;
@@ -33,52 +43,99 @@ struct Vertex
 	glm::vec3 position;
 };
 
+// Reads "x z y" from the start of one line, the line ends at lineEnd (at its newline or the end of the text)
+static bool parsePointLine(const char* line, const char* lineEnd, glm::vec3& position)
+{
+	float coordinates[3];
+	const char* cursor = line;
+	for (int k = 0; k < 3; ++k)
+	{
+		char* next = nullptr;
+		coordinates[k] = strtof(cursor, &next);
+
+		// strtof skips newlines as white space, a number from the next line does not count
+		if (next == cursor || next > lineEnd)
+			return false;
+		cursor = next;
+	}
+
+	position = glm::vec3(coordinates[0], coordinates[2], coordinates[1]);
+	return true;
+}
+
 vector<Vertex> loadAndCenterPoints(const string& filename) 
 {
-	ifstream file(filename);
+	ifstream file(filename, ios::binary);
 	if (!file.is_open()) 
 	{
 		cout << "Error: Unable to open file " << filename << endl;
 		return {};  // Return an empty vector if the file can't be opened
 	}
 
-	vector<Vertex> vertices;
-	glm::vec3 min(FLT_MAX), max(-FLT_MAX);
-	string line;
+	// The whole file at once, then the lines are parsed in parallel
+	string text((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+	file.close();
 
 	// Read the first line as the header (point count) and discard it
-	if (getline(file, line)) 
+	size_t headerEnd = text.find('\n');
+	if (!text.empty()) 
 	{
-		cout << "Point count header: " << line << endl;
+		cout << "Point count header: " << text.substr(0, headerEnd) << endl;
 	}
 
-	int lineNumber = 1;
-	while (getline(file, line))
+	// Start of every point line
+	vector<size_t> lineStarts;
+	if (headerEnd != string::npos)
 	{
-		lineNumber++;
-		Vertex vertex;
-		stringstream ss(line);
-		ss >> vertex.position.x >> vertex.position.z >> vertex.position.y;
+		for (size_t position = headerEnd + 1; position < text.size(); )
+		{
+			lineStarts.push_back(position);
+			size_t next = text.find('\n', position);
+			if (next == string::npos)
+				break;
+			position = next + 1;
+		}
+	}
 
-		if (ss.fail()) {
-			cout << "Error: Failed to read coordinates on line " << lineNumber << ": " << line << endl;
+	int lineCount = static_cast<int>(lineStarts.size());
+	vector<Vertex> parsed(lineCount);
+	vector<char> valid(lineCount);
+	JobSystem::shared().parallelFor(0, lineCount, 16384, [&](int first, int last)
+	{
+		for (int i = first; i < last; ++i)
+		{
+			const char* line = text.c_str() + lineStarts[i];
+			const char* lineEnd = i + 1 < lineCount ? text.c_str() + lineStarts[i + 1] - 1 : text.c_str() + text.size();
+			valid[i] = parsePointLine(line, lineEnd, parsed[i].position);
+		}
+	});
+
+	// In file order, so the messages and the points come out as before
+	vector<Vertex> vertices;
+	vertices.reserve(lineCount);
+	glm::vec3 min(FLT_MAX), max(-FLT_MAX);
+	for (int i = 0; i < lineCount; ++i)
+	{
+		if (!valid[i]) {
+			size_t lineLength = (i + 1 < lineCount ? lineStarts[i + 1] - 1 : text.size()) - lineStarts[i];
+			cout << "Error: Failed to read coordinates on line " << i + 2 << ": " << text.substr(lineStarts[i], lineLength) << endl;
 			continue;  // Skip this line and move to the next one
 		}
 
-		min = glm::min(min, vertex.position);
-		max = glm::max(max, vertex.position);
-		vertices.push_back(vertex);
+		min = glm::min(min, parsed[i].position);
+		max = glm::max(max, parsed[i].position);
+		vertices.push_back(parsed[i]);
 	}
 
-	file.close();
-
 	// Calculate the center of the bounding box
 	glm::vec3 center = (min + max) / 2.0f;
 
 	// Shift all vertices so the center of the cloud is at (0, 0, 0)
-	for (auto& vertex : vertices) {
-		vertex.position -= center;
-	}
+	JobSystem::shared().parallelFor(0, static_cast<int>(vertices.size()), 65536, [&](int first, int last)
+	{
+		for (int i = first; i < last; ++i)
+			vertices[i].position -= center;
+	});
 
 	cout << "Loaded " << vertices.size() << " points centered around " << center.x << ", " << center.y << ", " << center.z << endl;
 	return vertices;
@@ -86,51 +143,98 @@ vector<Vertex> loadAndCenterPoints(const string& filename)
 
 int main()
 {
-	glfwInit(); //Initialize GLFW
+	// Startup as a task graph: the points are loaded on a worker while the window opens and the
+	// shaders compile, the upload is queued when both are done
+	GLFWwindow* window = NULL;
+	unique_ptr<Shader> shaderProgram;
+	unique_ptr<Box> box;
+	unique_ptr<FrameUniforms> frameUniforms;
+	unique_ptr<UploadService> uploads;
+	vector<Vertex> points;
+	size_t pointCount = 0;
+	UploadHandle pointsUpload;
+	unsigned int VAO = 0, VBO = 0;
+
+	StartupGraph startup;
+
+	int openWindow = startup.addTask("open window", StartupGraph::MainThread, {}, [&]()
+	{
+		glfwInit(); //Initialize GLFW
+
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3); 
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+		glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+
+		//glfw window creation
+		window = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, "Oblig 1", NULL, NULL);
+		if (window == NULL)
+		{
+			std::cout << "Failed to create GLFW window" << std::endl;
+			return false;
+		}
+		glfwMakeContextCurrent(window);
+		glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
 
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3); 
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+		glfwSetCursorPosCallback(window, mouse_callback);
 
-	//glfw window creation
-	GLFWwindow* window = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, "Oblig 1", NULL, NULL);
-	if (window == NULL)
-	{
-		std::cout << "Failed to create GLFW window" << std::endl;
-		glfwTerminate();
-		return -1;
-	}
-	glfwMakeContextCurrent(window);
-	glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+		glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED); // tell GLFW to capture our mouse
 
-	glfwSetCursorPosCallback(window, mouse_callback);
-	
-	glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED); // tell GLFW to capture our mouse
+		//Initialize GLAD
+		gladLoadGL();
 
-	//Initialize GLAD
-	gladLoadGL();
+		//Set the viewport
+		glViewport(0, 0, SCR_WIDTH, SCR_HEIGHT);
+		return true;
+	});
 
-	//Set the viewport
-	glViewport(0, 0, SCR_WIDTH, SCR_HEIGHT);
+	startup.addTask("compile shaders", StartupGraph::MainThread, { openWindow }, [&]()
+	{
+		shaderProgram.reset(new Shader("default.vert", "default.frag"));
+		return true;
+	});
 
-	Shader shaderProgram("default.vert", "default.frag");
+	startup.addTask("create box", StartupGraph::MainThread, { openWindow }, [&]()
+	{
+		box.reset(new Box());
+		return true;
+	});
 
-	Box box;
+	// Projection and view for every program, uploaded once per frame
+	startup.addTask("create frame uniforms", StartupGraph::MainThread, { openWindow }, [&]()
+	{
+		frameUniforms.reset(new FrameUniforms());
+		return true;
+	});
 
 	// Load and center points
-	vector<Vertex> points = loadAndCenterPoints("vsim_las.txt");
-
-	// Create VAO, VBO for points
-	unsigned int VAO, VBO;
-	glGenVertexArrays(1, &VAO);
-	glGenBuffers(1, &VBO);
+	int loadPoints = startup.addTask("load points", StartupGraph::Worker, {}, [&]()
+	{
+		points = loadAndCenterPoints("vsim_las.txt");
+		return true;
+	});
 
-	glBindVertexArray(VAO);
-	glBindBuffer(GL_ARRAY_BUFFER, VBO);
-	glBufferData(GL_ARRAY_BUFFER, points.size() * sizeof(glm::vec3), &points[0], GL_STATIC_DRAW);
+	// The point buffer is filled on the upload thread, the render loop starts drawing it when it is done
+	int startUploads = startup.addTask("start upload thread", StartupGraph::MainThread, { openWindow }, [&]()
+	{
+		uploads.reset(new UploadService(window));
+		return true;
+	});
 
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void*)0);
-	glEnableVertexAttribArray(0);
+	startup.addTask("queue point upload", StartupGraph::MainThread, { startUploads, loadPoints }, [&]()
+	{
+		pointCount = points.size();
+		pointsUpload = uploads->uploadBuffer(std::move(points));
+		return true;
+	});
+
+	bool started = startup.run();
+	startup.printTimeline();
+	if (!started)
+	{
+		uploads.reset();
+		glfwTerminate();
+		return -1;
+	}
 
 	// Set point size
 	glPointSize(2.0f); // Increase point size for better visibility
@@ -151,32 +255,61 @@ int main()
 		glClearColor(0.5f, 0.3f, 0.8f, 1.0f);
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-		shaderProgram.Activate();
-
 		glm::mat4 projection = glm::perspective(glm::radians(45.0f), (float)SCR_WIDTH / (float)SCR_HEIGHT, 0.1f, 100.0f); // Adjust far clipping plane if needed
-		shaderProgram.setMat4("projection", projection);// pass the projection matrix to the shader
-
 		glm::mat4 view = camera.GetViewMatrix();
-		shaderProgram.setMat4("view", view); // pass the view matrix to the shader
+		frameUniforms->update(projection, view, camera.Position, glm::vec2(SCR_WIDTH, SCR_HEIGHT)); // shared by all the shader programs
+
+		shaderProgram->Activate();
 
 		glm::mat4 model = glm::mat4(1.0f);
 		model = glm::scale(model, glm::vec3(0.1f, 0.1f, 0.1f)); // Adjust scaling for larger coordinates
-		shaderProgram.setMat4("model", model);
+		shaderProgram->setMat4("model", model);
 		
 	
 
+		// Create VAO for the points once their buffer is on the GPU
+		if (pointsUpload && UploadService::isReady(pointsUpload))
+		{
+			VBO = UploadService::getBuffer(pointsUpload);
+			pointsUpload.reset();
+			if (VBO != 0)
+			{
+				glGenVertexArrays(1, &VAO);
+				glBindVertexArray(VAO);
+				glBindBuffer(GL_ARRAY_BUFFER, VBO);
+
+				glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void*)0);
+				glEnableVertexAttribArray(0);
+				cout << "Points on the GPU after " << glfwGetTime() << " s" << endl;
+			}
+		}
+
 		// Draw the point cloud
-		glBindVertexArray(VAO);
-		glDrawArrays(GL_POINTS, 0, points.size());
+		if (VAO != 0)
+		{
+			glBindVertexArray(VAO);
+			glDrawArrays(GL_POINTS, 0, pointCount);
+		}
 
 		// Draw box
-		//box.DrawBox();
+		//box->DrawBox();
 		
 		glfwSwapBuffers(window);
 		glfwPollEvents();
 	}
 
-	shaderProgram.Delete();
+	shaderProgram->Delete();
+	box.reset();
+	frameUniforms.reset();
+
+	// Its window shares the context of the main window and goes first
+	UploadService::discard(pointsUpload);
+	uploads.reset();
+	if (VAO != 0)
+	{
+		glDeleteVertexArrays(1, &VAO);
+		glDeleteBuffers(1, &VBO);
+	}
 
 	glfwDestroyWindow(window);
 	glfwTerminate();
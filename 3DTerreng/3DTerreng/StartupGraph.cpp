@@ -0,0 +1,163 @@
+#include "StartupGraph.h"
+#include "JobSystem.h"
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+
+int StartupGraph::addTask(const std::string& name, TaskThread thread, const std::vector<int>& dependencies, std::function<bool()> work)
+{
+    Task task;
+    task.name = name;
+    task.thread = thread;
+    task.work = std::move(work);
+    for (int dependency : dependencies)
+    {
+        // Only tasks added before, so the graph cannot have a cycle
+        if (dependency >= 0 && dependency < static_cast<int>(tasks.size()))
+            task.dependencies.push_back(dependency);
+        else
+            std::cout << "Error: Startup task " << name << " depends on unknown task " << dependency << std::endl;
+    }
+    tasks.push_back(task);
+    return static_cast<int>(tasks.size()) - 1;
+}
+
+double StartupGraph::millisecondsSinceStart() const
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - runStart).count();
+}
+
+void StartupGraph::runTask(int index)
+{
+    Task& task = tasks[index];
+    task.start = millisecondsSinceStart();
+    bool succeeded = task.work();
+    task.end = millisecondsSinceStart();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    task.state = succeeded ? Done : Failed;
+    if (!succeeded)
+        std::cout << "Error: Startup task " << task.name << " failed" << std::endl;
+    taskEnded.notify_all();
+}
+
+bool StartupGraph::run()
+{
+    runStart = std::chrono::steady_clock::now();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+        // Hand every worker task that is ready to the job system, and pick the first main thread task
+        int mainTask = -1;
+        bool unfinished = false;
+        bool changed = false;
+        for (int i = 0; i < static_cast<int>(tasks.size()); ++i)
+        {
+            Task& task = tasks[i];
+            if (task.state == Running)
+                unfinished = true;
+            if (task.state != Pending)
+                continue;
+            unfinished = true;
+
+            bool ready = true;
+            bool blocked = false;
+            for (int dependency : task.dependencies)
+            {
+                TaskState state = tasks[dependency].state;
+                ready = ready && state == Done;
+                blocked = blocked || state == Failed || state == Skipped;
+            }
+
+            if (blocked)
+            {
+                task.state = Skipped;
+                changed = true;
+            }
+            else if (ready && task.thread == Worker)
+            {
+                task.state = Running;
+                changed = true;
+                JobSystem::shared().submit([this, i]() { runTask(i); });
+            }
+            else if (ready && mainTask < 0)
+            {
+                mainTask = i;
+            }
+        }
+
+        if (!unfinished)
+            break;
+
+        if (mainTask >= 0)
+        {
+            tasks[mainTask].state = Running;
+            lock.unlock();
+            runTask(mainTask);
+            lock.lock();
+        }
+        else if (!changed)
+        {
+            // Everything that is left waits for a worker task
+            taskEnded.wait(lock);
+        }
+    }
+
+    for (const Task& task : tasks)
+    {
+        if (task.state != Done)
+            return false;
+    }
+    return true;
+}
+
+void StartupGraph::printTimeline() const
+{
+    double total = 0.0;
+    for (const Task& task : tasks)
+        total = std::max(total, task.end);
+
+    // Critical path: back from the task that ended last, always through the dependency that ended last
+    std::vector<bool> critical(tasks.size(), false);
+    int current = -1;
+    for (int i = 0; i < static_cast<int>(tasks.size()); ++i)
+    {
+        if (tasks[i].state == Done && (current < 0 || tasks[i].end > tasks[current].end))
+            current = i;
+    }
+    while (current >= 0)
+    {
+        critical[current] = true;
+        int latest = -1;
+        for (int dependency : tasks[current].dependencies)
+        {
+            if (latest < 0 || tasks[dependency].end > tasks[latest].end)
+                latest = dependency;
+        }
+        current = latest;
+    }
+
+    const int barWidth = 40;
+    std::cout << "Startup timeline (ms), * = critical path" << std::endl;
+    for (size_t i = 0; i < tasks.size(); ++i)
+    {
+        const Task& task = tasks[i];
+        std::string bar(barWidth, ' ');
+        if (task.state == Done || task.state == Failed)
+        {
+            int first = total > 0.0 ? static_cast<int>(task.start / total * barWidth) : 0;
+            int last = total > 0.0 ? static_cast<int>(task.end / total * barWidth) : 0;
+            first = std::min(first, barWidth - 1);
+            last = std::min(std::max(last, first + 1), barWidth);
+            std::fill(bar.begin() + first, bar.begin() + last, '#');
+        }
+
+        char line[256];
+        const char* status = task.state == Done ? "" : task.state == Failed ? " failed" : " skipped";
+        snprintf(line, sizeof(line), "%c %-22s %-6s %9.1f %9.1f %9.1f |%s|%s", critical[i] ? '*' : ' ', task.name.c_str(),
+            task.thread == MainThread ? "main" : "worker", task.start, task.end, task.end - task.start, bar.c_str(), status);
+        std::cout << line << std::endl;
+    }
+    std::cout << "Startup took " << total << " ms" << std::endl;
+}
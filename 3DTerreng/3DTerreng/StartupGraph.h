@@ -0,0 +1,58 @@
+#ifndef STARTUPGRAPH_H
+#define STARTUPGRAPH_H
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Startup as a graph of tasks with dependencies
+// Worker tasks go to the JobSystem as soon as their dependencies are done, main thread tasks
+// (everything that touches the window or OpenGL) run on the thread that calls run(). A task
+// returns false if it failed; the tasks that depend on it are skipped. Every task records when it
+// started and ended, so printTimeline() shows what overlapped and which chain took the longest
+class StartupGraph
+{
+public:
+	enum TaskThread { Worker, MainThread };
+
+	int addTask(const std::string& name, TaskThread thread, const std::vector<int>& dependencies, std::function<bool()> work);
+
+	// Returns when all tasks are done or skipped; false if any task failed or was skipped
+	bool run();
+
+	// Start and end of every task, and the critical path through the graph
+	void printTimeline() const;
+
+private:
+    enum TaskState { Pending, Running, Done, Failed, Skipped };
+
+    struct Task
+    {
+        std::string name;
+        TaskThread thread = Worker;
+        std::vector<int> dependencies;
+        std::function<bool()> work;
+        TaskState state = Pending;
+
+        // Milliseconds since run() started
+        double start = 0.0;
+        double end = 0.0;
+    };
+
+    std::vector<Task> tasks;
+
+    // Guards the task states, the main thread sleeps on the condition until a worker task ends
+    std::mutex mutex;
+    std::condition_variable taskEnded;
+
+    std::chrono::steady_clock::time_point runStart;
+    double millisecondsSinceStart() const;
+
+    // Runs the task on the calling thread and records its times and result
+    void runTask(int index);
+};
+
+#endif // !STARTUPGRAPH_H
@@ -0,0 +1,337 @@
+#include "UploadService.h"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+struct BufferUpload
+{
+    // Pieces of the data, and whatever keeps them alive; released as soon as the copy is done
+    std::vector<UploadSource> sources;
+    std::shared_ptr<void> owner;
+    size_t size = 0;
+
+    // Set by the thread that copies, read by the render thread after copied is true
+    GLuint buffer = 0;
+    GLsync fence = 0;
+
+    // Guards copied, the render thread sleeps on the condition in wait() and discard()
+    std::mutex mutex;
+    std::condition_variable copyFinished;
+    bool copied = false;
+
+    std::atomic<bool> cancelled{ false };
+
+    // Render thread only
+    bool ready = false;
+};
+
+// Long enough that a waiting thread does not spin, short enough to notice a lost context
+static const GLuint64 FENCE_TIMEOUT_NANOSECONDS = 100000000;
+
+// Waits for a fence from any context in the share group and deletes it
+static void waitAndDeleteFence(GLsync& fence)
+{
+    if (fence == 0)
+        return;
+
+    GLenum result;
+    do
+    {
+        result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, FENCE_TIMEOUT_NANOSECONDS);
+    } while (result == GL_TIMEOUT_EXPIRED);
+
+    glDeleteSync(fence);
+    fence = 0;
+}
+
+UploadService::UploadService(GLFWwindow* mainWindow, size_t chunkSize)
+    : chunkSize(std::max<size_t>(chunkSize, 64 * 1024))
+{
+    // Same context hints as the main window are still set, the new context shares its objects
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    uploadWindow = glfwCreateWindow(1, 1, "Upload", NULL, mainWindow);
+    glfwWindowHint(GLFW_VISIBLE, GLFW_TRUE);
+
+    // Creating a window may leave its context current on some platforms
+    glfwMakeContextCurrent(mainWindow);
+
+    if (uploadWindow == NULL)
+    {
+        std::cout << "Error: Could not create the shared context for uploads, uploading on the render thread" << std::endl;
+        return;
+    }
+
+    thread = std::thread(&UploadService::uploadLoop, this);
+}
+
+UploadService::~UploadService()
+{
+    if (uploadWindow == NULL)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    queueChanged.notify_all();
+    thread.join();
+
+    // The upload thread has released the context, the window can go
+    glfwDestroyWindow(uploadWindow);
+}
+
+UploadHandle UploadService::uploadBuffer(const void* data, size_t size)
+{
+    UploadSource source;
+    source.data = data;
+    source.size = size;
+    return enqueue(std::vector<UploadSource>(1, source), std::shared_ptr<void>());
+}
+
+UploadHandle UploadService::uploadBuffer(const std::vector<UploadSource>& sources)
+{
+    return enqueue(sources, std::shared_ptr<void>());
+}
+
+UploadHandle UploadService::enqueue(const std::vector<UploadSource>& sources, std::shared_ptr<void> owner)
+{
+    UploadHandle upload = std::make_shared<BufferUpload>();
+    upload->sources = sources;
+    upload->owner = owner;
+    for (const UploadSource& source : sources)
+        upload->size += source.size;
+
+    if (uploadWindow == NULL)
+    {
+        uploadDirectly(*upload);
+        return upload;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back(upload);
+    }
+    queueChanged.notify_one();
+    return upload;
+}
+
+void UploadService::uploadDirectly(BufferUpload& upload)
+{
+    glGenBuffers(1, &upload.buffer);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, upload.buffer);
+    glBufferData(GL_COPY_WRITE_BUFFER, upload.size, NULL, GL_STATIC_DRAW);
+
+    size_t offset = 0;
+    for (const UploadSource& source : upload.sources)
+    {
+        glBufferSubData(GL_COPY_WRITE_BUFFER, offset, source.size, source.data);
+        offset += source.size;
+    }
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+    finishCopy(upload, true);
+}
+
+void UploadService::finishCopy(BufferUpload& upload, bool succeeded)
+{
+    if (!succeeded && upload.buffer != 0)
+    {
+        glDeleteBuffers(1, &upload.buffer);
+        upload.buffer = 0;
+    }
+
+    upload.sources.clear();
+    upload.owner.reset();
+
+    std::lock_guard<std::mutex> lock(upload.mutex);
+    upload.copied = true;
+    upload.copyFinished.notify_all();
+}
+
+void UploadService::uploadLoop()
+{
+    glfwMakeContextCurrent(uploadWindow);
+
+    glGenBuffers(2, stagingBuffers);
+    for (GLuint staging : stagingBuffers)
+    {
+        glBindBuffer(GL_COPY_READ_BUFFER, staging);
+        glBufferData(GL_COPY_READ_BUFFER, chunkSize, NULL, GL_STREAM_DRAW);
+    }
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+
+    while (true)
+    {
+        UploadHandle upload;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            queueChanged.wait(lock, [this]() { return stopping || !queue.empty(); });
+            if (stopping)
+                break;
+            upload = queue.front();
+            queue.pop_front();
+        }
+
+        if (upload->cancelled)
+            finishCopy(*upload, false);
+        else
+            copyThroughStaging(*upload);
+    }
+
+    // Uploads that never started are given up, so nobody waits for them
+    std::deque<UploadHandle> remaining;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        remaining.swap(queue);
+    }
+    for (const UploadHandle& upload : remaining)
+        finishCopy(*upload, false);
+
+    for (GLsync& fence : stagingFences)
+        waitAndDeleteFence(fence);
+    glDeleteBuffers(2, stagingBuffers);
+    glFinish();
+
+    glfwMakeContextCurrent(NULL);
+}
+
+void UploadService::copyThroughStaging(BufferUpload& upload)
+{
+    glGetError();
+
+    glGenBuffers(1, &upload.buffer);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, upload.buffer);
+    glBufferData(GL_COPY_WRITE_BUFFER, upload.size, NULL, GL_STATIC_DRAW);
+    if (glGetError() == GL_OUT_OF_MEMORY)
+    {
+        std::cout << "Error: Out of memory for a buffer of " << upload.size << " bytes" << std::endl;
+        finishCopy(upload, false);
+        return;
+    }
+
+    size_t sourceIndex = 0;
+    size_t sourceOffset = 0;
+    int next = 0;
+    for (size_t offset = 0; offset < upload.size; offset += chunkSize)
+    {
+        if (upload.cancelled || stopping)
+        {
+            finishCopy(upload, false);
+            return;
+        }
+
+        // The copy out of this staging buffer two chunks ago must be done before it is filled again
+        waitAndDeleteFence(stagingFences[next]);
+
+        size_t length = std::min(chunkSize, upload.size - offset);
+        glBindBuffer(GL_COPY_READ_BUFFER, stagingBuffers[next]);
+        unsigned char* mapped = static_cast<unsigned char*>(glMapBufferRange(GL_COPY_READ_BUFFER, 0, length,
+            GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT));
+        if (mapped == nullptr)
+        {
+            std::cout << "Error: Could not map the staging buffer for an upload" << std::endl;
+            finishCopy(upload, false);
+            return;
+        }
+
+        // The chunk may take the end of one source and the start of the next
+        for (size_t filled = 0; filled < length; )
+        {
+            const UploadSource& source = upload.sources[sourceIndex];
+            size_t count = std::min(length - filled, source.size - sourceOffset);
+            memcpy(mapped + filled, static_cast<const unsigned char*>(source.data) + sourceOffset, count);
+            filled += count;
+            sourceOffset += count;
+            if (sourceOffset == source.size)
+            {
+                ++sourceIndex;
+                sourceOffset = 0;
+            }
+        }
+        glUnmapBuffer(GL_COPY_READ_BUFFER);
+
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, offset, length);
+        stagingFences[next] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+        // Sends the copy off now, so the GPU works on it while the next chunk is filled
+        glFlush();
+        next = 1 - next;
+    }
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+    // Passes when the last copy is done; the flush makes sure the render thread can see it pass
+    upload.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    glFlush();
+
+    finishCopy(upload, true);
+}
+
+bool UploadService::isReady(const UploadHandle& upload)
+{
+    if (!upload)
+        return false;
+    if (upload->ready)
+        return true;
+
+    {
+        std::lock_guard<std::mutex> lock(upload->mutex);
+        if (!upload->copied)
+            return false;
+    }
+
+    if (upload->fence != 0)
+    {
+        if (glClientWaitSync(upload->fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+            return false;
+        glDeleteSync(upload->fence);
+        upload->fence = 0;
+    }
+
+    upload->ready = true;
+    return true;
+}
+
+void UploadService::wait(const UploadHandle& upload)
+{
+    if (!upload || upload->ready)
+        return;
+
+    {
+        std::unique_lock<std::mutex> lock(upload->mutex);
+        upload->copyFinished.wait(lock, [&]() { return upload->copied; });
+    }
+
+    waitAndDeleteFence(upload->fence);
+    upload->ready = true;
+}
+
+GLuint UploadService::getBuffer(const UploadHandle& upload)
+{
+    return upload && upload->ready ? upload->buffer : 0;
+}
+
+void UploadService::discard(const UploadHandle& upload)
+{
+    if (!upload)
+        return;
+
+    upload->cancelled = true;
+    {
+        std::unique_lock<std::mutex> lock(upload->mutex);
+        upload->copyFinished.wait(lock, [&]() { return upload->copied; });
+    }
+
+    // Deleting them while a copy still runs is fine, OpenGL keeps them until the copy is done
+    if (upload->fence != 0)
+    {
+        glDeleteSync(upload->fence);
+        upload->fence = 0;
+    }
+    if (upload->buffer != 0)
+    {
+        glDeleteBuffers(1, &upload->buffer);
+        upload->buffer = 0;
+    }
+    upload->ready = true;
+}
@@ -2,11 +2,19 @@
 
 layout (location = 0) in vec3 aPos;
 
+// Camera for the whole frame (FrameUniforms.h)
+layout (std140) uniform FrameUniforms
+{
+    mat4 projection;
+    mat4 view;
+    mat4 viewProjection;
+    vec4 cameraPosition;
+    vec4 viewport;
+};
+
 uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
 
 void main()
 {
-    gl_Position = projection * view * model * vec4(aPos, 1.0);
+    gl_Position = viewProjection * model * vec4(aPos, 1.0);
 }
\ No newline at end of file
@@ -1,4 +1,6 @@
 #include"shaderClass.h"
+#include "FrameUniforms.h"
+#include <algorithm>
 
 string get_file_contents(const char* filename)
 {
@@ -38,12 +40,47 @@ Shader::Shader(const char* vertexFile, const char* fragmentFile)
 	glAttachShader(ID, vertexShader); //Attach the vertex shader to the shader program
 	glAttachShader(ID, fragmentShader); //Attach the fragment shader to the shader program
 	glLinkProgram(ID); //Link the shader program
+	setupUniforms();
 
 	glDeleteShader(vertexShader); //Delete the vertex shader
 	glDeleteShader(fragmentShader); //Delete the fragment shader
 }
 
 
+void Shader::setupUniforms()
+{
+	std::unordered_map<std::string, GLint>* locations = new std::unordered_map<std::string, GLint>();
+
+	GLint count = 0;
+	GLint maxLength = 0;
+	glGetProgramiv(ID, GL_ACTIVE_UNIFORMS, &count);
+	glGetProgramiv(ID, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+	std::string name(std::max(maxLength, 1), '\0');
+	for (GLint i = 0; i < count; ++i)
+	{
+		GLsizei length = 0;
+		GLint size = 0;
+		GLenum type = 0;
+		glGetActiveUniform(ID, i, maxLength, &length, &size, &type, &name[0]);
+		std::string uniformName(name.c_str(), length);
+
+		//Members of uniform blocks have no location
+		GLint location = glGetUniformLocation(ID, uniformName.c_str());
+		if (location < 0)
+			continue;
+		(*locations)[uniformName] = location;
+
+		//Arrays are reported as "name[0]", and are set by their plain name as well
+		if (uniformName.size() > 3 && uniformName.compare(uniformName.size() - 3, 3, "[0]") == 0)
+			(*locations)[uniformName.substr(0, uniformName.size() - 3)] = location;
+	}
+	uniformLocations.reset(locations);
+
+	GLuint frameBlock = glGetUniformBlockIndex(ID, "FrameUniforms");
+	if (frameBlock != GL_INVALID_INDEX)
+		glUniformBlockBinding(ID, frameBlock, FRAME_UNIFORMS_BINDING);
+}
+
 //Activate the shader
 void Shader::Activate()
 {
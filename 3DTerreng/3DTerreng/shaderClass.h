@@ -6,6 +6,8 @@
 #include <sstream>
 #include <iostream>
 #include <cerrno>
+#include <memory>
+#include <unordered_map>
 #include <glm/glm.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
@@ -23,20 +25,34 @@ class Shader
 		void Activate();
 		void Delete();
 
+		//Location of a uniform from the table made when the program was linked, -1 if it is not used
+		GLint getUniformLocation(const std::string& name) const
+		{
+			auto found = uniformLocations->find(name);
+			return found != uniformLocations->end() ? found->second : -1;
+		}
+
 		void setVec3(const std::string& name, const glm::vec3& value) const
 		{
-			glUniform3fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+			glUniform3fv(getUniformLocation(name), 1, &value[0]);
 		}
 
 		void setMat4(const std::string& name, const glm::mat4& mat) const
 		{
-			glUniformMatrix4fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+			glUniformMatrix4fv(getUniformLocation(name), 1, GL_FALSE, &mat[0][0]);
 		}
 
 		void SetMatrix4(const char* name, glm::mat4 matrix)
 		{
-			glUniformMatrix4fv(glGetUniformLocation(ID, name), 1, GL_FALSE, glm::value_ptr(matrix));
+			glUniformMatrix4fv(getUniformLocation(name), 1, GL_FALSE, glm::value_ptr(matrix));
 		}
+
+	private:
+		//Shared by the copies of the Shader
+		std::shared_ptr<const std::unordered_map<std::string, GLint>> uniformLocations;
+
+		//After linking: the location of every active uniform, and the FrameUniforms block binding
+		void setupUniforms();
 };
 
 #endif
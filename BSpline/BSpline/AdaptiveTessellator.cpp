@@ -0,0 +1,298 @@
+#include "AdaptiveTessellator.h"
+#include "BSplineSurface.h"
+#include <cfloat>
+#include <cmath>
+#include <deque>
+
+AdaptiveTessellator::AdaptiveTessellator(const BSplineSurface& surface) : surface(surface)
+{
+    surface.getDomain(uMin, uMax, vMin, vMax);
+}
+
+uint64_t AdaptiveTessellator::cellKey(int level, int x, int y)
+{
+    return (static_cast<uint64_t>(level) << 56) | (static_cast<uint64_t>(x) << 28) | static_cast<uint64_t>(y);
+}
+
+uint64_t AdaptiveTessellator::gridKey(int i, int j) const
+{
+    return static_cast<uint64_t>(i) * static_cast<uint64_t>(gridSize + 1) + static_cast<uint64_t>(j);
+}
+
+glm::vec3 AdaptiveTessellator::pointAt(int i, int j)
+{
+    // Corners and midpoints are shared by neighbouring cells, so each point is evaluated once
+    uint64_t key = gridKey(i, j);
+    auto found = pointCache.find(key);
+    if (found != pointCache.end())
+        return found->second;
+
+    float u = uMin + (uMax - uMin) * static_cast<float>(i) / static_cast<float>(gridSize);
+    float v = vMin + (vMax - vMin) * static_cast<float>(j) / static_cast<float>(gridSize);
+    glm::vec3 point = surface.evaluate(u, v);
+    pointCache[key] = point;
+    return point;
+}
+
+// True when the box is completely outside one of the six frustum planes
+static bool outsideFrustum(const glm::vec4 planes[6], const glm::vec3& boundsMin, const glm::vec3& boundsMax)
+{
+    for (int p = 0; p < 6; ++p)
+    {
+        // The corner of the box furthest along the plane normal
+        glm::vec3 corner(planes[p].x >= 0.0f ? boundsMax.x : boundsMin.x,
+                         planes[p].y >= 0.0f ? boundsMax.y : boundsMin.y,
+                         planes[p].z >= 0.0f ? boundsMax.z : boundsMin.z);
+        if (glm::dot(glm::vec3(planes[p]), corner) + planes[p].w < 0.0f)
+            return true;
+    }
+    return false;
+}
+
+void AdaptiveTessellator::setupFrustum(const AdaptiveTessellationSettings& settings)
+{
+    // Frustum planes from the rows of projection * view (Gribb and Hartmann), the near plane last
+    glm::mat4 clip = settings.projection * settings.view;
+    glm::vec4 rows[4];
+    for (int i = 0; i < 4; ++i)
+        rows[i] = glm::vec4(clip[0][i], clip[1][i], clip[2][i], clip[3][i]);
+    frustumPlanes[0] = rows[3] + rows[0];
+    frustumPlanes[1] = rows[3] - rows[0];
+    frustumPlanes[2] = rows[3] + rows[1];
+    frustumPlanes[3] = rows[3] - rows[1];
+    frustumPlanes[4] = rows[3] - rows[2];
+    frustumPlanes[5] = rows[3] + rows[2];
+}
+
+bool AdaptiveTessellator::needsSplit(int level, int x, int y, const AdaptiveTessellationSettings& settings)
+{
+    if (level >= maxLevel)
+        return false;
+
+    int size = gridSize >> level;
+    int half = size / 2;
+    int i0 = x * size, j0 = y * size;
+    int i1 = i0 + size, j1 = j0 + size;
+
+    glm::vec3 p00 = pointAt(i0, j0), p10 = pointAt(i1, j0);
+    glm::vec3 p01 = pointAt(i0, j1), p11 = pointAt(i1, j1);
+    glm::vec3 center = pointAt(i0 + half, j0 + half);
+    glm::vec3 bottom = pointAt(i0 + half, j0), top = pointAt(i0 + half, j1);
+    glm::vec3 left = pointAt(i0, j0 + half), right = pointAt(i1, j0 + half);
+
+    // Chordal deviation: distance between the surface and the bilinear cell at the midpoints
+    float deviation = glm::length(center - 0.25f * (p00 + p10 + p01 + p11));
+    deviation = glm::max(deviation, glm::length(bottom - 0.5f * (p00 + p10)));
+    deviation = glm::max(deviation, glm::length(top - 0.5f * (p01 + p11)));
+    deviation = glm::max(deviation, glm::length(left - 0.5f * (p00 + p01)));
+    deviation = glm::max(deviation, glm::length(right - 0.5f * (p10 + p11)));
+
+    // A cell outside the view is never seen, however coarse it is. The box of the samples is grown
+    // by the deviation, since the surface between them can bulge past it
+    const glm::vec3 samples[9] = { p00, p10, p01, p11, center, bottom, top, left, right };
+    glm::vec3 boundsMin = samples[0], boundsMax = samples[0];
+    for (const glm::vec3& sample : samples)
+    {
+        boundsMin = glm::min(boundsMin, sample);
+        boundsMax = glm::max(boundsMax, sample);
+    }
+    if (outsideFrustum(frustumPlanes, boundsMin - glm::vec3(deviation), boundsMax + glm::vec3(deviation)))
+        return false;
+
+    // World size to pixels at the distance of the cell. When the centre is not in front of the near
+    // plane the nearest sample that is stands in for it; with none of them in front the cell is not
+    // split, a depth at or behind the near plane says nothing about its size on screen
+    const glm::vec4& nearPlane = frustumPlanes[5];
+    float depth = FLT_MAX;
+    if (glm::dot(glm::vec3(nearPlane), center) + nearPlane.w > 0.0f)
+    {
+        depth = -(settings.view * glm::vec4(center, 1.0f)).z;
+    }
+    else
+    {
+        for (const glm::vec3& sample : samples)
+        {
+            if (glm::dot(glm::vec3(nearPlane), sample) + nearPlane.w > 0.0f)
+                depth = glm::min(depth, -(settings.view * glm::vec4(sample, 1.0f)).z);
+        }
+    }
+    if (depth == FLT_MAX)
+        return false;
+    float pixelsPerUnit = 0.5f * settings.viewportSize.y * settings.projection[1][1] / depth;
+
+    return deviation * pixelsPerUnit > settings.maxPixelError;
+}
+
+int AdaptiveTessellator::coveringLeafLevel(int level, int x, int y) const
+{
+    for (int k = level; k >= 0; --k)
+    {
+        if (leaves.count(cellKey(k, x >> (level - k), y >> (level - k))))
+            return k;
+    }
+    return -1;
+}
+
+void AdaptiveTessellator::balance()
+{
+    std::deque<uint64_t> queue(leaves.begin(), leaves.end());
+    const int dx[4] = { -1, 1, 0, 0 };
+    const int dy[4] = { 0, 0, -1, 1 };
+
+    while (!queue.empty())
+    {
+        uint64_t key = queue.front();
+        queue.pop_front();
+        if (!leaves.count(key))
+            continue;
+
+        int level = static_cast<int>(key >> 56);
+        int x = static_cast<int>((key >> 28) & 0xFFFFFFF);
+        int y = static_cast<int>(key & 0xFFFFFFF);
+        int cells = 1 << level;
+
+        for (int n = 0; n < 4; ++n)
+        {
+            int nx = x + dx[n], ny = y + dy[n];
+            if (nx < 0 || ny < 0 || nx >= cells || ny >= cells)
+                continue;
+
+            // A neighbour more than one level coarser is split, and this cell is checked again
+            int k = coveringLeafLevel(level, nx, ny);
+            if (k >= 0 && k < level - 1)
+            {
+                int cx = nx >> (level - k), cy = ny >> (level - k);
+                leaves.erase(cellKey(k, cx, cy));
+                for (int c = 0; c < 4; ++c)
+                {
+                    uint64_t child = cellKey(k + 1, 2 * cx + (c & 1), 2 * cy + (c >> 1));
+                    leaves.insert(child);
+                    queue.push_back(child);
+                }
+                queue.push_back(key);
+                break;
+            }
+        }
+    }
+}
+
+void AdaptiveTessellator::tessellate(const AdaptiveTessellationSettings& settings,
+    std::vector<glm::vec3>& vertices, std::vector<glm::vec3>& normals, std::vector<unsigned int>& indices)
+{
+    maxLevel = glm::clamp(settings.maxLevel, 0, 26);
+    gridSize = 1 << (maxLevel + 1);
+    leaves.clear();
+    pointCache.clear();
+    setupFrustum(settings);
+
+    // Start with at least one cell per Bezier patch, so no feature falls between the samples
+    int minLevel = settings.minLevel;
+    if (minLevel < 0)
+    {
+        int patches = 1;
+        for (const BezierPatch& patch : surface.getBezierPatches())
+            patches = glm::max(patches, static_cast<int>(std::ceil((uMax - uMin) / (patch.u1 - patch.u0))));
+        for (const BezierPatch& patch : surface.getBezierPatches())
+            patches = glm::max(patches, static_cast<int>(std::ceil((vMax - vMin) / (patch.v1 - patch.v0))));
+        minLevel = 1;
+        while ((1 << minLevel) < patches)
+            ++minLevel;
+    }
+    minLevel = glm::min(minLevel, maxLevel);
+
+    // Split top down until every cell is flat enough on screen
+    std::vector<uint64_t> stack;
+    for (int x = 0; x < (1 << minLevel); ++x)
+        for (int y = 0; y < (1 << minLevel); ++y)
+            stack.push_back(cellKey(minLevel, x, y));
+
+    while (!stack.empty())
+    {
+        uint64_t key = stack.back();
+        stack.pop_back();
+        int level = static_cast<int>(key >> 56);
+        int x = static_cast<int>((key >> 28) & 0xFFFFFFF);
+        int y = static_cast<int>(key & 0xFFFFFFF);
+
+        if (needsSplit(level, x, y, settings))
+        {
+            for (int c = 0; c < 4; ++c)
+                stack.push_back(cellKey(level + 1, 2 * x + (c & 1), 2 * y + (c >> 1)));
+        }
+        else
+        {
+            leaves.insert(key);
+        }
+    }
+
+    balance();
+
+    vertices.clear();
+    normals.clear();
+    indices.clear();
+    std::unordered_map<uint64_t, unsigned int> vertexIndex;
+
+    auto addVertex = [&](int i, int j) -> unsigned int
+    {
+        uint64_t key = gridKey(i, j);
+        auto found = vertexIndex.find(key);
+        if (found != vertexIndex.end())
+            return found->second;
+
+        float u = uMin + (uMax - uMin) * static_cast<float>(i) / static_cast<float>(gridSize);
+        float v = vMin + (vMax - vMin) * static_cast<float>(j) / static_cast<float>(gridSize);
+        glm::vec3 point, du, dv;
+        surface.evaluateDerivatives(u, v, point, du, dv);
+        glm::vec3 normal = glm::cross(du, dv);
+        float length = glm::length(normal);
+
+        unsigned int index = static_cast<unsigned int>(vertices.size());
+        vertices.push_back(point);
+        normals.push_back(length > 0.0f ? normal / length : glm::vec3(0.0f, 0.0f, 1.0f));
+        vertexIndex[key] = index;
+        return index;
+    };
+
+    for (uint64_t key : leaves)
+    {
+        int level = static_cast<int>(key >> 56);
+        int x = static_cast<int>((key >> 28) & 0xFFFFFFF);
+        int y = static_cast<int>(key & 0xFFFFFFF);
+        int cells = 1 << level;
+        int size = gridSize >> level;
+        int half = size / 2;
+        int i0 = x * size, j0 = y * size;
+        int i1 = i0 + size, j1 = j0 + size;
+
+        // An edge gets its midpoint when the neighbour on that side is split finer
+        bool splitBottom = y > 0 && coveringLeafLevel(level, x, y - 1) < 0;
+        bool splitRight = x + 1 < cells && coveringLeafLevel(level, x + 1, y) < 0;
+        bool splitTop = y + 1 < cells && coveringLeafLevel(level, x, y + 1) < 0;
+        bool splitLeft = x > 0 && coveringLeafLevel(level, x - 1, y) < 0;
+
+        if (!splitBottom && !splitRight && !splitTop && !splitLeft)
+        {
+            // Same two triangles as the uniform grid
+            unsigned int a = addVertex(i0, j0), b = addVertex(i1, j0);
+            unsigned int c = addVertex(i0, j1), d = addVertex(i1, j1);
+            indices.insert(indices.end(), { a, b, c, c, b, d });
+            continue;
+        }
+
+        // Fan around the cell centre, going counter clockwise in (u, v)
+        unsigned int ring[8];
+        int count = 0;
+        ring[count++] = addVertex(i0, j0);
+        if (splitBottom) ring[count++] = addVertex(i0 + half, j0);
+        ring[count++] = addVertex(i1, j0);
+        if (splitRight) ring[count++] = addVertex(i1, j0 + half);
+        ring[count++] = addVertex(i1, j1);
+        if (splitTop) ring[count++] = addVertex(i0 + half, j1);
+        ring[count++] = addVertex(i0, j1);
+        if (splitLeft) ring[count++] = addVertex(i0, j0 + half);
+
+        unsigned int center = addVertex(i0 + half, j0 + half);
+        for (int k = 0; k < count; ++k)
+            indices.insert(indices.end(), { center, ring[k], ring[(k + 1) % count] });
+    }
+}
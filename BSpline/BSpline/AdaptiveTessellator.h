@@ -0,0 +1,62 @@
+#ifndef ADAPTIVETESSELLATOR_H
+#define ADAPTIVETESSELLATOR_H
+
+#include <glm/glm.hpp>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <cstdint>
+
+class BSplineSurface;
+
+struct AdaptiveTessellationSettings
+{
+    glm::mat4 projection = glm::mat4(1.0f);
+    glm::mat4 view = glm::mat4(1.0f);
+    glm::vec2 viewportSize = glm::vec2(800.0f, 800.0f);
+
+    float maxPixelError = 0.5f; // Allowed chordal deviation on screen, in pixels
+    int minLevel = -1;          // Coarsest level, -1 picks one cell per Bezier patch or finer
+    int maxLevel = 8;           // Finest level, 2^maxLevel cells along each parameter
+};
+
+// Tessellates the parameter domain with a restricted quadtree
+// A cell is split while the surface deviates too much from the flat cell on screen (cells outside
+// the view frustum are left as they are),
+// neighbours never differ by more than one level, and cells next to finer cells
+// get the edge midpoint as an extra vertex, so the mesh has no T-junctions or cracks
+class AdaptiveTessellator
+{
+public:
+    AdaptiveTessellator(const BSplineSurface& surface);
+
+    void tessellate(const AdaptiveTessellationSettings& settings,
+        std::vector<glm::vec3>& vertices, std::vector<glm::vec3>& normals, std::vector<unsigned int>& indices);
+
+private:
+    const BSplineSurface& surface;
+    float uMin, uMax, vMin, vMax;
+
+    // Integer grid coordinates are in units of half the finest cell, so cell centres are on the grid
+    int maxLevel = 8;
+    int gridSize = 512;
+
+    // Planes of the view frustum, pointing inwards; the near plane is the last one
+    glm::vec4 frustumPlanes[6];
+    void setupFrustum(const AdaptiveTessellationSettings& settings);
+
+    std::unordered_set<uint64_t> leaves;
+    std::unordered_map<uint64_t, glm::vec3> pointCache;
+
+    static uint64_t cellKey(int level, int x, int y);
+    uint64_t gridKey(int i, int j) const;
+
+    glm::vec3 pointAt(int i, int j);
+    bool needsSplit(int level, int x, int y, const AdaptiveTessellationSettings& settings);
+
+    // Level of the leaf covering the cell (level, x, y), or -1 when that area is split finer
+    int coveringLeafLevel(int level, int x, int y) const;
+    void balance();
+};
+
+#endif // !ADAPTIVETESSELLATOR_H
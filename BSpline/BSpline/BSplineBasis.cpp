@@ -0,0 +1,345 @@
+#include "BSplineBasis.h"
+#include <cstddef>
+#include <cmath>
+
+std::vector<float> clampedUniformKnots(int numControlPoints, int degree)
+{
+    std::vector<float> knots;
+    for (int i = 0; i <= degree; ++i)
+        knots.push_back(0.0f);
+    for (int i = 1; i < numControlPoints - degree; ++i)
+        knots.push_back(static_cast<float>(i));
+    for (int i = 0; i <= degree; ++i)
+        knots.push_back(static_cast<float>(numControlPoints - degree));
+    return knots;
+}
+
+template <typename Real>
+int findSpan(int n, int d, Real t, const std::vector<Real>& knots)
+{
+    // Special case for the end of the domain, otherwise the half-open interval gives no span
+    if (t >= knots[n + 1])
+        return n;
+    if (t <= knots[d])
+        return d;
+
+    // Binary search between knots[d] and knots[n + 1]
+    int low = d;
+    int high = n + 1;
+    int mid = (low + high) / 2;
+    while (t < knots[mid] || t >= knots[mid + 1])
+    {
+        if (t < knots[mid])
+            high = mid;
+        else
+            low = mid;
+        mid = (low + high) / 2;
+    }
+    return mid;
+}
+
+template <typename Real>
+void basisFunctions(int span, Real t, int d, const std::vector<Real>& knots, Real* N)
+{
+    // Cox-de Boor without recursion, every term is computed only once
+    Real left[MAX_BSPLINE_DEGREE + 1];
+    Real right[MAX_BSPLINE_DEGREE + 1];
+
+    N[0] = Real(1);
+    for (int j = 1; j <= d; ++j)
+    {
+        left[j] = t - knots[span + 1 - j];
+        right[j] = knots[span + j] - t;
+        Real saved = Real(0);
+        for (int r = 0; r < j; ++r)
+        {
+            Real temp = N[r] / (right[r + 1] + left[j - r]);
+            N[r] = saved + right[r + 1] * temp;
+            saved = left[j - r] * temp;
+        }
+        N[j] = saved;
+    }
+}
+
+template <typename Real>
+void basisFunctionDerivatives(int span, Real t, int d, int order, const std::vector<Real>& knots, Real* ders)
+{
+    const int size = d + 1;
+    Real ndu[MAX_BSPLINE_DEGREE + 1][MAX_BSPLINE_DEGREE + 1];
+    Real a[2][MAX_BSPLINE_DEGREE + 1];
+    Real left[MAX_BSPLINE_DEGREE + 1];
+    Real right[MAX_BSPLINE_DEGREE + 1];
+
+    // Basis functions and knot differences, stored in a triangular table
+    ndu[0][0] = Real(1);
+    for (int j = 1; j <= d; ++j)
+    {
+        left[j] = t - knots[span + 1 - j];
+        right[j] = knots[span + j] - t;
+        Real saved = Real(0);
+        for (int r = 0; r < j; ++r)
+        {
+            ndu[j][r] = right[r + 1] + left[j - r];
+            Real temp = ndu[r][j - 1] / ndu[j][r];
+            ndu[r][j] = saved + right[r + 1] * temp;
+            saved = left[j - r] * temp;
+        }
+        ndu[j][j] = saved;
+    }
+
+    for (int j = 0; j <= d; ++j)
+        ders[j] = ndu[j][d];
+
+    // Derivatives higher than the degree are zero
+    for (int k = d + 1; k <= order; ++k)
+        for (int j = 0; j <= d; ++j)
+            ders[k * size + j] = Real(0);
+
+    int maxOrder = order < d ? order : d;
+    for (int r = 0; r <= d; ++r)
+    {
+        int s1 = 0, s2 = 1;
+        a[0][0] = Real(1);
+        for (int k = 1; k <= maxOrder; ++k)
+        {
+            Real dd = Real(0);
+            int rk = r - k;
+            int pk = d - k;
+            if (r >= k)
+            {
+                a[s2][0] = a[s1][0] / ndu[pk + 1][rk];
+                dd = a[s2][0] * ndu[rk][pk];
+            }
+            int j1 = (rk >= -1) ? 1 : -rk;
+            int j2 = (r - 1 <= pk) ? k - 1 : d - r;
+            for (int j = j1; j <= j2; ++j)
+            {
+                a[s2][j] = (a[s1][j] - a[s1][j - 1]) / ndu[pk + 1][rk + j];
+                dd += a[s2][j] * ndu[rk + j][pk];
+            }
+            if (r <= pk)
+            {
+                a[s2][k] = -a[s1][k - 1] / ndu[pk + 1][r];
+                dd += a[s2][k] * ndu[r][pk];
+            }
+            ders[k * size + r] = dd;
+            int tmp = s1; s1 = s2; s2 = tmp;
+        }
+    }
+
+    // Multiply by d! / (d - k)!
+    Real factor = static_cast<Real>(d);
+    for (int k = 1; k <= maxOrder; ++k)
+    {
+        for (int j = 0; j <= d; ++j)
+            ders[k * size + j] *= factor;
+        factor *= static_cast<Real>(d - k);
+    }
+}
+
+template <typename Real>
+int SpanPolynomialsT<Real>::span(Real t) const
+{
+    int n = numControlPoints - 1;
+    if (uniform)
+    {
+        int k = degree + static_cast<int>((t - uniformStart) * uniformInvLength);
+        return k < degree ? degree : (k > n ? n : k);
+    }
+    return findSpan(n, degree, t, knots);
+}
+
+template <typename Real>
+void buildSpanPolynomials(int numControlPoints, int d, const std::vector<Real>& knots, SpanPolynomialsT<Real>& polynomials)
+{
+    const int size = d + 1;
+    const int n = numControlPoints - 1;
+
+    polynomials.degree = d;
+    polynomials.numControlPoints = numControlPoints;
+    polynomials.knots = knots;
+    polynomials.spanStart.assign(n + 1, Real(0));
+    polynomials.spanInvLength.assign(n + 1, Real(0));
+    polynomials.spanMatrix.assign(n + 1, -1);
+    polynomials.matrices.clear();
+
+    // Knot spacing relative to the span, the key used to share matrices between spans
+    std::vector<std::vector<Real>> keys;
+
+    Real ders[(MAX_BSPLINE_DEGREE + 1) * (MAX_BSPLINE_DEGREE + 1)];
+    Real firstLength = knots[d + 1] - knots[d];
+    bool uniform = true;
+
+    for (int k = d; k <= n; ++k)
+    {
+        Real length = knots[k + 1] - knots[k];
+        if (length <= Real(0))
+        {
+            uniform = false;
+            continue;
+        }
+        if (std::fabs(length - firstLength) > Real(1e-5) * firstLength)
+            uniform = false;
+
+        polynomials.spanStart[k] = knots[k];
+        polynomials.spanInvLength[k] = Real(1) / length;
+
+        std::vector<Real> key;
+        for (int m = k - d + 1; m <= k + d; ++m)
+            key.push_back((knots[m] - knots[k]) / length);
+
+        int found = -1;
+        for (size_t m = 0; m < keys.size() && found < 0; ++m)
+        {
+            bool same = true;
+            for (size_t e = 0; e < key.size() && same; ++e)
+                same = std::fabs(keys[m][e] - key[e]) <= Real(1e-5);
+            if (same)
+                found = static_cast<int>(m);
+        }
+
+        if (found < 0)
+        {
+            // Taylor expansion at the start of the span: c_p = N^(p)(knots[k]) * length^p / p!
+            basisFunctionDerivatives(k, knots[k], d, d, knots, ders);
+
+            std::vector<Real> matrix(size * size * size, Real(0));
+            Real scale = Real(1);
+            for (int p = 0; p <= d; ++p)
+            {
+                for (int j = 0; j <= d; ++j)
+                    matrix[j * size + p] = ders[p * size + j] * scale;
+                scale *= length / static_cast<Real>(p + 1);
+            }
+
+            // Derivative r in x: the coefficient of x^p is c_(p + r) * (p + r)! / p!
+            for (int r = 1; r <= d; ++r)
+                for (int j = 0; j <= d; ++j)
+                    for (int p = 0; p + r <= d; ++p)
+                        matrix[(r * size + j) * size + p] = matrix[((r - 1) * size + j) * size + p + 1] * static_cast<Real>(p + 1);
+
+            found = static_cast<int>(keys.size());
+            keys.push_back(key);
+            polynomials.matrices.insert(polynomials.matrices.end(), matrix.begin(), matrix.end());
+        }
+        polynomials.spanMatrix[k] = found;
+    }
+
+    polynomials.uniform = uniform;
+    polynomials.uniformStart = knots[d];
+    polynomials.uniformInvLength = uniform ? Real(1) / firstLength : Real(0);
+}
+
+template <typename Real>
+void evaluateSpanPolynomials(const SpanPolynomialsT<Real>& polynomials, int span, Real t, int order, Real* ders)
+{
+    const int d = polynomials.degree;
+    const int size = d + 1;
+    const Real* matrix = polynomials.matrix(span);
+    const Real invLength = polynomials.spanInvLength[span];
+    const Real x = (t - polynomials.spanStart[span]) * invLength;
+
+    Real scale = Real(1);
+    for (int r = 0; r <= order; ++r)
+    {
+        for (int j = 0; j <= d; ++j)
+        {
+            if (r > d)
+            {
+                ders[r * size + j] = Real(0);
+                continue;
+            }
+
+            // Horner's scheme, highest power first
+            const Real* c = &matrix[(r * size + j) * size];
+            Real value = Real(0);
+            for (int p = d - r; p >= 0; --p)
+                value = value * x + c[p];
+            ders[r * size + j] = value * scale;
+        }
+        scale *= invLength;
+    }
+}
+
+template <typename Real>
+void sampleBasis(const SpanPolynomialsT<Real>& polynomials, int order, const std::vector<Real>& params, BasisTableT<Real>& table)
+{
+    const int d = polynomials.degree;
+    const int size = d + 1;
+    const int stride = (order + 1) * size;
+    const int count = static_cast<int>(params.size());
+
+    table.degree = d;
+    table.order = order;
+    table.spans.resize(count);
+    table.values.resize(count * stride);
+
+    std::vector<Real> x(count);
+    for (int s = 0; s < count; ++s)
+    {
+        int span = polynomials.span(params[s]);
+        table.spans[s] = span;
+        x[s] = (params[s] - polynomials.spanStart[span]) * polynomials.spanInvLength[span];
+    }
+
+    std::vector<Real> acc(count);
+    int first = 0;
+    while (first < count)
+    {
+        // Samples first..last - 1 use the same coefficient matrix and the same span length
+        int span = table.spans[first];
+        int last = first + 1;
+        while (last < count && polynomials.spanMatrix[table.spans[last]] == polynomials.spanMatrix[span]
+            && polynomials.spanInvLength[table.spans[last]] == polynomials.spanInvLength[span])
+            ++last;
+
+        const Real* matrix = polynomials.matrix(span);
+        const Real* xs = &x[0];
+        Real* values = &acc[0];
+        Real scale = Real(1);
+        for (int r = 0; r <= order; ++r)
+        {
+            for (int j = 0; j <= d; ++j)
+            {
+                if (r > d)
+                {
+                    for (int s = first; s < last; ++s)
+                        table.values[s * stride + r * size + j] = Real(0);
+                    continue;
+                }
+
+                // Coefficients copied to locals, so the compiler knows they do not alias the samples
+                const Real* c = &matrix[(r * size + j) * size];
+                const Real highest = c[d - r] * scale;
+                for (int s = first; s < last; ++s)
+                    values[s] = highest;
+                for (int p = d - r - 1; p >= 0; --p)
+                {
+                    const Real coefficient = c[p] * scale;
+                    for (int s = first; s < last; ++s)
+                        values[s] = values[s] * xs[s] + coefficient;
+                }
+                for (int s = first; s < last; ++s)
+                    table.values[s * stride + r * size + j] = values[s];
+            }
+            scale *= polynomials.spanInvLength[span];
+        }
+        first = last;
+    }
+}
+
+// The evaluators are used with float (vertex data, the default) and double (georeferenced data)
+template int findSpan<float>(int, int, float, const std::vector<float>&);
+template int findSpan<double>(int, int, double, const std::vector<double>&);
+template void basisFunctions<float>(int, float, int, const std::vector<float>&, float*);
+template void basisFunctions<double>(int, double, int, const std::vector<double>&, double*);
+template void basisFunctionDerivatives<float>(int, float, int, int, const std::vector<float>&, float*);
+template void basisFunctionDerivatives<double>(int, double, int, int, const std::vector<double>&, double*);
+template struct SpanPolynomialsT<float>;
+template struct SpanPolynomialsT<double>;
+template void buildSpanPolynomials<float>(int, int, const std::vector<float>&, SpanPolynomialsT<float>&);
+template void buildSpanPolynomials<double>(int, int, const std::vector<double>&, SpanPolynomialsT<double>&);
+template void evaluateSpanPolynomials<float>(const SpanPolynomialsT<float>&, int, float, int, float*);
+template void evaluateSpanPolynomials<double>(const SpanPolynomialsT<double>&, int, double, int, double*);
+template void sampleBasis<float>(const SpanPolynomialsT<float>&, int, const std::vector<float>&, BasisTableT<float>&);
+template void sampleBasis<double>(const SpanPolynomialsT<double>&, int, const std::vector<double>&, BasisTableT<double>&);
@@ -0,0 +1,100 @@
+#ifndef BSPLINEBASIS_H
+#define BSPLINEBASIS_H
+
+#include <vector>
+
+// Highest degree supported by the basis evaluator (sizes the fixed work arrays)
+const int MAX_BSPLINE_DEGREE = 7;
+
+// Clamped knot vector with equal spacing, for numControlPoints - degree spans of length 1
+// The curve or surface starts and ends in the end points of the control net
+std::vector<float> clampedUniformKnots(int numControlPoints, int degree);
+
+// Everything below is a template on the number type Real, compiled for float and double
+// at the end of BSplineBasis.cpp. SpanPolynomials and BasisTable are the float versions
+
+// Finds the knot span containing t, so that knots[span] <= t < knots[span + 1]
+// n = number of control points - 1, d = degree
+// t at the end of the domain is put in the last span instead of giving zero
+template <typename Real>
+int findSpan(int n, int d, Real t, const std::vector<Real>& knots);
+
+// Computes the d + 1 basis functions that are non-zero in the span
+// N[k] is the basis function of control point span - d + k
+template <typename Real>
+void basisFunctions(int span, Real t, int d, const std::vector<Real>& knots, Real* N);
+
+// Same as basisFunctions, but with derivatives up to and including "order"
+// ders[k * (d + 1) + j] is the k-th derivative of basis function span - d + j
+template <typename Real>
+void basisFunctionDerivatives(int span, Real t, int d, int order, const std::vector<Real>& knots, Real* ders);
+
+// The basis functions of every knot span written as polynomials in the local
+// parameter x = (t - knots[span]) / (knots[span + 1] - knots[span]), x in [0, 1]
+// Built once, after that the basis and its derivatives are evaluated with Horner's
+// scheme and no knot-difference divisions. Spans with the same relative knot
+// spacing share one coefficient matrix, so a uniform knot vector has only a
+// few matrices (the interior ones and the clamped ends)
+template <typename Real>
+struct SpanPolynomialsT
+{
+    int degree = 0;
+    int numControlPoints = 0;
+    std::vector<Real> knots;
+
+    // Indexed by span, spanMatrix is -1 for empty spans
+    std::vector<Real> spanStart;
+    std::vector<Real> spanInvLength;
+    std::vector<int> spanMatrix;
+
+    // Per matrix (degree + 1)^3 coefficients: [derivative order][basis function][power of x]
+    std::vector<Real> matrices;
+
+    // Equal spacing in the domain, the span is then found without a search
+    bool uniform = false;
+    Real uniformStart = 0;
+    Real uniformInvLength = 0;
+
+    int span(Real t) const;
+
+    const Real* matrix(int span) const
+    {
+        int size = degree + 1;
+        return &matrices[spanMatrix[span] * size * size * size];
+    }
+};
+
+typedef SpanPolynomialsT<float> SpanPolynomials;
+
+template <typename Real>
+void buildSpanPolynomials(int numControlPoints, int d, const std::vector<Real>& knots, SpanPolynomialsT<Real>& polynomials);
+
+// Same layout as basisFunctionDerivatives: ders[k * (d + 1) + j], with k up to order
+template <typename Real>
+void evaluateSpanPolynomials(const SpanPolynomialsT<Real>& polynomials, int span, Real t, int order, Real* ders);
+
+// Basis functions for many parameter values at once (one row/column of a grid)
+// One lookup per sample instead of one recursion per control point
+template <typename Real>
+struct BasisTableT
+{
+    int degree = 0;
+    int order = 0;                  // Number of stored derivatives
+    std::vector<int> spans;         // Knot span per sample
+    std::vector<Real> values;       // (order + 1) * (degree + 1) values per sample
+
+    // The k-th derivative of the basis functions for sample s
+    const Real* derivative(int s, int k) const
+    {
+        return &values[(s * (order + 1) + k) * (degree + 1)];
+    }
+};
+
+typedef BasisTableT<float> BasisTable;
+
+// Runs of samples that share a span polynomial are evaluated together, so the
+// inner Horner loop goes over the samples with fixed coefficients and vectorizes
+template <typename Real>
+void sampleBasis(const SpanPolynomialsT<Real>& polynomials, int order, const std::vector<Real>& params, BasisTableT<Real>& table);
+
+#endif // !BSPLINEBASIS_H
@@ -0,0 +1,378 @@
+#include "BSplineCurve.h"
+#include "JobSystem.h"
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+
+// Pieces per knot span for the arc length integration
+static const int ARC_LENGTH_SEGMENTS_PER_SPAN = 8;
+
+// The table starts with 2 entries per piece and is made denser (up to the maximum)
+// until the interpolation is off by less than the tolerance times the mean piece length
+static const int ARC_LENGTH_MAX_ENTRIES_PER_SEGMENT = 16;
+static const float ARC_LENGTH_TOLERANCE = 1e-2f;
+
+// Samples per batch in evaluateMany, one basis table each
+static const int CURVE_BATCH_SIZE = 4096;
+
+// 5 point Gauss-Legendre rule on [-1, 1], exact for polynomials up to degree 9
+static const float GAUSS_NODES[5] = { 0.0f, -0.5384693101f, 0.5384693101f, -0.9061798459f, 0.9061798459f };
+static const float GAUSS_WEIGHTS[5] = { 0.5688888889f, 0.4786286705f, 0.4786286705f, 0.2369268851f, 0.2369268851f };
+
+BSplineCurve::BSplineCurve(const std::vector<glm::vec3>& controlPoints, const std::vector<float>& weights,
+    const std::vector<float>& knots, int degree)
+{
+    this->controlPoints = controlPoints;
+    if (this->controlPoints.empty())
+        this->controlPoints.push_back(glm::vec3(0.0f));
+    if (this->controlPoints.size() < 2)
+    {
+        std::cout << "Error: A curve needs at least 2 control points, got " << controlPoints.size() << std::endl;
+        this->controlPoints.push_back(this->controlPoints.back());
+    }
+    int numControlPoints = static_cast<int>(this->controlPoints.size());
+
+    bool valid = degree >= 1 && degree <= MAX_BSPLINE_DEGREE && numControlPoints > degree
+        && static_cast<int>(knots.size()) >= numControlPoints + degree + 1;
+    if (valid)
+    {
+        this->degree = degree;
+        knotVector = knots;
+    }
+    else
+    {
+        std::cout << "Error: Inconsistent knot vector or degree for " << numControlPoints << " control points. Using a uniform knot vector" << std::endl;
+        this->degree = std::max(1, std::min(std::min(degree, MAX_BSPLINE_DEGREE), numControlPoints - 1));
+        knotVector = clampedUniformKnots(numControlPoints, this->degree);
+    }
+
+    this->weights = weights;
+    if (this->weights.size() != this->controlPoints.size())
+    {
+        if (!weights.empty())
+            std::cout << "Error: Expected " << this->controlPoints.size() << " weights, got " << weights.size() << ". Using weight 1" << std::endl;
+        this->weights.assign(this->controlPoints.size(), 1.0f);
+    }
+
+    homogeneousPoints.resize(this->controlPoints.size());
+    for (size_t i = 0; i < this->controlPoints.size(); ++i)
+        homogeneousPoints[i] = glm::vec4(this->weights[i] * this->controlPoints[i], this->weights[i]);
+
+    buildSpanPolynomials(numControlPoints, this->degree, knotVector, polynomials);
+    buildArcLengthTable();
+}
+
+BSplineCurve::~BSplineCurve()
+{
+    MeshArena::shared().free(mesh);
+}
+
+void BSplineCurve::getDomain(float& tMin, float& tMax) const
+{
+    tMin = knotVector[degree];
+    tMax = knotVector[controlPoints.size()];
+}
+
+glm::vec3 BSplineCurve::evaluate(float t) const
+{
+    float N[MAX_BSPLINE_DEGREE + 1];
+    int span = polynomials.span(t);
+    evaluateSpanPolynomials(polynomials, span, t, 0, N);
+
+    glm::vec4 A(0.0f);
+    for (int k = 0; k <= degree; ++k)
+        A += N[k] * homogeneousPoints[span - degree + k];
+    return glm::vec3(A) / A.w;
+}
+
+void BSplineCurve::evaluateDerivatives(float t, glm::vec3& point, glm::vec3& d1, glm::vec3& d2) const
+{
+    float N[3 * (MAX_BSPLINE_DEGREE + 1)];
+    int span = polynomials.span(t);
+    evaluateSpanPolynomials(polynomials, span, t, 2, N);
+    const float* dN = N + degree + 1;
+    const float* ddN = N + 2 * (degree + 1);
+
+    glm::vec4 A(0.0f), At(0.0f), Att(0.0f);
+    for (int k = 0; k <= degree; ++k)
+    {
+        const glm::vec4& Pw = homogeneousPoints[span - degree + k];
+        A += N[k] * Pw;
+        At += dN[k] * Pw;
+        Att += ddN[k] * Pw;
+    }
+
+    point = glm::vec3(A) / A.w;
+    d1 = (glm::vec3(At) - At.w * point) / A.w;
+    d2 = (glm::vec3(Att) - 2.0f * At.w * d1 - Att.w * point) / A.w;
+}
+
+void BSplineCurve::evaluateRange(const float* params, int count, glm::vec3* points, glm::vec3* tangents) const
+{
+    std::vector<float> batch(params, params + count);
+    BasisTable table;
+    sampleBasis(polynomials, tangents != nullptr ? 1 : 0, batch, table);
+
+    for (int s = 0; s < count; ++s)
+    {
+        const float* N = table.derivative(s, 0);
+        const glm::vec4* Pw = &homogeneousPoints[table.spans[s] - degree];
+        glm::vec4 A(0.0f);
+        for (int k = 0; k <= degree; ++k)
+            A += N[k] * Pw[k];
+        points[s] = glm::vec3(A) / A.w;
+
+        if (tangents != nullptr)
+        {
+            const float* dN = table.derivative(s, 1);
+            glm::vec4 At(0.0f);
+            for (int k = 0; k <= degree; ++k)
+                At += dN[k] * Pw[k];
+            tangents[s] = (glm::vec3(At) - At.w * points[s]) / A.w;
+        }
+    }
+}
+
+void BSplineCurve::evaluateMany(const std::vector<float>& params, std::vector<glm::vec3>& points,
+    std::vector<glm::vec3>* tangents) const
+{
+    int count = static_cast<int>(params.size());
+    points.resize(count);
+    if (tangents != nullptr)
+        tangents->resize(count);
+    if (count == 0)
+        return;
+
+    JobSystem::shared().parallelFor(0, count, CURVE_BATCH_SIZE, [&](int first, int last)
+    {
+        evaluateRange(&params[first], last - first, &points[first],
+            tangents != nullptr ? &(*tangents)[first] : nullptr);
+    });
+}
+
+void BSplineCurve::buildArcLengthTable()
+{
+    // |C'(t)|, only the first derivative is needed here
+    auto speed = [this](float t)
+    {
+        float N[2 * (MAX_BSPLINE_DEGREE + 1)];
+        int span = polynomials.span(t);
+        evaluateSpanPolynomials(polynomials, span, t, 1, N);
+        const float* dN = N + degree + 1;
+
+        glm::vec4 A(0.0f), At(0.0f);
+        for (int k = 0; k <= degree; ++k)
+        {
+            const glm::vec4& Pw = homogeneousPoints[span - degree + k];
+            A += N[k] * Pw;
+            At += dN[k] * Pw;
+        }
+        glm::vec3 point = glm::vec3(A) / A.w;
+        return glm::length((glm::vec3(At) - At.w * point) / A.w);
+    };
+
+    // Length of the curve between a and b, Gauss-Legendre on the speed
+    auto integrate = [&speed](float a, float b)
+    {
+        float half = 0.5f * (b - a);
+        float middle = 0.5f * (a + b);
+        float sum = 0.0f;
+        for (int g = 0; g < 5; ++g)
+            sum += GAUSS_WEIGHTS[g] * speed(middle + half * GAUSS_NODES[g]);
+        return half * sum;
+    };
+
+    // Every non-empty knot span is cut into equal pieces, the speed is smooth inside a piece
+    // Lengths are summed in double, so long curves do not lose the short pieces
+    std::vector<float> segmentParams;
+    std::vector<double> segmentLengths;
+    double length = 0.0;
+    int n = static_cast<int>(controlPoints.size()) - 1;
+    for (int span = degree; span <= n; ++span)
+    {
+        float a = knotVector[span];
+        float b = knotVector[span + 1];
+        if (b <= a)
+            continue;
+        for (int i = 0; i < ARC_LENGTH_SEGMENTS_PER_SPAN; ++i)
+        {
+            float t0 = a + (b - a) * i / ARC_LENGTH_SEGMENTS_PER_SPAN;
+            float t1 = a + (b - a) * (i + 1) / ARC_LENGTH_SEGMENTS_PER_SPAN;
+            segmentParams.push_back(t0);
+            segmentLengths.push_back(length);
+            length += integrate(t0, t1);
+        }
+    }
+    float tMin, tMax;
+    getDomain(tMin, tMax);
+    segmentParams.push_back(tMax);
+    segmentLengths.push_back(length);
+    totalLength = static_cast<float>(length);
+
+    int numSegments = static_cast<int>(segmentParams.size()) - 1;
+    if (totalLength <= 0.0f || numSegments < 1)
+    {
+        // All control points in one place, every distance gives the start
+        lengthTableParams.assign(1, tMin);
+        lengthTableSlopes.assign(1, 0.0f);
+        lengthStep = 0.0f;
+        return;
+    }
+
+    // Arc length from the start to t, t in piece
+    auto lengthAt = [&](int piece, float t)
+    {
+        return segmentLengths[piece] + integrate(segmentParams[piece], t);
+    };
+
+    // Inverse table t(s) with equal steps in s, so a lookup needs no search
+    auto fillTable = [&](int numEntries)
+    {
+        lengthStep = totalLength / (numEntries - 1);
+        lengthTableParams.resize(numEntries);
+        lengthTableSlopes.resize(numEntries);
+
+        int segment = 0;
+        for (int k = 0; k < numEntries; ++k)
+        {
+            double s = std::min(static_cast<double>(k) * lengthStep, length);
+            while (segment < numSegments - 1 && segmentLengths[segment + 1] < s)
+                ++segment;
+
+            // Newton on L(t) = s inside the piece, with bisection when a step leaves the bracket
+            float lo = segmentParams[segment];
+            float hi = segmentParams[segment + 1];
+            double pieceLength = segmentLengths[segment + 1] - segmentLengths[segment];
+            float t = pieceLength > 0.0 ? lo + (hi - lo) * static_cast<float>((s - segmentLengths[segment]) / pieceLength) : lo;
+            for (int iteration = 0; iteration < 20; ++iteration)
+            {
+                double error = lengthAt(segment, t) - s;
+                if (std::fabs(error) <= 1e-6 * pieceLength)
+                    break;
+                if (error > 0.0) hi = t; else lo = t;
+
+                float v = speed(t);
+                float next = v > 0.0f ? t - static_cast<float>(error) / v : 0.5f * (lo + hi);
+                if (!(next > lo && next < hi))
+                    next = 0.5f * (lo + hi);
+                // Converged as far as a float parameter can resolve
+                bool converged = std::fabs(next - t) <= 1e-6f * std::max(1.0f, std::fabs(t));
+                t = next;
+                if (converged)
+                    break;
+            }
+
+            lengthTableParams[k] = t;
+            float v = speed(t);
+            lengthTableSlopes[k] = v > 0.0f ? 1.0f / v : 0.0f;
+        }
+        lengthTableParams.front() = tMin;
+        lengthTableParams.back() = tMax;
+    };
+
+    // Largest error of the interpolation, measured half way between the entries
+    auto interpolationError = [&]()
+    {
+        double worst = 0.0;
+        int last = static_cast<int>(lengthTableParams.size()) - 1;
+        for (int k = 0; k < last; ++k)
+        {
+            float s = (k + 0.5f) * lengthStep;
+            float t = parameterAtLength(s);
+            int piece = static_cast<int>(std::upper_bound(segmentParams.begin(), segmentParams.end(), t) - segmentParams.begin()) - 1;
+            piece = std::max(0, std::min(piece, numSegments - 1));
+            worst = std::max(worst, std::fabs(lengthAt(piece, t) - s));
+        }
+        return worst;
+    };
+
+    // Straight or gently bent paths stop at the first size, sharp turns (slow spots) need more entries
+    double tolerance = ARC_LENGTH_TOLERANCE * length / numSegments;
+    for (int entriesPerSegment = 2; ; entriesPerSegment *= 2)
+    {
+        fillTable(numSegments * entriesPerSegment + 1);
+        if (entriesPerSegment >= ARC_LENGTH_MAX_ENTRIES_PER_SEGMENT || interpolationError() <= tolerance)
+            break;
+    }
+}
+
+float BSplineCurve::parameterAtLength(float s) const
+{
+    if (lengthStep <= 0.0f)
+        return lengthTableParams[0];
+
+    int last = static_cast<int>(lengthTableParams.size()) - 1;
+    float x = s / lengthStep;
+    if (!(x > 0.0f))
+        return lengthTableParams[0];
+    if (x >= last)
+        return lengthTableParams[last];
+
+    // Cubic Hermite between the two entries, with dt/ds as the slopes
+    int i = static_cast<int>(x);
+    float f = x - i;
+    float f2 = f * f;
+    float f3 = f2 * f;
+    float t0 = lengthTableParams[i];
+    float t1 = lengthTableParams[i + 1];
+    float t = (2.0f * f3 - 3.0f * f2 + 1.0f) * t0 + (-2.0f * f3 + 3.0f * f2) * t1
+        + lengthStep * ((f3 - 2.0f * f2 + f) * lengthTableSlopes[i] + (f3 - f2) * lengthTableSlopes[i + 1]);
+
+    // t(s) only grows, a slope blowing up at a cusp must not push t out of the interval
+    return std::min(std::max(t, t0), t1);
+}
+
+glm::vec3 BSplineCurve::evaluateAtLength(float s) const
+{
+    return evaluate(parameterAtLength(s));
+}
+
+void BSplineCurve::evaluateAtLengths(const std::vector<float>& lengths, std::vector<glm::vec3>& points,
+    std::vector<glm::vec3>* tangents) const
+{
+    std::vector<float> params(lengths.size());
+    for (size_t i = 0; i < lengths.size(); ++i)
+        params[i] = parameterAtLength(lengths[i]);
+    evaluateMany(params, points, tangents);
+}
+
+void BSplineCurve::setupBuffers(int count)
+{
+    count = std::max(count, 2);
+    std::vector<float> lengths(count);
+    for (int i = 0; i < count; ++i)
+        lengths[i] = totalLength * i / (count - 1);
+
+    std::vector<glm::vec3> points;
+    evaluateAtLengths(lengths, points);
+    GLsizei vertexCount = static_cast<GLsizei>(points.size());
+
+    // A new range when the count changed, else the points are written over the old ones
+    MeshArena& arena = MeshArena::shared();
+    if (mesh.vertexCount != vertexCount)
+    {
+        arena.free(mesh);
+        mesh = arena.allocate(VertexFormat::Position, vertexCount, 0);
+    }
+    arena.uploadVertices(mesh, 0, vertexCount, points.data());
+}
+
+void BSplineCurve::DrawCurve(Shader& shaderProgram, RenderQueue& queue) const
+{
+    if (!mesh.isValid())
+        return;
+
+    // The curve lies inside the hull of its control points, their mean is near its middle
+    glm::vec3 center(0.0f);
+    for (const glm::vec3& point : controlPoints)
+        center += point;
+    center /= static_cast<float>(std::max<size_t>(controlPoints.size(), 1));
+
+    DrawPacket packet;
+    packet.program = &shaderProgram;
+    packet.vertexArray = MeshArena::shared().getVertexArray(mesh.format);
+    packet.mode = GL_LINE_STRIP;
+    packet.count = mesh.vertexCount;
+    packet.first = mesh.baseVertex;
+    queue.submit(packet, RenderPass::Opaque, center);
+}
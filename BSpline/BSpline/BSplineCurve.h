@@ -0,0 +1,80 @@
+#ifndef BSPLINECURVE_H
+#define BSPLINECURVE_H
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include <vector>
+#include "shaderClass.h"
+#include "BSplineBasis.h"
+#include "MeshArena.h"
+#include "RenderQueue.h"
+
+// Rational (NURBS) B-Spline curve, for paths such as recorded ball tracks
+// Evaluated with the same span polynomials as BSplineSurface. An arc length table
+// is built with the curve, so points can be placed by distance along the path
+// (constant speed) instead of by parameter
+class BSplineCurve
+{
+public:
+	// weights may be empty for a polynomial curve
+	BSplineCurve(const std::vector<glm::vec3>& controlPoints, const std::vector<float>& weights,
+		const std::vector<float>& knots, int degree);
+	~BSplineCurve();
+
+	glm::vec3 evaluate(float t) const;
+
+	// Point with first and second derivative, with the quotient rule for the weights
+	void evaluateDerivatives(float t, glm::vec3& point, glm::vec3& d1, glm::vec3& d2) const;
+
+	// Many parameter values at once, large batches are split over several threads
+	// tangents (first derivatives) may be null
+	void evaluateMany(const std::vector<float>& params, std::vector<glm::vec3>& points,
+		std::vector<glm::vec3>* tangents = nullptr) const;
+
+	// Valid parameter domain [tMin, tMax]
+	void getDomain(float& tMin, float& tMax) const;
+
+	float getLength() const { return totalLength; }
+
+	// Parameter at distance s from the start, s is clamped to [0, getLength()]
+	// A table lookup and a cubic interpolation, no search and no curve evaluation
+	float parameterAtLength(float s) const;
+	glm::vec3 evaluateAtLength(float s) const;
+
+	// Points at the given distances from the start, for moving along the path with constant speed
+	void evaluateAtLengths(const std::vector<float>& lengths, std::vector<glm::vec3>& points,
+		std::vector<glm::vec3>* tangents = nullptr) const;
+
+	// Uploads count points with equal spacing along the curve for DrawCurve
+	void setupBuffers(int count);
+	// Submits the line strip to the queue, the program must stay alive until it is executed
+	void DrawCurve(Shader& shaderProgram, RenderQueue& queue) const;
+
+private:
+    std::vector<glm::vec3> controlPoints;
+    std::vector<float> weights;
+
+    // Control points in homogeneous coordinates (w * P, w)
+    std::vector<glm::vec4> homogeneousPoints;
+
+    std::vector<float> knotVector;
+    int degree = 3;
+
+    SpanPolynomials polynomials;
+
+    // Parameter values at equal steps of arc length, and dt/ds at the same points
+    // Entry k is at distance k * lengthStep from the start
+    std::vector<float> lengthTableParams;
+    std::vector<float> lengthTableSlopes;
+    float lengthStep = 0.0f;
+    float totalLength = 0.0f;
+    void buildArcLengthTable();
+
+    // Evaluates params[first, first + count) with one basis table
+    void evaluateRange(const float* params, int count, glm::vec3* points, glm::vec3* tangents) const;
+
+    // The points of setupBuffers in the shared vertex buffer
+    MeshRange mesh;
+};
+
+#endif // !BSPLINECURVE_H
@@ -1,5 +1,14 @@
 #include "BSplineSurface.h"
+#include "AdaptiveTessellator.h"
+#include "JobSystem.h"
+#include "GLState.h"
 #include <iostream>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+
+UploadService* BSplineSurface::uploadService = nullptr;
 
 BSplineSurface::BSplineSurface()
 {
@@ -7,8 +16,8 @@ BSplineSurface::BSplineSurface()
     VBO = 0;
     EBO = 0;
 
-    normalVAO = 0;
-    normalVBO = 0;
+    patchVAO = 0;
+    patchVBO = 0;
 
     initControlPoints();
     generateSurface();
@@ -16,11 +25,138 @@ BSplineSurface::BSplineSurface()
     setupBuffers();
 }
 
+BSplineSurface::BSplineSurface(const std::vector<glm::vec3>& controlPoints, const std::vector<float>& weights,
+    int numControlPointsU, int numControlPointsV,
+    const std::vector<float>& knotsU, const std::vector<float>& knotsV,
+    int degreeU, int degreeV)
+{
+    VAO = 0;
+    VBO = 0;
+    EBO = 0;
+
+    patchVAO = 0;
+    patchVBO = 0;
+
+    initControlNet(controlPoints, weights, numControlPointsU, numControlPointsV, knotsU, knotsV, degreeU, degreeV);
+
+    generateSurface();
+    calculateNormals();
+    setupBuffers();
+}
+
+BSplineSurface::BSplineSurface(const std::vector<glm::dvec3>& worldControlPoints, const std::vector<float>& weights,
+    int numControlPointsU, int numControlPointsV,
+    const std::vector<float>& knotsU, const std::vector<float>& knotsV,
+    int degreeU, int degreeV)
+{
+    VAO = 0;
+    VBO = 0;
+    EBO = 0;
+
+    patchVAO = 0;
+    patchVBO = 0;
+
+    // The middle of the bounding box as origin, the local coordinates are then as small as they can be
+    glm::dvec3 boundsMin(DBL_MAX), boundsMax(-DBL_MAX);
+    for (const glm::dvec3& point : worldControlPoints)
+    {
+        boundsMin = glm::min(boundsMin, point);
+        boundsMax = glm::max(boundsMax, point);
+    }
+    origin = worldControlPoints.empty() ? glm::dvec3(0.0) : 0.5 * (boundsMin + boundsMax);
+
+    std::vector<glm::vec3> localPoints(worldControlPoints.size());
+    for (size_t i = 0; i < worldControlPoints.size(); ++i)
+        localPoints[i] = glm::vec3(worldControlPoints[i] - origin);
+
+    if (initControlNet(localPoints, weights, numControlPointsU, numControlPointsV, knotsU, knotsV, degreeU, degreeV))
+    {
+        this->worldControlPoints = worldControlPoints;
+        preciseEvaluator.setup(worldControlPoints, this->weights, numControlPointsU, numControlPointsV,
+            knotVectorU, knotVectorV, d_u, d_v, origin);
+    }
+    else
+    {
+        origin = glm::dvec3(0.0);
+    }
+
+    generateSurface();
+    calculateNormals();
+    setupBuffers();
+}
+
+// Enough knots, none smaller than the one before, and a domain that is not empty; otherwise the span
+// search fails
+static bool isValidKnotVector(const std::vector<float>& knots, int numControlPoints, int degree)
+{
+    return static_cast<int>(knots.size()) >= numControlPoints + degree + 1
+        && std::is_sorted(knots.begin(), knots.end())
+        && knots[degree] < knots[numControlPoints];
+}
+
+bool BSplineSurface::initControlNet(const std::vector<glm::vec3>& controlPoints, const std::vector<float>& weights,
+    int numControlPointsU, int numControlPointsV,
+    const std::vector<float>& knotsU, const std::vector<float>& knotsV,
+    int degreeU, int degreeV)
+{
+    bool valid = numControlPointsU * numControlPointsV == static_cast<int>(controlPoints.size())
+        && degreeU >= 1 && degreeU <= MAX_BSPLINE_DEGREE && degreeV >= 1 && degreeV <= MAX_BSPLINE_DEGREE
+        && numControlPointsU > degreeU && numControlPointsV > degreeV
+        && isValidKnotVector(knotsU, numControlPointsU, degreeU)
+        && isValidKnotVector(knotsV, numControlPointsV, degreeV)
+        // A weight of zero or below puts the homogeneous w at zero or below, and the division by it
+        // fills the mesh and the normals with NaN
+        && std::all_of(weights.begin(), weights.end(), [](float weight) { return weight > 0.0f; });
+
+    if (valid)
+    {
+        this->controlPoints = controlPoints;
+        this->weights = weights;
+        this->numControlPointsU = numControlPointsU;
+        this->numControlPointsV = numControlPointsV;
+        knotVectorU = knotsU;
+        knotVectorV = knotsV;
+        d_u = degreeU;
+        d_v = degreeV;
+
+        if (this->weights.size() != controlPoints.size())
+        {
+            if (!weights.empty())
+                std::cout << "Error: Expected " << controlPoints.size() << " weights, got " << weights.size() << ". Using weight 1" << std::endl;
+            this->weights.assign(controlPoints.size(), 1.0f);
+        }
+        updateHomogeneousPoints();
+    }
+    else
+    {
+        std::cout << "Error: Inconsistent control net, knot vectors, degrees or weights. Using the default surface" << std::endl;
+        initControlPoints();
+    }
+    return valid;
+}
+
 BSplineSurface::~BSplineSurface()
 {
-    glDeleteVertexArrays(1, &VAO);
-    glDeleteBuffers(1, &VBO);
-    glDeleteBuffers(1, &EBO);
+    // The upload thread may still read the vertices, they must not go before it is done
+    UploadService::discard(vertexUpload);
+    UploadService::discard(indexUpload);
+
+    if (VAO != 0)
+    {
+        GLState::deleteVertexArrays(1, &VAO);
+        GLState::deleteBuffers(1, &VBO);
+        GLState::deleteBuffers(1, &EBO);
+    }
+
+    if (patchVAO != 0)
+    {
+        GLState::deleteVertexArrays(1, &patchVAO);
+        GLState::deleteBuffers(1, &patchVBO);
+    }
+
+    MeshArena::shared().free(analyticMesh);
+    if (patchTexture != 0)
+        GLState::deleteTextures(1, &patchTexture);
 }
 
 
@@ -34,220 +170,1327 @@ void BSplineSurface::initControlPoints()
       glm::vec3(1, 1, 2), glm::vec3(2, 1, 2), glm::vec3(3, 1, 0),
       glm::vec3(1, 2, 0), glm::vec3(2, 2, 0), glm::vec3(3, 2, 0)
     };
+    numControlPointsU = 3;
+    numControlPointsV = 3;
+
+    // Vanlig B-Spline, alle vektene er 1
+    weights.assign(controlPoints.size(), 1.0f);
+    updateHomogeneousPoints();
 }
 
-void BSplineSurface::generateSurface()
+void BSplineSurface::updateHomogeneousPoints()
 {
-    float step = 0.03f;
+    homogeneousPoints.resize(controlPoints.size());
+    for (size_t i = 0; i < controlPoints.size(); ++i)
+    {
+        homogeneousPoints[i] = glm::vec4(weights[i] * controlPoints[i], weights[i]);
+    }
+}
 
-    // Antall kontrollpunkter
-    int numControlPointsU = 3; 
-    int numControlPointsV = 3;
+void BSplineSurface::getDomain(float& uMin, float& uMax, float& vMin, float& vMax) const
+{
+    // The valid domain is [knots[d], knots[n + 1]] in each direction
+    uMin = knotVectorU[d_u];
+    uMax = knotVectorU[numControlPointsU];
+    vMin = knotVectorV[d_v];
+    vMax = knotVectorV[numControlPointsV];
+}
 
-    for (float u = 0.0f; u <= 1.0f; u += step)
+void BSplineSurface::sampleParameters(std::vector<float>& us, std::vector<float>& vs) const
+{
+    int numU = static_cast<int>(1.0f / tessellationStep) + 1;
+    int numV = static_cast<int>(1.0f / tessellationStep) + 1;
+
+    float uMin, uMax, vMin, vMax;
+    getDomain(uMin, uMax, vMin, vMax);
+
+    us.resize(numU);
+    vs.resize(numV);
+    for (int i = 0; i < numU; ++i)
+        us[i] = uMin + (uMax - uMin) * static_cast<float>(i) / static_cast<float>(numU - 1);
+    for (int j = 0; j < numV; ++j)
+        vs[j] = vMin + (vMax - vMin) * static_cast<float>(j) / static_cast<float>(numV - 1);
+}
+
+// Bernstein polynomials of degree d at t, and their derivatives if dB is not null
+static void bernstein(int d, float t, float* B, float* dB)
+{
+    // de Casteljau's triangle, stopping at degree d - 1 first when derivatives are needed
+    int last = dB ? d - 1 : d;
+    B[0] = 1.0f;
+    for (int j = 1; j <= last; ++j)
+    {
+        float saved = 0.0f;
+        for (int r = 0; r < j; ++r)
+        {
+            float temp = B[r];
+            B[r] = saved + (1.0f - t) * temp;
+            saved = t * temp;
+        }
+        B[j] = saved;
+    }
+
+    if (dB)
     {
-        for (float v = 0.0f; v <= 1.0f; v += step)
+        // B'_i,d = d * (B_i-1,d-1 - B_i,d-1)
+        for (int i = 0; i <= d; ++i)
+        {
+            float prev = i > 0 ? B[i - 1] : 0.0f;
+            float curr = i < d ? B[i] : 0.0f;
+            dB[i] = d * (prev - curr);
+        }
+
+        // Raise the values to degree d
+        float saved = 0.0f;
+        for (int r = 0; r < d; ++r)
+        {
+            float temp = B[r];
+            B[r] = saved + (1.0f - t) * temp;
+            saved = t * temp;
+        }
+        B[d] = saved;
+    }
+}
+
+// For each parameter, the patch segment it lies in and its Bernstein values (and derivatives)
+// The derivatives are scaled with the segment length so they are with respect to the surface parameter
+static void sampleBernstein(const std::vector<float>& params, const std::vector<float>& segmentStarts,
+    const std::vector<float>& segmentEnds, int d, bool derivatives,
+    std::vector<int>& segments, std::vector<float>& values)
+{
+    int stride = (derivatives ? 2 : 1) * (d + 1);
+    segments.resize(params.size());
+    values.resize(params.size() * stride);
+
+    int segment = 0;
+    for (size_t s = 0; s < params.size(); ++s)
+    {
+        // Parameters come sorted, so the segment index only moves forward
+        while (segment + 1 < static_cast<int>(segmentStarts.size()) && params[s] >= segmentStarts[segment + 1])
+            ++segment;
+        segments[s] = segment;
+
+        float length = segmentEnds[segment] - segmentStarts[segment];
+        float t = (params[s] - segmentStarts[segment]) / length;
+        float* B = &values[s * stride];
+        bernstein(d, t, B, derivatives ? B + d + 1 : nullptr);
+        if (derivatives)
+            for (int i = 0; i <= d; ++i)
+                B[d + 1 + i] /= length;
+    }
+}
+
+void BSplineSurface::evaluateGrid(const std::vector<float>& us, const std::vector<float>& vs,
+    std::vector<glm::vec3>* points, std::vector<glm::vec3>* normals) const
+{
+    if (points) points->resize(us.size() * vs.size());
+    if (normals) normals->resize(us.size() * vs.size());
+
+    std::vector<float> startsU(numPatchesU), endsU(numPatchesU), startsV(numPatchesV), endsV(numPatchesV);
+    for (int pu = 0; pu < numPatchesU; ++pu)
+    {
+        startsU[pu] = bezierPatches[pu * numPatchesV].u0;
+        endsU[pu] = bezierPatches[pu * numPatchesV].u1;
+    }
+    for (int pv = 0; pv < numPatchesV; ++pv)
+    {
+        startsV[pv] = bezierPatches[pv].v0;
+        endsV[pv] = bezierPatches[pv].v1;
+    }
+
+    // Bernstein values once per row and column of the grid
+    bool derivatives = normals != nullptr;
+    std::vector<int> segmentU, segmentV;
+    std::vector<float> bernsteinU, bernsteinV;
+    sampleBernstein(us, startsU, endsU, d_u, derivatives, segmentU, bernsteinU);
+    sampleBernstein(vs, startsV, endsV, d_v, derivatives, segmentV, bernsteinV);
+    const int strideU = (derivatives ? 2 : 1) * (d_u + 1);
+    const int strideV = (derivatives ? 2 : 1) * (d_v + 1);
+
+    // Every patch writes only the grid samples inside it, so the patches can run at the same time
+    auto tessellatePatch = [&](int patchIndex)
+    {
+        const BezierPatch& patch = bezierPatches[patchIndex];
+        int pu = patchIndex / numPatchesV;
+        int pv = patchIndex % numPatchesV;
+
+        glm::vec4 row[MAX_BSPLINE_DEGREE + 1];
+        glm::vec4 rowDu[MAX_BSPLINE_DEGREE + 1];
+
+        for (size_t a = 0; a < us.size(); ++a)
         {
-            glm::vec3 point(0.0f); // Startspunkt for hver surface punkt
+            if (segmentU[a] != pu)
+                continue;
 
-            // G igjennom alle kontrollpunktene i U og V-retning
-            for (int i = 0; i < numControlPointsU; ++i)  // Iterer over U-retningen
+            // Contract the patch in u once per row of samples
+            const float* Bu = &bernsteinU[a * strideU];
+            const float* dBu = Bu + d_u + 1;
+            for (int j = 0; j <= d_v; ++j)
             {
-                for (int j = 0; j < numControlPointsV; ++j)  // Iterer over V-retningen
+                glm::vec4 sum(0.0f), sumDu(0.0f);
+                for (int i = 0; i <= d_u; ++i)
                 {
-                    float Bu = N(i, d_u, u, knotVectorU);  // Bu er basisfunksjon i U-retning
-                    float Bv = N(j, d_v, v, knotVectorV);  // Bv er basisfunksjon i V-retning
+                    const glm::vec4& Pw = patch.points[i * (d_v + 1) + j];
+                    sum += Bu[i] * Pw;
+                    if (derivatives) sumDu += dBu[i] * Pw;
+                }
+                row[j] = sum;
+                rowDu[j] = sumDu;
+            }
+
+            for (size_t b = 0; b < vs.size(); ++b)
+            {
+                if (segmentV[b] != pv)
+                    continue;
+
+                const float* Bv = &bernsteinV[b * strideV];
+                glm::vec4 A(0.0f);
+                for (int j = 0; j <= d_v; ++j)
+                    A += Bv[j] * row[j];
+
+                // Homogeneous division, w = 1 for polynomial surfaces
+                glm::vec3 point = glm::vec3(A) / A.w;
+                if (points)
+                    (*points)[a * vs.size() + b] = point;
+
+                if (normals)
+                {
+                    const float* dBv = Bv + d_v + 1;
+                    glm::vec4 Au(0.0f), Av(0.0f);
+                    for (int j = 0; j <= d_v; ++j)
+                    {
+                        Au += Bv[j] * rowDu[j];
+                        Av += dBv[j] * row[j];
+                    }
+
+                    // Rational derivative: S' = (A' - w' * S) / w
+                    glm::vec3 du = (glm::vec3(Au) - Au.w * point) / A.w;
+                    glm::vec3 dv = (glm::vec3(Av) - Av.w * point) / A.w;
+                    glm::vec3 normal = glm::cross(du, dv);
+                    float length = glm::length(normal);
+                    (*normals)[a * vs.size() + b] = length > 0.0f ? normal / length : glm::vec3(0.0f, 0.0f, 1.0f);
+                }
+            }
+        }
+    };
+
+    // Patches are independent, each one is enough work for a job
+    JobSystem::shared().parallelFor(0, static_cast<int>(bezierPatches.size()), 1, [&](int first, int last)
+    {
+        for (int p = first; p < last; ++p)
+            tessellatePatch(p);
+    });
+}
+
+// Inserts all knots of X (sorted) in the U direction of the net in one pass
+// Knot refinement, The NURBS Book algorithm A5.4, done for every column of the net at once
+// The net has numU rows of numV homogeneous points
+static void refineKnotsU(std::vector<float>& knots, int d, const std::vector<float>& X, std::vector<glm::vec4>& net, int& numU, int numV)
+{
+    if (X.empty())
+        return;
+
+    const int n = numU - 1;
+    const int m = n + d + 1;
+    const int r = static_cast<int>(X.size()) - 1;
+    const int a = findSpan(n, d, X[0], knots);
+    const int b = findSpan(n, d, X[r], knots) + 1;
+
+    std::vector<float> refinedKnots(m + r + 2);
+    std::vector<glm::vec4> refined((numU + r + 1) * numV);
+
+    for (int j = 0; j <= a - d; ++j)
+        for (int c = 0; c < numV; ++c)
+            refined[j * numV + c] = net[j * numV + c];
+    for (int j = b - 1; j <= n; ++j)
+        for (int c = 0; c < numV; ++c)
+            refined[(j + r + 1) * numV + c] = net[j * numV + c];
+    for (int j = 0; j <= a; ++j)
+        refinedKnots[j] = knots[j];
+    for (int j = b + d; j <= m; ++j)
+        refinedKnots[j + r + 1] = knots[j];
+
+    int i = b + d - 1;
+    int k = b + d + r;
+    for (int j = r; j >= 0; --j)
+    {
+        while (X[j] <= knots[i] && i > a)
+        {
+            for (int c = 0; c < numV; ++c)
+                refined[(k - d - 1) * numV + c] = net[(i - d - 1) * numV + c];
+            refinedKnots[k] = knots[i];
+            --k;
+            --i;
+        }
+        for (int c = 0; c < numV; ++c)
+            refined[(k - d - 1) * numV + c] = refined[(k - d) * numV + c];
+        for (int l = 1; l <= d; ++l)
+        {
+            int index = k - d + l;
+            float alpha = refinedKnots[k + l] - X[j];
+            if (alpha == 0.0f)
+            {
+                for (int c = 0; c < numV; ++c)
+                    refined[(index - 1) * numV + c] = refined[index * numV + c];
+            }
+            else
+            {
+                alpha /= refinedKnots[k + l] - knots[i - d + l];
+                for (int c = 0; c < numV; ++c)
+                    refined[(index - 1) * numV + c] = alpha * refined[(index - 1) * numV + c] + (1.0f - alpha) * refined[index * numV + c];
+            }
+        }
+        refinedKnots[k] = X[j];
+        --k;
+    }
+
+    knots.swap(refinedKnots);
+    net.swap(refined);
+    numU += r + 1;
+}
+
+// Raises every knot inside the domain to multiplicity d, so each span becomes a Bezier segment
+static void refineToBezier(std::vector<float>& knots, int d, std::vector<glm::vec4>& net, int& numU, int numV)
+{
+    // Only the first n + d + 1 knots are used by the basis functions
+    knots.resize(numU + d + 1);
+
+    std::vector<float> domainKnots;
+    for (int i = d; i <= numU; ++i)
+        if (domainKnots.empty() || knots[i] != domainKnots.back())
+            domainKnots.push_back(knots[i]);
+
+    // All insertions at once, one at a time would copy the whole net for every knot
+    std::vector<float> insertions;
+    for (float t : domainKnots)
+    {
+        int multiplicity = static_cast<int>(std::count(knots.begin(), knots.end(), t));
+        for (int m = multiplicity; m < d && t < knots.back(); ++m)
+            insertions.push_back(t);
+    }
+    refineKnotsU(knots, d, insertions, net, numU, numV);
+}
+
+static std::vector<glm::vec4> transposeNet(const std::vector<glm::vec4>& net, int numU, int numV)
+{
+    std::vector<glm::vec4> transposed(net.size());
+    for (int i = 0; i < numU; ++i)
+        for (int j = 0; j < numV; ++j)
+            transposed[j * numU + i] = net[i * numV + j];
+    return transposed;
+}
+
+void BSplineSurface::extractBezierPatches()
+{
+    std::vector<glm::vec4> net = homogeneousPoints;
+    std::vector<float> knotsU = knotVectorU;
+    std::vector<float> knotsV = knotVectorV;
+    int numU = numControlPointsU;
+    int numV = numControlPointsV;
+
+    // Knot insertion in U on all columns, then in V on all rows
+    refineToBezier(knotsU, d_u, net, numU, numV);
+    net = transposeNet(net, numU, numV);
+    refineToBezier(knotsV, d_v, net, numV, numU);
+    net = transposeNet(net, numV, numU);
+
+    // Last knot index of every non-empty span in the domain
+    std::vector<int> spansU, spansV;
+    for (int k = d_u; k < numU; ++k)
+        if (knotsU[k] < knotsU[k + 1])
+            spansU.push_back(k);
+    for (int k = d_v; k < numV; ++k)
+        if (knotsV[k] < knotsV[k + 1])
+            spansV.push_back(k);
+
+    numPatchesU = static_cast<int>(spansU.size());
+    numPatchesV = static_cast<int>(spansV.size());
+    bezierPatches.clear();
+    bezierPatches.reserve(spansU.size() * spansV.size());
 
-                    // Beregne et punkt p surface ved  bruke en vektet sum av alle kontrollpunktene
-                    //  controlPoints[i * numControlPointsV + j] dette henter kontrollpunktet p posisjon i og j
-                    point += Bu * Bv * controlPoints[i * numControlPointsV + j];
+    for (int ku : spansU)
+    {
+        for (int kv : spansV)
+        {
+            BezierPatch patch;
+            patch.degreeU = d_u;
+            patch.degreeV = d_v;
+            patch.u0 = knotsU[ku];
+            patch.u1 = knotsU[ku + 1];
+            patch.v0 = knotsV[kv];
+            patch.v1 = knotsV[kv + 1];
+            patch.boundsMin = glm::vec3(FLT_MAX);
+            patch.boundsMax = glm::vec3(-FLT_MAX);
+
+            for (int i = 0; i <= d_u; ++i)
+            {
+                for (int j = 0; j <= d_v; ++j)
+                {
+                    const glm::vec4& Pw = net[(ku - d_u + i) * numV + (kv - d_v + j)];
+                    patch.points.push_back(Pw);
+                    glm::vec3 P = glm::vec3(Pw) / Pw.w;
+                    patch.boundsMin = glm::min(patch.boundsMin, P);
+                    patch.boundsMax = glm::max(patch.boundsMax, P);
                 }
             }
-            surfaceVertices.push_back(point);
+            bezierPatches.push_back(patch);
         }
     }
+}
+
+void BSplineSurface::generateSurface()
+{
+    // Span polynomials and Bezier form once, every evaluation after this works on them
+    buildSpanPolynomials(numControlPointsU, d_u, knotVectorU, polynomialsU);
+    buildSpanPolynomials(numControlPointsV, d_v, knotVectorV, polynomialsV);
+    extractBezierPatches();
+    buildProjectionSeeds();
+
+    // A surface tessellated in an earlier run is read from the cache file instead
+    tessellationKey = computeTessellationKey();
+    if (tessellationCache.load(tessellationKey))
+    {
+        surfaceVertices.assign(tessellationCache.vertices(), tessellationCache.vertices() + tessellationCache.vertexCount());
+        surfaceNormals.assign(tessellationCache.normals(), tessellationCache.normals() + tessellationCache.vertexCount());
+        surfaceIndices.assign(tessellationCache.indices(), tessellationCache.indices() + tessellationCache.indexCount());
+        return;
+    }
+
+    std::vector<float> us, vs;
+    sampleParameters(us, vs);
 
-    // Genererer indekser for  lage triangler p surface
-    int numU = static_cast<int>(1.0f / step) + 1;
-    int numV = static_cast<int>(1.0f / step) + 1;
+    // Alle punktene på surface, regnet ut patch for patch
+    surfaceVertices.clear();
+    if (isGeoreferenced())
+        preciseEvaluator.evaluateGrid(std::vector<double>(us.begin(), us.end()), std::vector<double>(vs.begin(), vs.end()), &surfaceVertices, nullptr);
+    else
+        evaluateGrid(us, vs, &surfaceVertices, nullptr);
 
-    for (int i = 0; i < numV - 1; ++i) {
-        for (int j = 0; j < numU - 1; ++j) 
+    // Genererer indekser for å lage triangler på surface
+    int numU = static_cast<int>(us.size());
+    int numV = static_cast<int>(vs.size());
+
+    surfaceIndices.clear();
+    for (int i = 0; i < numU - 1; ++i) {
+        for (int j = 0; j < numV - 1; ++j)
         {
-            // Lager to trekanter for hvert firkantet omrde i gridet p surface
+            // Lager to trekanter for hvert firkantet område i gridet på surface
             // surfaceIndices lagrer indekser som peker til punktene i surfaceVertices
-            surfaceIndices.push_back(i * numU + j);
-            surfaceIndices.push_back((i + 1) * numU + j);
-            surfaceIndices.push_back(i * numU + (j + 1));
+            surfaceIndices.push_back(i * numV + j);
+            surfaceIndices.push_back((i + 1) * numV + j);
+            surfaceIndices.push_back(i * numV + (j + 1));
 
-            surfaceIndices.push_back(i * numU + (j + 1));
-            surfaceIndices.push_back((i + 1) * numU + j);
-            surfaceIndices.push_back((i + 1) * numU + (j + 1));
+            surfaceIndices.push_back(i * numV + (j + 1));
+            surfaceIndices.push_back((i + 1) * numV + j);
+            surfaceIndices.push_back((i + 1) * numV + (j + 1));
         }
     }
 }
 
+uint64_t BSplineSurface::computeTessellationKey() const
+{
+    int sizes[4] = { numControlPointsU, numControlPointsV, d_u, d_v };
+    uint64_t key = hashBytes(sizes, sizeof(sizes));
+    key = hashVector(controlPoints, key);
+    key = hashVector(weights, key);
+    key = hashVector(knotVectorU, key);
+    key = hashVector(knotVectorV, key);
+    key = hashVector(worldControlPoints, key);
+    key = hashBytes(&origin, sizeof(origin), key);
+    return hashBytes(&tessellationStep, sizeof(tessellationStep), key);
+}
+
 void BSplineSurface::setupBuffers()
 {
+    // Without an OpenGL context (headless simulation) the surface is only evaluated, nothing is drawn
+    if (!GLAD_GL_VERSION_3_3)
+    {
+        tessellationCache.release();
+        return;
+    }
+
     glGenVertexArrays(1, &VAO);
+
+    if (uploadService != nullptr)
+    {
+        // The vertices are already copied out of the cache file, the mapping is not needed
+        tessellationCache.release();
+
+        UploadSource positions, normals, indices;
+        positions.data = surfaceVertices.data();
+        positions.size = surfaceVertices.size() * sizeof(glm::vec3);
+        normals.data = surfaceNormals.data();
+        normals.size = surfaceNormals.size() * sizeof(glm::vec3);
+        vertexUpload = uploadService->uploadBuffer({ positions, normals });
+        indexUpload = uploadService->uploadBuffer(surfaceIndices.data(), surfaceIndices.size() * sizeof(unsigned int));
+
+        setupPatchBuffers();
+        return;
+    }
+
     glGenBuffers(1, &VBO);
     glGenBuffers(1, &EBO);
 
-    glBindVertexArray(VAO);
+    GLState::bindVertexArray(VAO);
+
+    // From the mapped cache file when the tessellation was loaded, no copy in between
+    bool cached = tessellationCache.vertices() != nullptr;
+    const void* indexData = cached ? static_cast<const void*>(tessellationCache.indices()) : surfaceIndices.data();
+
+    uploadVertexBuffer(cached ? tessellationCache.vertices() : nullptr);
+
+    GLState::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, surfaceIndices.size() * sizeof(unsigned int), indexData, GL_STATIC_DRAW);
+    tessellationCache.release();
+
+    GLState::bindVertexArray(0);
+
+    setupPatchBuffers();
+}
+
+void BSplineSurface::setUploadService(UploadService* service)
+{
+    uploadService = service;
+}
+
+bool BSplineSurface::finishUpload()
+{
+    if (!vertexUpload && !indexUpload)
+        return hasMesh();
+
+    if (!UploadService::isReady(vertexUpload) || !UploadService::isReady(indexUpload))
+        return false;
+
+    VBO = UploadService::getBuffer(vertexUpload);
+    EBO = UploadService::getBuffer(indexUpload);
+    vertexUpload.reset();
+    indexUpload.reset();
+    if (VBO == 0 || EBO == 0)
+    {
+        std::cout << "Error: Upload of the surface mesh failed" << std::endl;
+        GLState::deleteBuffers(1, &VBO);
+        GLState::deleteBuffers(1, &EBO);
+        VBO = 0;
+        EBO = 0;
+        return false;
+    }
+
+    // Binding the buffers here is what makes the data from the upload context visible in this one
+    GLState::bindVertexArray(VAO);
+    GLState::bindBuffer(GL_ARRAY_BUFFER, VBO);
+    setVertexAttributes();
+    GLState::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+    GLState::bindVertexArray(0);
+    return true;
+}
+
+void BSplineSurface::updateBuffers()
+{
+    // The new mesh replaces the one on its way, which has to arrive first to have buffers to fill
+    UploadService::wait(vertexUpload);
+    UploadService::wait(indexUpload);
+    if (!finishUpload())
+        return;
+
+    GLState::bindVertexArray(VAO);
+
+    uploadVertexBuffer(nullptr);
+
+    GLState::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, surfaceIndices.size() * sizeof(unsigned int), surfaceIndices.data(), GL_STATIC_DRAW);
+
+    GLState::bindVertexArray(0);
+}
 
-    glBindBuffer(GL_ARRAY_BUFFER, VBO);
-    glBufferData(GL_ARRAY_BUFFER, surfaceVertices.size() * sizeof(glm::vec3), &surfaceVertices[0], GL_STATIC_DRAW);
+void BSplineSurface::uploadVertexBuffer(const void* cachedData)
+{
+    GLsizeiptr blockSize = surfaceVertices.size() * sizeof(glm::vec3);
 
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, surfaceIndices.size() * sizeof(unsigned int), &surfaceIndices[0], GL_STATIC_DRAW);
+    GLState::bindBuffer(GL_ARRAY_BUFFER, VBO);
+    if (cachedData != nullptr)
+    {
+        // The cache file stores the normals right after the positions, the same layout as the buffer
+        glBufferData(GL_ARRAY_BUFFER, 2 * blockSize, cachedData, GL_STATIC_DRAW);
+    }
+    else
+    {
+        glBufferData(GL_ARRAY_BUFFER, 2 * blockSize, nullptr, GL_STATIC_DRAW);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, blockSize, surfaceVertices.data());
+        glBufferSubData(GL_ARRAY_BUFFER, blockSize, blockSize, surfaceNormals.data());
+    }
+
+    setVertexAttributes();
+}
+
+void BSplineSurface::setVertexAttributes()
+{
+    GLsizeiptr blockSize = surfaceVertices.size() * sizeof(glm::vec3);
 
     // Position attribute
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
     glEnableVertexAttribArray(0);
 
-    glBindVertexArray(0);
+    // Normal attribute
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)blockSize);
+    glEnableVertexAttribArray(1);
 }
 
-float BSplineSurface::N(int i, int d, float t, const std::vector<float>& knots) const
+void BSplineSurface::tessellateAdaptive(const glm::mat4& projection, const glm::mat4& view, const glm::vec2& viewportSize, float maxPixelError)
 {
-    // Beregner basisfunksjonen for B-spline
-    // N(i, d, t)
-    if (d == 0)  // Grad 0
-    {
-        // Sjekker om kontrollpunktene har noe innflytelse eller ikke
-        // Returnerer funksjonen 1 s er t mellom  knots[i] og knots[i + 1], s betyr det at kontrollpunktet har innflytelse p kurven
-        // hvis ikke t er i omrdet vil det returneres 0, alts kontrollpunktene har ikke innflytelse
-        return (t >= knots[i] && t < knots[i + 1]) ? 1.0f : 0.0f;
-    }
+    AdaptiveTessellationSettings settings;
+    settings.projection = projection;
+    settings.view = view;
+    settings.viewportSize = viewportSize;
+    settings.maxPixelError = maxPixelError;
+
+    AdaptiveTessellator tessellator(*this);
+    tessellator.tessellate(settings, surfaceVertices, surfaceNormals, surfaceIndices);
 
-    // Beregne vektene for kontrollpunktet under
-    float term1 = 0.0f, term2 = 0.0f;
-    // Beregner fste del
-    if ((i + d < knots.size()) && (knots[i + d] - knots[i]) != 0) 
+    updateBuffers();
+}
+
+// Degree elevation of a Bezier curve given by count points with the given stride
+// The curve keeps its shape, it just gets one more control point
+static void elevateDegree(const glm::vec4* points, int count, int stride, glm::vec4* elevated, int elevatedStride)
+{
+    int d = count - 1;
+    elevated[0] = points[0];
+    for (int i = 1; i <= d; ++i)
     {
-        term1 = (t - knots[i]) / (knots[i + d] - knots[i]) * N(i, d - 1, t, knots);
+        float alpha = static_cast<float>(i) / static_cast<float>(d + 1);
+        elevated[i * elevatedStride] = alpha * points[(i - 1) * stride] + (1.0f - alpha) * points[i * stride];
     }
-    // Beregner andre del
-    if ((i + d + 1 < knots.size()) && (knots[i + d + 1] - knots[i + 1]) != 0) 
+    elevated[(d + 1) * elevatedStride] = points[d * stride];
+}
+
+void BSplineSurface::setupPatchBuffers()
+{
+    // The tessellation shaders work on bicubic patches only
+    if (d_u > 3 || d_v > 3)
+        return;
+
+    std::vector<glm::vec4> patchPoints;
+    patchPoints.reserve(bezierPatches.size() * 16);
+
+    for (const BezierPatch& patch : bezierPatches)
     {
-        term2 = (knots[i + d + 1] - t) / (knots[i + d + 1] - knots[i + 1]) * N(i + 1, d - 1, t, knots);
+        // Raise the degree in u for every column, then in v for every row
+        glm::vec4 net[4 * 4];
+        glm::vec4 temp[4 * 4];
+        for (int i = 0; i <= d_u; ++i)
+            for (int j = 0; j <= d_v; ++j)
+                net[i * 4 + j] = patch.points[i * (d_v + 1) + j];
+
+        for (int du = d_u; du < 3; ++du)
+        {
+            for (int j = 0; j <= d_v; ++j)
+                elevateDegree(&net[j], du + 1, 4, &temp[j], 4);
+            std::copy(temp, temp + 16, net);
+        }
+        for (int dv = d_v; dv < 3; ++dv)
+        {
+            for (int i = 0; i < 4; ++i)
+                elevateDegree(&net[i * 4], dv + 1, 1, &temp[i * 4], 1);
+            std::copy(temp, temp + 16, net);
+        }
+
+        patchPoints.insert(patchPoints.end(), net, net + 16);
     }
 
-    // Summen av de to delene
-    return term1 + term2;
+    patchVertexCount = static_cast<GLsizei>(patchPoints.size());
+
+    glGenVertexArrays(1, &patchVAO);
+    glGenBuffers(1, &patchVBO);
+
+    GLState::bindVertexArray(patchVAO);
+    GLState::bindBuffer(GL_ARRAY_BUFFER, patchVBO);
+    glBufferData(GL_ARRAY_BUFFER, patchPoints.size() * sizeof(glm::vec4), patchPoints.data(), GL_STATIC_DRAW);
+
+    // Homogeneous control point attribute
+    glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(glm::vec4), (void*)0);
+    glEnableVertexAttribArray(0);
+
+    GLState::bindVertexArray(0);
 }
 
 void BSplineSurface::calculateNormals()
 {
+    // The normals came with the cached tessellation
+    if (tessellationCache.normals() != nullptr)
+        return;
+
+    std::vector<float> us, vs;
+    sampleParameters(us, vs);
+
+    // Same grid and patches as generateSurface, with the derivative rows added
     surfaceNormals.clear();
-    float step = 0.03f;
+    if (isGeoreferenced())
+        preciseEvaluator.evaluateGrid(std::vector<double>(us.begin(), us.end()), std::vector<double>(vs.begin(), vs.end()), nullptr, &surfaceNormals);
+    else
+        evaluateGrid(us, vs, nullptr, &surfaceNormals);
+
+    // The grid is complete now, the next run with the same surface can load it
+    TessellationCache::store(tessellationKey, surfaceVertices, surfaceNormals, surfaceIndices);
+}
+
 
-    for (float u = 0.0f; u <= 1.0f; u += step) {
-        for (float v = 0.0f; v <= 1.0f; v += step) {
-            glm::vec3 du = calculatePartialDerivativeU(u, v);
-            glm::vec3 dv = calculatePartialDerivativeV(u, v);
-            glm::vec3 normal = glm::normalize(glm::cross(du, dv));
-            surfaceNormals.push_back(normal);
+glm::vec3 BSplineSurface::evaluate(float u, float v) const
+{
+    float Nu[MAX_BSPLINE_DEGREE + 1], Nv[MAX_BSPLINE_DEGREE + 1];
+    int spanU = polynomialsU.span(u);
+    int spanV = polynomialsV.span(v);
+    evaluateSpanPolynomials(polynomialsU, spanU, u, 0, Nu);
+    evaluateSpanPolynomials(polynomialsV, spanV, v, 0, Nv);
+
+    // Bare de (d_u + 1) x (d_v + 1) kontrollpunktene som har innflytelse
+    glm::vec4 A(0.0f);
+    for (int k = 0; k <= d_u; ++k)
+        for (int l = 0; l <= d_v; ++l)
+            A += Nu[k] * Nv[l] * homogeneousPoints[(spanU - d_u + k) * numControlPointsV + (spanV - d_v + l)];
+
+    return glm::vec3(A) / A.w;
+}
+
+glm::dvec3 BSplineSurface::evaluateWorld(double u, double v) const
+{
+    if (isGeoreferenced())
+        return origin + preciseEvaluator.evaluate(u, v);
+    return glm::dvec3(evaluate(static_cast<float>(u), static_cast<float>(v)));
+}
+
+void BSplineSurface::evaluateDerivatives(float u, float v, glm::vec3& point, glm::vec3& du, glm::vec3& dv) const
+{
+    float Nu[2 * (MAX_BSPLINE_DEGREE + 1)], Nv[2 * (MAX_BSPLINE_DEGREE + 1)];
+    int spanU = polynomialsU.span(u);
+    int spanV = polynomialsV.span(v);
+    evaluateSpanPolynomials(polynomialsU, spanU, u, 1, Nu);
+    evaluateSpanPolynomials(polynomialsV, spanV, v, 1, Nv);
+    const float* dNu = Nu + d_u + 1;
+    const float* dNv = Nv + d_v + 1;
+
+    glm::vec4 A(0.0f), Au(0.0f), Av(0.0f);
+    for (int k = 0; k <= d_u; ++k)
+    {
+        for (int l = 0; l <= d_v; ++l)
+        {
+            const glm::vec4& Pw = homogeneousPoints[(spanU - d_u + k) * numControlPointsV + (spanV - d_v + l)];
+            A += Nu[k] * Nv[l] * Pw;
+            Au += dNu[k] * Nv[l] * Pw;
+            Av += Nu[k] * dNv[l] * Pw;
         }
     }
-    // Debug output to check normal vectors
-    for (const auto& normal : surfaceNormals) {
-        std::cout << "Normal: " << normal.x << ", " << normal.y << ", " << normal.z << std::endl;
-    }
-    setupNormalBuffers();
+
+    point = glm::vec3(A) / A.w;
+    du = (glm::vec3(Au) - Au.w * point) / A.w;
+    dv = (glm::vec3(Av) - Av.w * point) / A.w;
 }
 
-void BSplineSurface::setupNormalBuffers()
+void BSplineSurface::evaluateSecondDerivatives(float u, float v, glm::vec3& point, glm::vec3& du, glm::vec3& dv,
+    glm::vec3& duu, glm::vec3& duv, glm::vec3& dvv) const
 {
-    // Prepare normal lines data
-    std::vector<glm::vec3> normalLines;
-    for (size_t i = 0; i < surfaceVertices.size(); ++i) {
-        normalLines.push_back(surfaceVertices[i]);                     // Start of the line
-        normalLines.push_back(surfaceVertices[i] + 0.1f * surfaceNormals[i]); // End of the line
+    float Nu[3 * (MAX_BSPLINE_DEGREE + 1)], Nv[3 * (MAX_BSPLINE_DEGREE + 1)];
+    int spanU = polynomialsU.span(u);
+    int spanV = polynomialsV.span(v);
+    evaluateSpanPolynomials(polynomialsU, spanU, u, 2, Nu);
+    evaluateSpanPolynomials(polynomialsV, spanV, v, 2, Nv);
+    const float* dNu = Nu + d_u + 1;
+    const float* dNv = Nv + d_v + 1;
+    const float* ddNu = Nu + 2 * (d_u + 1);
+    const float* ddNv = Nv + 2 * (d_v + 1);
+
+    glm::vec4 A(0.0f), Au(0.0f), Av(0.0f), Auu(0.0f), Auv(0.0f), Avv(0.0f);
+    for (int k = 0; k <= d_u; ++k)
+    {
+        for (int l = 0; l <= d_v; ++l)
+        {
+            const glm::vec4& Pw = homogeneousPoints[(spanU - d_u + k) * numControlPointsV + (spanV - d_v + l)];
+            A += Nu[k] * Nv[l] * Pw;
+            Au += dNu[k] * Nv[l] * Pw;
+            Av += Nu[k] * dNv[l] * Pw;
+            Auu += ddNu[k] * Nv[l] * Pw;
+            Auv += dNu[k] * dNv[l] * Pw;
+            Avv += Nu[k] * ddNv[l] * Pw;
+        }
     }
 
-    // Generate and bind VAO for normals
-    glGenVertexArrays(1, &normalVAO);
-    glBindVertexArray(normalVAO);
+    // Quotient rule, differentiated once more: w * S'' = A'' - 2 w' S' - w'' S
+    point = glm::vec3(A) / A.w;
+    du = (glm::vec3(Au) - Au.w * point) / A.w;
+    dv = (glm::vec3(Av) - Av.w * point) / A.w;
+    duu = (glm::vec3(Auu) - 2.0f * Au.w * du - Auu.w * point) / A.w;
+    duv = (glm::vec3(Auv) - Au.w * dv - Av.w * du - Auv.w * point) / A.w;
+    dvv = (glm::vec3(Avv) - 2.0f * Av.w * dv - Avv.w * point) / A.w;
+}
 
-    // Generate VBO for normals if not created
-    if (normalVBO == 0) {
-        glGenBuffers(1, &normalVBO);
+glm::vec3 BSplineSurface::calculatePartialDerivativeU(float u, float v) const
+{
+    glm::vec3 point, du, dv;
+    evaluateDerivatives(u, v, point, du, dv);
+    return du;
+}
+
+glm::vec3 BSplineSurface::calculatePartialDerivativeV(float u, float v) const
+{
+    glm::vec3 point, du, dv;
+    evaluateDerivatives(u, v, point, du, dv);
+    return dv;
+}
+
+
+glm::vec3 BSplineSurface::getCenter() const
+{
+    if (bezierPatches.empty())
+        return glm::vec3(0.0f);
+
+    glm::vec3 boundsMin(FLT_MAX), boundsMax(-FLT_MAX);
+    for (const BezierPatch& patch : bezierPatches)
+    {
+        boundsMin = glm::min(boundsMin, patch.boundsMin);
+        boundsMax = glm::max(boundsMax, patch.boundsMax);
     }
+    return 0.5f * (boundsMin + boundsMax);
+}
 
-    // Bind and buffer data to VBO
-    glBindBuffer(GL_ARRAY_BUFFER, normalVBO);
-    glBufferData(GL_ARRAY_BUFFER, normalLines.size() * sizeof(glm::vec3), &normalLines[0], GL_STATIC_DRAW);
+void BSplineSurface::DrawBSpline(Shader& shaderProgram, RenderQueue& queue) const
+{
+    if (!hasMesh())
+        return;
 
-    // Set up the vertex attribute for normals
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
-    glEnableVertexAttribArray(0);
+    // Draw the B-Spline surface
+    DrawPacket packet;
+    packet.program = &shaderProgram;
+    packet.vertexArray = VAO;
+    packet.mode = GL_TRIANGLES;
+    packet.count = static_cast<GLsizei>(surfaceIndices.size());
+    packet.indexed = true;
+    queue.submit(packet, RenderPass::Opaque, getCenter());
+}
+
+void BSplineSurface::DrawNormals(Shader& shaderProgram, RenderQueue& queue) const
+{
+    if (!hasMesh())
+        return;
 
-    glBindVertexArray(0); // Unbind
+    // Every vertex goes through as a point, the geometry shader turns it into a line
+    DrawPacket packet;
+    packet.program = &shaderProgram;
+    packet.vertexArray = VAO;
+    packet.mode = GL_POINTS;
+    packet.count = static_cast<GLsizei>(surfaceVertices.size());
+    queue.submit(packet, RenderPass::Overlay, getCenter());
 }
 
+bool BSplineSurface::canDrawPatches() const
+{
+    return patchVertexCount > 0 && hasTessellationShaders();
+}
 
+void BSplineSurface::DrawBSplinePatches(Shader& shaderProgram, RenderQueue& queue) const
+{
+    DrawPacket packet;
+    packet.program = &shaderProgram;
+    packet.vertexArray = patchVAO;
+    packet.mode = GL_PATCHES;
+    packet.count = patchVertexCount;
+    packet.patchVertices = 16;
+    queue.submit(packet, RenderPass::Opaque, getCenter());
+}
 
-glm::vec3 BSplineSurface::calculatePartialDerivativeU(float u, float v) const
+void BSplineSurface::setupAnalyticShading(int samplesPerPatch)
 {
-    glm::vec3 du(0.0f);
-    int numControlPointsU = 3;
-    int numControlPointsV = 3;
+    if (patchVertexCount == 0)
+    {
+        std::cout << "Error: Analytic shading needs patches of degree 3 or lower, the surface has degree " << d_u << " x " << d_v << std::endl;
+        return;
+    }
+    samplesPerPatch = std::max(samplesPerPatch, 1);
+
+    // Grid lines on every patch border, the points are evaluated once for the whole grid
+    std::vector<float> us, vs;
+    for (int pu = 0; pu < numPatchesU; ++pu)
+    {
+        const BezierPatch& patch = bezierPatches[pu * numPatchesV];
+        for (int k = 0; k < samplesPerPatch; ++k)
+            us.push_back(patch.u0 + (patch.u1 - patch.u0) * k / samplesPerPatch);
+    }
+    us.push_back(bezierPatches.back().u1);
+    for (int pv = 0; pv < numPatchesV; ++pv)
+    {
+        const BezierPatch& patch = bezierPatches[pv];
+        for (int k = 0; k < samplesPerPatch; ++k)
+            vs.push_back(patch.v0 + (patch.v1 - patch.v0) * k / samplesPerPatch);
+    }
+    vs.push_back(bezierPatches.back().v1);
+
+    std::vector<glm::vec3> points;
+    evaluateGrid(us, vs, &points, nullptr);
+
+    // Every patch gets its own vertices with the local parameters (s, t) in [0, 1] and the
+    // patch index, so the fragment shader never has to search for the patch of a pixel
+    const int numV = static_cast<int>(vs.size());
+    const int side = samplesPerPatch + 1;
+    std::vector<float> vertexData;
+    std::vector<unsigned int> indices;
+    vertexData.reserve(static_cast<size_t>(numPatchesU) * numPatchesV * side * side * 6);
+    indices.reserve(static_cast<size_t>(numPatchesU) * numPatchesV * samplesPerPatch * samplesPerPatch * 6);
+    for (int pu = 0; pu < numPatchesU; ++pu)
+    {
+        for (int pv = 0; pv < numPatchesV; ++pv)
+        {
+            const unsigned int first = static_cast<unsigned int>(vertexData.size() / 6);
+            const float patchIndex = static_cast<float>(pu * numPatchesV + pv);
+            for (int i = 0; i < side; ++i)
+            {
+                for (int j = 0; j < side; ++j)
+                {
+                    const glm::vec3& point = points[(pu * samplesPerPatch + i) * numV + pv * samplesPerPatch + j];
+                    float s = static_cast<float>(i) / samplesPerPatch;
+                    float t = static_cast<float>(j) / samplesPerPatch;
+                    vertexData.insert(vertexData.end(), { point.x, point.y, point.z, s, t, patchIndex });
+                }
+            }
 
-    for (int i = 0; i < numControlPointsU; ++i) {
-        for (int j = 0; j < numControlPointsV; ++j) {
-            float BuPrime = NPrime(i, d_u, u, knotVectorU); // Derivative of B-spline basis function w.r.t u
-            float Bv = N(j, d_v, v, knotVectorV);
-            du += BuPrime * Bv * controlPoints[i * numControlPointsV + j];
+            for (int i = 0; i < samplesPerPatch; ++i)
+            {
+                for (int j = 0; j < samplesPerPatch; ++j)
+                {
+                    indices.push_back(first + i * side + j);
+                    indices.push_back(first + (i + 1) * side + j);
+                    indices.push_back(first + i * side + (j + 1));
+
+                    indices.push_back(first + i * side + (j + 1));
+                    indices.push_back(first + (i + 1) * side + j);
+                    indices.push_back(first + (i + 1) * side + (j + 1));
+                }
+            }
         }
     }
-    return du;
+    // Position and patch parameters (s, t, patch index), the indices count from the mesh's first vertex
+    MeshArena& arena = MeshArena::shared();
+    GLsizei vertexCount = static_cast<GLsizei>(vertexData.size() / 6);
+    GLsizei indexCount = static_cast<GLsizei>(indices.size());
+    arena.free(analyticMesh);
+    analyticMesh = arena.allocate(VertexFormat::PositionAndVec3, vertexCount, indexCount);
+    arena.uploadVertices(analyticMesh, 0, vertexCount, vertexData.data());
+    arena.uploadIndices(analyticMesh, 0, indexCount, indices.data());
+
+    if (patchTexture == 0)
+        glGenTextures(1, &patchTexture);
+
+    // The bicubic patches are already on the GPU for the tessellation shaders, the texture only views them
+    GLState::bindTexture(0, GL_TEXTURE_BUFFER, patchTexture);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, patchVBO);
 }
 
-glm::vec3 BSplineSurface::calculatePartialDerivativeV(float u, float v) const
+void BSplineSurface::DrawBSplineAnalytic(Shader& shaderProgram, RenderQueue& queue) const
 {
-    glm::vec3 dv(0.0f);
-    int numControlPointsU = 3;
-    int numControlPointsV = 3;
+    // Filled, the shading is the point of this mode
+    DrawPacket packet;
+    packet.program = &shaderProgram;
+    packet.vertexArray = MeshArena::shared().getVertexArray(analyticMesh.format);
+    packet.mode = GL_TRIANGLES;
+    packet.count = analyticMesh.indexCount;
+    packet.indexed = true;
+    packet.first = analyticMesh.firstIndex;
+    packet.baseVertex = analyticMesh.baseVertex;
+    packet.bufferTexture = patchTexture;
+    packet.filled = true;
+    queue.submit(packet, RenderPass::Opaque, getCenter());
+}
 
-    for (int i = 0; i < numControlPointsU; ++i) {
-        for (int j = 0; j < numControlPointsV; ++j) {
-            float Bu = N(i, d_u, u, knotVectorU);
-            float BvPrime = NPrime(j, d_v, v, knotVectorV); // Derivative of B-spline basis function w.r.t v
-            dv += Bu * BvPrime * controlPoints[i * numControlPointsV + j];
+// Samples per patch edge for the projection seeds; Bezier patches of degree <= 3 bend
+// at most a few times, so a 5 x 5 grid per patch starts Newton in the right basin
+static const int SEEDS_PER_PATCH_EDGE = 5;
+
+// Query points searched together in the seed search
+static const int PROJECTION_LANES = 8;
+
+void BSplineSurface::buildProjectionSeeds()
+{
+    const int seedsPerPatch = SEEDS_PER_PATCH_EDGE * SEEDS_PER_PATCH_EDGE;
+    size_t count = bezierPatches.size() * seedsPerPatch;
+    seedX.resize(count);
+    seedY.resize(count);
+    seedZ.resize(count);
+    seedU.resize(count);
+    seedV.resize(count);
+
+    size_t s = 0;
+    for (const BezierPatch& patch : bezierPatches)
+    {
+        for (int a = 0; a < SEEDS_PER_PATCH_EDGE; ++a)
+        {
+            for (int b = 0; b < SEEDS_PER_PATCH_EDGE; ++b, ++s)
+            {
+                float u = patch.u0 + (patch.u1 - patch.u0) * static_cast<float>(a) / (SEEDS_PER_PATCH_EDGE - 1);
+                float v = patch.v0 + (patch.v1 - patch.v0) * static_cast<float>(b) / (SEEDS_PER_PATCH_EDGE - 1);
+                glm::vec3 point = evaluate(u, v);
+                seedX[s] = point.x;
+                seedY[s] = point.y;
+                seedZ[s] = point.z;
+                seedU[s] = u;
+                seedV[s] = v;
+            }
         }
     }
-    return dv;
+
+    // How far a point of a cell can be from the nearest of its corner samples, measured on a finer
+    // grid inside every cell
+    const int steps = 4;
+    seedCoverage.assign(bezierPatches.size(), 0.0f);
+    for (size_t p = 0; p < bezierPatches.size(); ++p)
+    {
+        const BezierPatch& patch = bezierPatches[p];
+        int patchSeed = static_cast<int>(p) * seedsPerPatch;
+        float cellU = (patch.u1 - patch.u0) / (SEEDS_PER_PATCH_EDGE - 1);
+        float cellV = (patch.v1 - patch.v0) / (SEEDS_PER_PATCH_EDGE - 1);
+        for (int a = 0; a + 1 < SEEDS_PER_PATCH_EDGE; ++a)
+        {
+            for (int b = 0; b + 1 < SEEDS_PER_PATCH_EDGE; ++b)
+            {
+                int corners[4] = { patchSeed + a * SEEDS_PER_PATCH_EDGE + b, 0, 0, 0 };
+                corners[1] = corners[0] + 1;
+                corners[2] = corners[0] + SEEDS_PER_PATCH_EDGE;
+                corners[3] = corners[2] + 1;
+                for (int i = 0; i <= steps; ++i)
+                {
+                    for (int j = 0; j <= steps; ++j)
+                    {
+                        glm::vec3 point = evaluate(patch.u0 + cellU * (a + static_cast<float>(i) / steps),
+                            patch.v0 + cellV * (b + static_cast<float>(j) / steps));
+                        float nearest = FLT_MAX;
+                        for (int corner : corners)
+                        {
+                            nearest = std::min(nearest, glm::length(
+                                glm::vec3(seedX[corner], seedY[corner], seedZ[corner]) - point));
+                        }
+                        seedCoverage[p] = std::max(seedCoverage[p], nearest);
+                    }
+                }
+            }
+        }
+
+        // The finer grid can miss the furthest point by up to half its own cell
+        seedCoverage[p] *= 1.0f + 1.0f / steps;
+    }
 }
 
-float BSplineSurface::NPrime(int i, int d, float t, const std::vector<float>& knots) const
+// Newton step (stepU, stepV) for the closest point with the parameters that are held fixed left out
+// Where the distance is not convex the Newton step may go uphill; the Gauss-Newton matrix (without
+// the second derivative terms) always points downhill and is used instead. False when the
+// tangents are degenerate
+static bool projectionStep(const glm::vec3& du, const glm::vec3& dv, const glm::vec3& r,
+    const glm::vec3& duu, const glm::vec3& duv, const glm::vec3& dvv, float f, float g,
+    bool holdU, bool holdV, float& stepU, float& stepV)
 {
-    if (d == 0) return 0.0f;
+    stepU = 0.0f;
+    stepV = 0.0f;
+    if (holdU && holdV)
+        return true;
 
-    float term1 = 0.0f, term2 = 0.0f;
+    float a = glm::dot(du, du) + glm::dot(r, duu);
+    float b = glm::dot(du, dv) + glm::dot(r, duv);
+    float c = glm::dot(dv, dv) + glm::dot(r, dvv);
+    if (holdU || holdV)
+    {
+        float curvature = holdU ? c : a;
+        if (curvature <= 0.0f)
+            curvature = holdU ? glm::dot(dv, dv) : glm::dot(du, du);
+        if (curvature < 1e-20f)
+            return false;
+        stepU = holdU ? 0.0f : -f / curvature;
+        stepV = holdU ? -g / curvature : 0.0f;
+        return true;
+    }
 
-    if ((i + d < knots.size()) && (knots[i + d] - knots[i]) != 0) {
-        term1 = (d / (knots[i + d] - knots[i])) * N(i, d - 1, t, knots);
+    float determinant = a * c - b * b;
+    if (a <= 0.0f || determinant <= 0.0f)
+    {
+        a = glm::dot(du, du);
+        b = glm::dot(du, dv);
+        c = glm::dot(dv, dv);
+        determinant = a * c - b * b;
     }
-    if ((i + d + 1 < knots.size()) && (knots[i + d + 1] - knots[i + 1]) != 0) {
-        term2 = -(d / (knots[i + d + 1] - knots[i + 1])) * N(i + 1, d - 1, t, knots);
+    if (determinant < 1e-20f)
+        return false;
+    stepU = (b * g - c * f) / determinant;
+    stepV = (b * f - a * g) / determinant;
+    return true;
+}
+
+void BSplineSurface::refineProjection(const glm::vec3& query, float u, float v, SurfaceProjection& result,
+    const SurfaceProjection* known, float knownRadius) const
+{
+    float uMin, uMax, vMin, vMax;
+    getDomain(uMin, uMax, vMin, vMax);
+
+    // Newton on f(u, v) = Su . (S - P) = 0 and g(u, v) = Sv . (S - P) = 0 (The NURBS Book, 6.1)
+    // A Newton step can overshoot into another valley or out of the domain, so only parameters
+    // closer than the best so far are stepped from. A step that does not get closer is halved,
+    // and when none does the seed itself is the result
+    const float pointTolerance = 1e-6f;
+    const float cosineTolerance = 1e-6f;
+    float bestU = u, bestV = v;
+    float bestDistance = FLT_MAX;
+    float stepU = 0.0f, stepV = 0.0f;
+    float stepScale = 1.0f;
+    float stepLength = 0.0f;
+    glm::vec3 point, du, dv, duu, duv, dvv;
+    for (int iteration = 0; iteration < 40; ++iteration)
+    {
+        evaluateSecondDerivatives(u, v, point, du, dv, duu, duv, dvv);
+        glm::vec3 r = point - query;
+        float distance = glm::length(r);
+        if (distance >= bestDistance)
+        {
+            // Back towards the best parameters. Where the valley is nearly flat the step can be far
+            // too long, so it is halved down to a thousandth; once it is shorter than the tolerance
+            // the best point is as close as float rounding lets it get
+            stepScale *= 0.5f;
+            if (stepScale < 1.0f / 1024.0f || stepScale * stepLength <= pointTolerance)
+                break;
+            u = glm::clamp(bestU + stepScale * stepU, uMin, uMax);
+            v = glm::clamp(bestV + stepScale * stepV, vMin, vMax);
+            continue;
+        }
+        bestU = u;
+        bestV = v;
+        bestDistance = distance;
+        stepScale = 1.0f;
+
+        // Stop on the surface, or in the valley of the known projection
+        if (distance <= pointTolerance)
+            break;
+        if (known != NULL && glm::length(point - known->point) <= knownRadius)
+            break;
+
+        // A parameter on the boundary that the gradient pushes out of the domain is held there, and
+        // the closest point is searched along that boundary curve with the other parameter alone
+        float f = glm::dot(du, r);
+        float g = glm::dot(dv, r);
+        bool holdU = (u <= uMin && f > 0.0f) || (u >= uMax && f < 0.0f);
+        bool holdV = (v <= vMin && g > 0.0f) || (v >= vMax && g < 0.0f);
+
+        // Stop when r is perpendicular to the tangents the parameters can still move along
+        bool flatU = holdU || std::fabs(f) <= cosineTolerance * glm::length(du) * distance;
+        bool flatV = holdV || std::fabs(g) <= cosineTolerance * glm::length(dv) * distance;
+        if (flatU && flatV)
+            break;
+
+        // A parameter on the boundary that the step pushes out is held as well, and the step solved again
+        for (int pass = 0; pass < 2; ++pass)
+        {
+            if (!projectionStep(du, dv, r, duu, duv, dvv, f, g, holdU, holdV, stepU, stepV))
+                break;
+            bool pushU = !holdU && ((u <= uMin && stepU < 0.0f) || (u >= uMax && stepU > 0.0f));
+            bool pushV = !holdV && ((v <= vMin && stepV < 0.0f) || (v >= vMax && stepV > 0.0f));
+            if (!pushU && !pushV)
+                break;
+            holdU = holdU || pushU;
+            holdV = holdV || pushV;
+            stepU = stepV = 0.0f;
+        }
+
+        // Shortened to end on the boundary; clamping each parameter on its own would turn the step
+        // away from its direction, and then even a short step can go uphill
+        float fraction = 1.0f;
+        if (u + stepU < uMin)
+            fraction = std::min(fraction, (uMin - u) / stepU);
+        if (u + stepU > uMax)
+            fraction = std::min(fraction, (uMax - u) / stepU);
+        if (v + stepV < vMin)
+            fraction = std::min(fraction, (vMin - v) / stepV);
+        if (v + stepV > vMax)
+            fraction = std::min(fraction, (vMax - v) / stepV);
+        float newU = glm::clamp(u + fraction * stepU, uMin, uMax);
+        float newV = glm::clamp(v + fraction * stepV, vMin, vMax);
+
+        // The parameters no longer move
+        stepLength = glm::length((newU - u) * du + (newV - v) * dv);
+        if (stepLength <= pointTolerance)
+            break;
+        stepU = newU - u;
+        stepV = newV - v;
+        u = newU;
+        v = newV;
     }
 
-    return term1 + term2;
+    evaluateDerivatives(bestU, bestV, point, du, dv);
+    glm::vec3 normal = glm::cross(du, dv);
+    float length = glm::length(normal);
+
+    result.u = bestU;
+    result.v = bestV;
+    result.point = point;
+    result.normal = length > 0.0f ? normal / length : glm::vec3(0.0f, 0.0f, 1.0f);
+    result.distance = glm::length(point - query);
+}
+
+void BSplineSurface::projectBatch(const glm::vec3* queries, int count, SurfaceProjection* results) const
+{
+    const int seedsPerPatch = SEEDS_PER_PATCH_EDGE * SEEDS_PER_PATCH_EDGE;
+
+    for (int first = 0; first < count; first += PROJECTION_LANES)
+    {
+        // Unused lanes repeat the last query, so the loops always have full width
+        float qx[PROJECTION_LANES], qy[PROJECTION_LANES], qz[PROJECTION_LANES];
+        float best[PROJECTION_LANES];
+        int bestSeed[PROJECTION_LANES];
+        int lanes = std::min(PROJECTION_LANES, count - first);
+        for (int l = 0; l < PROJECTION_LANES; ++l)
+        {
+            const glm::vec3& query = queries[first + std::min(l, lanes - 1)];
+            qx[l] = query.x;
+            qy[l] = query.y;
+            qz[l] = query.z;
+            best[l] = FLT_MAX;
+            bestSeed[l] = 0;
+        }
+
+        // The centre sample of every patch first, so the bound is tight before the patches are pruned
+        for (size_t p = 0; p < bezierPatches.size(); ++p)
+        {
+            int s = static_cast<int>(p) * seedsPerPatch + seedsPerPatch / 2;
+            for (int l = 0; l < PROJECTION_LANES; ++l)
+            {
+                float dx = seedX[s] - qx[l];
+                float dy = seedY[s] - qy[l];
+                float dz = seedZ[s] - qz[l];
+                float distance = dx * dx + dy * dy + dz * dz;
+                bool closer = distance < best[l];
+                best[l] = closer ? distance : best[l];
+                bestSeed[l] = closer ? s : bestSeed[l];
+            }
+        }
+
+        for (size_t p = 0; p < bezierPatches.size(); ++p)
+        {
+            // A patch lies inside its bounding box: skip it when the box is further
+            // away than the best seed of every query
+            const BezierPatch& patch = bezierPatches[p];
+            bool needed = false;
+            for (int l = 0; l < PROJECTION_LANES; ++l)
+            {
+                float dx = std::max(std::max(patch.boundsMin.x - qx[l], qx[l] - patch.boundsMax.x), 0.0f);
+                float dy = std::max(std::max(patch.boundsMin.y - qy[l], qy[l] - patch.boundsMax.y), 0.0f);
+                float dz = std::max(std::max(patch.boundsMin.z - qz[l], qz[l] - patch.boundsMax.z), 0.0f);
+                needed |= dx * dx + dy * dy + dz * dz < best[l];
+            }
+            if (!needed)
+                continue;
+
+            int end = static_cast<int>(p + 1) * seedsPerPatch;
+            for (int s = static_cast<int>(p) * seedsPerPatch; s < end; ++s)
+            {
+                // Branch free over the lanes, so the compiler can keep all queries in vector registers
+                for (int l = 0; l < PROJECTION_LANES; ++l)
+                {
+                    float dx = seedX[s] - qx[l];
+                    float dy = seedY[s] - qy[l];
+                    float dz = seedZ[s] - qz[l];
+                    float distance = dx * dx + dy * dy + dz * dz;
+                    bool closer = distance < best[l];
+                    best[l] = closer ? distance : best[l];
+                    bestSeed[l] = closer ? s : bestSeed[l];
+                }
+            }
+        }
+
+        for (int l = 0; l < lanes; ++l)
+        {
+            const glm::vec3& query = queries[first + l];
+            SurfaceProjection& result = results[first + l];
+            refineProjection(query, seedU[bestSeed[l]], seedV[bestSeed[l]], result);
+
+            // The nearest sample can lie in the valley of a local minimum, with the closest point in
+            // another valley. A closer point is within seedCoverage of some sample, so the search is
+            // started again from every sample that is closer than the result plus that
+            int nearestSeed = bestSeed[l];
+            for (size_t p = 0; p < bezierPatches.size(); ++p)
+            {
+                const BezierPatch& patch = bezierPatches[p];
+                glm::vec3 outside = glm::max(glm::max(patch.boundsMin - query, query - patch.boundsMax), glm::vec3(0.0f));
+                if (glm::dot(outside, outside) >= result.distance * result.distance)
+                    continue;
+
+                int end = static_cast<int>(p + 1) * seedsPerPatch;
+                for (int s = static_cast<int>(p) * seedsPerPatch; s < end; ++s)
+                {
+                    float distance = glm::length(glm::vec3(seedX[s], seedY[s], seedZ[s]) - query);
+                    if (s == nearestSeed || distance >= result.distance + seedCoverage[p])
+                        continue;
+
+                    // Most of these end in the valley of the result, and stop as soon as they get there
+                    SurfaceProjection candidate;
+                    SurfaceProjection known = result;
+                    refineProjection(query, seedU[s], seedV[s], candidate, &known, 0.1f * seedCoverage[p]);
+                    if (candidate.distance < result.distance)
+                        result = candidate;
+                }
+            }
+        }
+    }
 }
 
+// Spreads the lowest 10 bits of x out to every third bit
+static uint32_t spreadBits(uint32_t x)
+{
+    x &= 0x3FF;
+    x = (x | (x << 16)) & 0x030000FF;
+    x = (x | (x << 8)) & 0x0300F00F;
+    x = (x | (x << 4)) & 0x030C30C3;
+    x = (x | (x << 2)) & 0x09249249;
+    return x;
+}
 
-void BSplineSurface::DrawBSpline(Shader shaderProgram) const
+void BSplineSurface::projectPoints(const std::vector<glm::vec3>& queries, std::vector<SurfaceProjection>& results) const
 {
-    shaderProgram.Activate();  // Activate the shader program
+    results.resize(queries.size());
+    if (queries.empty() || seedX.empty())
+        return;
 
-    // Draw the B-Spline surface
-    glBindVertexArray(VAO);
-    glDrawElements(GL_TRIANGLES, surfaceIndices.size(), GL_UNSIGNED_INT, 0);
-    glBindVertexArray(0);
-
-    // Draw normals as lines
-    glBindVertexArray(normalVAO);
-    glDrawArrays(GL_LINES, 0, static_cast<GLsizei>(surfaceNormals.size() * 2));
-    glBindVertexArray(0); // Unbind
-}
\ No newline at end of file
+    int count = static_cast<int>(queries.size());
+
+    // Queries in Morton order, so the lanes of a batch are close together and
+    // the patch bounds prune the seed search for all of them at once
+    glm::vec3 boundsMin(FLT_MAX), boundsMax(-FLT_MAX);
+    for (const glm::vec3& query : queries)
+    {
+        boundsMin = glm::min(boundsMin, query);
+        boundsMax = glm::max(boundsMax, query);
+    }
+    glm::vec3 scale = 1023.0f / glm::max(boundsMax - boundsMin, glm::vec3(1e-20f));
+
+    std::vector<std::pair<uint32_t, int>> order(count);
+    for (int i = 0; i < count; ++i)
+    {
+        glm::vec3 cell = (queries[i] - boundsMin) * scale;
+        uint32_t code = spreadBits(static_cast<uint32_t>(cell.x)) | (spreadBits(static_cast<uint32_t>(cell.y)) << 1)
+            | (spreadBits(static_cast<uint32_t>(cell.z)) << 2);
+        order[i] = std::make_pair(code, i);
+    }
+    std::sort(order.begin(), order.end());
+
+    std::vector<glm::vec3> sortedQueries(count);
+    for (int i = 0; i < count; ++i)
+        sortedQueries[i] = queries[order[i].second];
+    std::vector<SurfaceProjection> sortedResults(count);
+
+    // Pieces big enough to hide the job overhead, small enough to balance the load
+    const int grainSize = 256;
+    JobSystem::shared().parallelFor(0, count, grainSize, [&](int first, int last)
+    {
+        projectBatch(&sortedQueries[first], last - first, &sortedResults[first]);
+    });
+
+    for (int i = 0; i < count; ++i)
+        results[order[i].second] = sortedResults[i];
+}
+
+SurfaceProjection BSplineSurface::projectPoint(const glm::vec3& query) const
+{
+    SurfaceProjection result;
+    if (!seedX.empty())
+        projectBatch(&query, 1, &result);
+    return result;
+}
@@ -6,61 +6,254 @@
 #include <glm/glm.hpp>
 #include <vector>
 #include "shaderClass.h"
+#include "BSplineBasis.h"
+#include "TessellationCache.h"
+#include "SplineEvaluator.h"
+#include "UploadService.h"
+#include "MeshArena.h"
+#include "RenderQueue.h"
+
+// One polynomial piece of the surface in Bezier form, made by knot insertion
+// The patch covers [u0, u1] x [v0, v1] of the surface parameters
+struct BezierPatch
+{
+    int degreeU = 0;
+    int degreeV = 0;
+
+    // (degreeU + 1) x (degreeV + 1) homogeneous control points: points[i * (degreeV + 1) + j]
+    std::vector<glm::vec4> points;
+
+    float u0 = 0.0f, u1 = 1.0f;
+    float v0 = 0.0f, v1 = 1.0f;
+
+    // Bounding box of the control hull, contains the whole patch (used for culling)
+    glm::vec3 boundsMin;
+    glm::vec3 boundsMax;
+};
+
+// Result of projecting a point onto the surface
+struct SurfaceProjection
+{
+    float u = 0.0f;
+    float v = 0.0f;
+    glm::vec3 point = glm::vec3(0.0f);
+    glm::vec3 normal = glm::vec3(0.0f, 0.0f, 1.0f);
+    float distance = 0.0f;
+};
 
 class BSplineSurface 
 {
 public:
 	BSplineSurface();
+
+	// Rational (NURBS) surface with one weight per control point
+	// Control points are stored row by row: controlPoints[i * numControlPointsV + j]
+	// Weights must be above 0 and the knots non-decreasing, otherwise it is the default surface;
+	// no weights means weight 1 everywhere
+	BSplineSurface(const std::vector<glm::vec3>& controlPoints, const std::vector<float>& weights,
+		int numControlPointsU, int numControlPointsV,
+		const std::vector<float>& knotsU, const std::vector<float>& knotsV,
+		int degreeU, int degreeV);
+
+	// Georeferenced surface, for control points with large coordinates (for example UTM)
+	// The points are stored relative to an origin in the middle of the net, and the mesh is
+	// evaluated in double relative to it before it is rounded to float. Vertices and every
+	// float result of the surface (evaluate, projection, patches) are relative to getOrigin()
+	BSplineSurface(const std::vector<glm::dvec3>& worldControlPoints, const std::vector<float>& weights,
+		int numControlPointsU, int numControlPointsV,
+		const std::vector<float>& knotsU, const std::vector<float>& knotsV,
+		int degreeU, int degreeV);
 	~BSplineSurface();
 
-	void DrawBSpline(Shader shaderProgram) const;
+	// Surfaces made after this upload their mesh on the upload thread instead of in the constructor
+	// The service must outlive them; null goes back to uploading right away
+	static void setUploadService(UploadService* service);
+
+	// Sets up the vertex array once the mesh upload is done, call every frame before drawing
+	// Returns true when the mesh can be drawn; until then DrawBSpline and DrawNormals draw nothing
+	bool finishUpload();
+
+	// The Draw functions submit the surface to the queue, it is drawn when the queue is executed
+	// The program must stay alive until then
+	void DrawBSpline(Shader& shaderProgram, RenderQueue& queue) const;
+
+	// Debug view of the vertex normals, one line per vertex made by the geometry shader
+	// Expects the normals.vert/normals.geom/normals.frag program with its matrices and normalLength set
+	void DrawNormals(Shader& shaderProgram, RenderQueue& queue) const;
+
+	// Draws the Bezier patches with tessellation shaders, the surface is evaluated on the GPU
+	// Only the control points are uploaded; needs OpenGL 4.0 and patches of degree 3 or lower
+	void DrawBSplinePatches(Shader& shaderProgram, RenderQueue& queue) const;
+	bool canDrawPatches() const;
+
+	// Coarse mesh shaded with the exact normal: the fragment shader evaluates the Bezier patch
+	// at the parameters of every pixel (analytic.vert/analytic.frag), so the shading does not depend
+	// on the vertex count. samplesPerPatch is the grid resolution inside one patch
+	// Like DrawBSplinePatches this needs patches of degree 3 or lower. The patch points are bound
+	// to texture unit 0, the program's patchPoints sampler has to be set to 0
+	void setupAnalyticShading(int samplesPerPatch);
+	bool canDrawAnalytic() const { return analyticMesh.indexCount > 0; }
+	void DrawBSplineAnalytic(Shader& shaderProgram, RenderQueue& queue) const;
+
+	// Point on the surface for the parameters (u, v)
+	glm::vec3 evaluate(float u, float v) const;
+
+	// Point in world coordinates, in double for a georeferenced surface
+	glm::dvec3 evaluateWorld(double u, double v) const;
+
+	const glm::dvec3& getOrigin() const { return origin; }
+	bool isGeoreferenced() const { return !worldControlPoints.empty(); }
+
+	// Point and first partial derivatives, with the quotient rule for the weights
+	void evaluateDerivatives(float u, float v, glm::vec3& point, glm::vec3& du, glm::vec3& dv) const;
+
+	// Point with first and second partial derivatives
+	void evaluateSecondDerivatives(float u, float v, glm::vec3& point, glm::vec3& du, glm::vec3& dv,
+		glm::vec3& duu, glm::vec3& duv, glm::vec3& dvv) const;
+
+	// Closest point on the surface for each query point (point inversion)
+	// Newton iteration started from the nearest sample of a coarse grid, and again from the other samples
+	// that could lead to a closer point; never further than the nearest sample. Batches run on several threads
+	void projectPoints(const std::vector<glm::vec3>& queries, std::vector<SurfaceProjection>& results) const;
+	SurfaceProjection projectPoint(const glm::vec3& query) const;
+
+	// Valid parameter domain [uMin, uMax] x [vMin, vMax]
+	void getDomain(float& uMin, float& uMax, float& vMin, float& vMax) const;
+
+	// Replaces the uniform grid with a crack free adaptive mesh for the current camera
+	// Cells are split until the chordal deviation is below maxPixelError pixels on screen
+	void tessellateAdaptive(const glm::mat4& projection, const glm::mat4& view, const glm::vec2& viewportSize, float maxPixelError);
+
+	size_t getTriangleCount() const { return surfaceIndices.size() / 3; }
+
+	// The surface split into independent Bezier patches
+	const std::vector<BezierPatch>& getBezierPatches() const { return bezierPatches; }
 
 private:
     // Initialiserer kontrollpunktene
     void initControlPoints();
 
-    // Basert p kontrollpunktene genererer det B-Spline surface
+    // Takes the net if it is consistent, otherwise the default surface; false in that case
+    bool initControlNet(const std::vector<glm::vec3>& controlPoints, const std::vector<float>& weights,
+        int numControlPointsU, int numControlPointsV,
+        const std::vector<float>& knotsU, const std::vector<float>& knotsV,
+        int degreeU, int degreeV);
+
+    // Basert på kontrollpunktene genererer det B-Spline surface
     void generateSurface();
 
     // Buffere
     void setupBuffers();
 
-    // Brukes til  konstruere surface ved  beregne B-Spline basisfunksjonen
-    // Kontrollpunktindex = i, grad = d, parameteren = t, knot sekvens = knots
-    // t Parameter man bruker for  tegne kurven. Finner ut av hvor mye et punkt bidrar til formen p kurven
-    float N(int i, int d, float t, const std::vector<float>& knots) const;
+    // Uploads surfaceVertices and surfaceIndices again after a new tessellation
+    void updateBuffers();
 
     // Har lista over kontrollpunkter
     std::vector<glm::vec3> controlPoints;
 
+    // Weight per control point, all 1 for a polynomial B-Spline
+    std::vector<float> weights;
+
+    // Control points in homogeneous coordinates (w * P, w)
+    // Polynomial and rational surfaces share the same evaluation path
+    std::vector<glm::vec4> homogeneousPoints;
+    void updateHomogeneousPoints();
+
+    // Antall kontrollpunkter
+    int numControlPointsU = 3;
+    int numControlPointsV = 3;
+
+    // Parameter step for the tessellation, relative to the domain
+    float tessellationStep = 0.03f;
+
     // Liste over vertices
     std::vector<glm::vec3> surfaceVertices;
 
-    // Surface sin indekser som brukes for  tegne surface
+    // Surface sin indekser som brukes for å tegne surface
     std::vector<unsigned int> surfaceIndices;
 
     // Disse er knot vektorene for parameterene U og V
-    // Bestemmer hvordan kontrollpunktene p virker formen p surface
+    // Bestemmer hvordan kontrollpunktene på virker formen på surface
     std::vector<float> knotVectorU{ 0.0f, 0.0f, 0.0f, 1.0f, 2.0f, 2.0f, 2.0f };  
     std::vector<float> knotVectorV{ 0.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f };  
 
     // Grad for B-Spline
     // u og v retning
-    // Pvirker formen
+    // Påvirker formen
     // [eit kvadrat av eit kvadrat]
     int d_u = 2; 
     int d_v = 2; 
 
     std::vector<glm::vec3> surfaceNormals; // Normals for each vertex
     void calculateNormals(); // New method to calculate normals
-    void setupNormalBuffers(); // Sets up buffers for normal lines
 
-    float NPrime(int i, int d, float t, const std::vector<float>& knots) const;
+    // Positions and then normals in the one vertex buffer, attributes 0 and 1 of the VAO
+    void uploadVertexBuffer(const void* cachedData);
+    void setVertexAttributes();
+
+    // Mesh buffers on their way to the GPU, VBO and EBO are taken from them in finishUpload
+    static UploadService* uploadService;
+    UploadHandle vertexUpload;
+    UploadHandle indexUpload;
+    bool hasMesh() const { return EBO != 0 && !vertexUpload && !indexUpload; }
+
+    // Middle of the bounding box of the patches, where the render queue measures the depth
+    glm::vec3 getCenter() const;
+
+    // Bezier patches made once from the control net by knot insertion (Boehm)
+    // Stored row by row: bezierPatches[pu * numPatchesV + pv]
+    std::vector<BezierPatch> bezierPatches;
+    int numPatchesU = 0;
+    int numPatchesV = 0;
+    void extractBezierPatches();
+
+    // Basis functions per knot span as polynomials, rebuilt with the knot vectors
+    SpanPolynomials polynomialsU;
+    SpanPolynomials polynomialsV;
+
+    // Coarse samples for seeding the projection, stored patch by patch as separate
+    // coordinate arrays so the nearest sample search runs over several queries at once
+    std::vector<float> seedX, seedY, seedZ, seedU, seedV;
+    // How far a point of the patch can be from its nearest sample, per patch
+    std::vector<float> seedCoverage;
+    void buildProjectionSeeds();
+    void projectBatch(const glm::vec3* queries, int count, SurfaceProjection* results) const;
+    // Newton from (u, v); with a known projection it stops once it gets within knownRadius of that
+    // one, as it would only find it again
+    void refineProjection(const glm::vec3& query, float u, float v, SurfaceProjection& result,
+        const SurfaceProjection* known = NULL, float knownRadius = 0.0f) const;
+
+    // Georeferenced nets only: the original points, and the double evaluator for the mesh
+    glm::dvec3 origin = glm::dvec3(0.0);
+    std::vector<glm::dvec3> worldControlPoints;
+    SplineSurfaceEvaluator<DoublePrecision> preciseEvaluator;
+
+    // Tessellations from earlier runs, keyed on everything that changes the mesh
+    TessellationCache tessellationCache;
+    uint64_t tessellationKey = 0;
+    uint64_t computeTessellationKey() const;
+
+    // Parameter values for the tessellation grid in u and v
+    void sampleParameters(std::vector<float>& us, std::vector<float>& vs) const;
+
+    // Evaluates the whole grid us x vs, patch by patch on several threads
+    // points/normals may be null when only one of them is needed
+    void evaluateGrid(const std::vector<float>& us, const std::vector<float>& vs,
+        std::vector<glm::vec3>* points, std::vector<glm::vec3>* normals) const;
 
     glm::vec3 calculatePartialDerivativeU(float u, float v) const;
     glm::vec3 calculatePartialDerivativeV(float u, float v) const;
 
-    GLuint normalVAO, normalVBO;
+    // Bezier patches raised to bicubic, 16 homogeneous control points each
+    void setupPatchBuffers();
+    GLuint patchVAO, patchVBO;
+    GLsizei patchVertexCount = 0;
+
+    // Coarse grid per patch with position, (s, t) and patch index per vertex for the analytic
+    // shading, in the shared buffers. The shader reads the patch points from patchVBO through
+    // patchTexture, which views the whole buffer, so the patches keep a buffer of their own
+    MeshRange analyticMesh;
+    GLuint patchTexture = 0;
 
     GLuint VAO, VBO, EBO;
 };
@@ -0,0 +1,423 @@
+#include "BSplineTerrain.h"
+#include "JobSystem.h"
+#include <iostream>
+#include <algorithm>
+#include <cfloat>
+
+// Floats per vertex in the shared buffer: position and normal
+static const int TERRAIN_VERTEX_FLOATS = 6;
+
+BSplineTerrain::BSplineTerrain(const std::vector<glm::vec3>& controlPoints, const std::vector<float>& weights,
+    int numControlPointsU, int numControlPointsV,
+    const std::vector<float>& knotsU, const std::vector<float>& knotsV,
+    int degreeU, int degreeV, int spansPerTile, int maxSamplesPerSpan)
+{
+    bool valid = numControlPointsU * numControlPointsV == static_cast<int>(controlPoints.size())
+        && degreeU >= 1 && degreeU <= MAX_BSPLINE_DEGREE && degreeV >= 1 && degreeV <= MAX_BSPLINE_DEGREE
+        && numControlPointsU > degreeU && numControlPointsV > degreeV
+        && static_cast<int>(knotsU.size()) >= numControlPointsU + degreeU + 1
+        && static_cast<int>(knotsV.size()) >= numControlPointsV + degreeV + 1;
+
+    if (!valid)
+    {
+        std::cout << "Error: Inconsistent terrain control net, knot vectors or degrees. The terrain is empty" << std::endl;
+        return;
+    }
+
+    this->controlPoints = controlPoints;
+    this->numControlPointsU = numControlPointsU;
+    this->numControlPointsV = numControlPointsV;
+    knotVectorU = knotsU;
+    knotVectorV = knotsV;
+    d_u = degreeU;
+    d_v = degreeV;
+
+    this->weights = weights;
+    if (this->weights.size() != controlPoints.size())
+    {
+        if (!weights.empty())
+            std::cout << "Error: Expected " << controlPoints.size() << " weights, got " << weights.size() << ". Using weight 1" << std::endl;
+        this->weights.assign(controlPoints.size(), 1.0f);
+    }
+
+    homogeneousPoints.resize(controlPoints.size());
+    for (size_t i = 0; i < controlPoints.size(); ++i)
+        homogeneousPoints[i] = glm::vec4(controlPoints[i] * this->weights[i], this->weights[i]);
+
+    buildSpanPolynomials(numControlPointsU, d_u, knotVectorU, polynomialsU);
+    buildSpanPolynomials(numControlPointsV, d_v, knotVectorV, polynomialsV);
+
+    // Power of two, so a coarser neighbour's samples are always a subset of ours
+    this->maxSamplesPerSpan = 1;
+    while (this->maxSamplesPerSpan * 2 <= maxSamplesPerSpan)
+        this->maxSamplesPerSpan *= 2;
+
+    createTiles(spansPerTile < 1 ? 1 : spansPerTile);
+
+    // One range of the shared buffers for all tiles, every tile has room for its finest resolution
+    GLsizei totalVertices = 0, totalIndices = 0;
+    for (const TerrainTile& tile : tiles)
+    {
+        totalVertices += tile.vertexCapacity;
+        totalIndices += tile.indexCapacity;
+    }
+
+    // Position and normal per vertex
+    mesh = MeshArena::shared().allocate(VertexFormat::PositionAndVec3, totalVertices, totalIndices);
+
+    update();
+}
+
+BSplineTerrain::~BSplineTerrain()
+{
+    MeshArena::shared().free(mesh);
+}
+
+void BSplineTerrain::createTiles(int spansPerTile)
+{
+    // Spans d..n are the domain, they are cut into groups of spansPerTile
+    int lastSpanU = numControlPointsU - 1;
+    int lastSpanV = numControlPointsV - 1;
+    numTilesU = (lastSpanU - d_u + spansPerTile) / spansPerTile;
+    numTilesV = (lastSpanV - d_v + spansPerTile) / spansPerTile;
+
+    tiles.assign(numTilesU * numTilesV, TerrainTile());
+    GLint baseVertex = 0;
+    GLsizei firstIndex = 0;
+
+    for (int tu = 0; tu < numTilesU; ++tu)
+    {
+        for (int tv = 0; tv < numTilesV; ++tv)
+        {
+            TerrainTile& tile = tiles[tu * numTilesV + tv];
+            tile.spanU0 = d_u + tu * spansPerTile;
+            tile.spanU1 = std::min(tile.spanU0 + spansPerTile, lastSpanU + 1);
+            tile.spanV0 = d_v + tv * spansPerTile;
+            tile.spanV1 = std::min(tile.spanV0 + spansPerTile, lastSpanV + 1);
+            tile.u0 = knotVectorU[tile.spanU0];
+            tile.u1 = knotVectorU[tile.spanU1];
+            tile.v0 = knotVectorV[tile.spanV0];
+            tile.v1 = knotVectorV[tile.spanV1];
+            tile.samplesPerSpan = maxSamplesPerSpan;
+
+            int cellsU = (tile.spanU1 - tile.spanU0) * maxSamplesPerSpan;
+            int cellsV = (tile.spanV1 - tile.spanV0) * maxSamplesPerSpan;
+            tile.baseVertex = baseVertex;
+            tile.vertexCapacity = (cellsU + 1) * (cellsV + 1);
+            tile.firstIndex = firstIndex;
+            tile.indexCapacity = cellsU * cellsV * 6;
+            baseVertex += tile.vertexCapacity;
+            firstIndex += tile.indexCapacity;
+
+            // Until the first tessellation: the control points with influence on the tile
+            // The surface lies inside their convex hull
+            tile.boundsMin = glm::vec3(FLT_MAX);
+            tile.boundsMax = glm::vec3(-FLT_MAX);
+            for (int i = tile.spanU0 - d_u; i < tile.spanU1; ++i)
+            {
+                for (int j = tile.spanV0 - d_v; j < tile.spanV1; ++j)
+                {
+                    tile.boundsMin = glm::min(tile.boundsMin, controlPoints[i * numControlPointsV + j]);
+                    tile.boundsMax = glm::max(tile.boundsMax, controlPoints[i * numControlPointsV + j]);
+                }
+            }
+        }
+    }
+}
+
+void BSplineTerrain::markDirty(int tu, int tv)
+{
+    if (tu >= 0 && tv >= 0 && tu < numTilesU && tv < numTilesV)
+        tiles[tu * numTilesV + tv].dirty = true;
+}
+
+int BSplineTerrain::neighbourSamplesPerSpan(int tu, int tv) const
+{
+    if (tu < 0 || tv < 0 || tu >= numTilesU || tv >= numTilesV)
+        return 0;
+    return tiles[tu * numTilesV + tv].samplesPerSpan;
+}
+
+void BSplineTerrain::setControlPoint(int i, int j, const glm::vec3& point)
+{
+    if (i < 0 || j < 0 || i >= numControlPointsU || j >= numControlPointsV)
+    {
+        std::cout << "Error: Control point (" << i << ", " << j << ") is outside the terrain" << std::endl;
+        return;
+    }
+
+    int index = i * numControlPointsV + j;
+    controlPoints[index] = point;
+    homogeneousPoints[index] = glm::vec4(point * weights[index], weights[index]);
+
+    // The point has influence on the knot spans i..i + d_u and j..j + d_v
+    for (int tu = 0; tu < numTilesU; ++tu)
+    {
+        for (int tv = 0; tv < numTilesV; ++tv)
+        {
+            TerrainTile& tile = tiles[tu * numTilesV + tv];
+            if (tile.spanU0 <= i + d_u && i < tile.spanU1 && tile.spanV0 <= j + d_v && j < tile.spanV1)
+                tile.dirty = true;
+        }
+    }
+}
+
+void BSplineTerrain::setTileResolution(int tile, int samplesPerSpan)
+{
+    if (tile < 0 || tile >= static_cast<int>(tiles.size()))
+        return;
+
+    int samples = 1;
+    while (samples * 2 <= samplesPerSpan && samples < maxSamplesPerSpan)
+        samples *= 2;
+    if (samples == tiles[tile].samplesPerSpan)
+        return;
+
+    tiles[tile].samplesPerSpan = samples;
+
+    // The neighbours fit their shared edges to the new resolution
+    int tu = tile / numTilesV;
+    int tv = tile % numTilesV;
+    markDirty(tu, tv);
+    markDirty(tu - 1, tv);
+    markDirty(tu + 1, tv);
+    markDirty(tu, tv - 1);
+    markDirty(tu, tv + 1);
+}
+
+void BSplineTerrain::updateLevelOfDetail(const glm::vec3& cameraPosition, float lodDistance)
+{
+    for (int t = 0; t < static_cast<int>(tiles.size()); ++t)
+    {
+        const TerrainTile& tile = tiles[t];
+        glm::vec3 closest = glm::clamp(cameraPosition, tile.boundsMin, tile.boundsMax);
+        int level = static_cast<int>(glm::length(cameraPosition - closest) / lodDistance);
+        setTileResolution(t, level < 30 ? maxSamplesPerSpan >> level : 1);
+    }
+}
+
+void BSplineTerrain::tileParameters(const std::vector<float>& knots, int span0, int span1, int samplesPerSpan, std::vector<float>& params)
+{
+    // Same expression in every tile, so a shared edge gets bit for bit the same parameters
+    params.clear();
+    for (int s = span0; s < span1; ++s)
+    {
+        float length = knots[s + 1] - knots[s];
+        if (length <= 0.0f)
+            continue;
+        for (int m = 0; m < samplesPerSpan; ++m)
+            params.push_back(knots[s] + length * static_cast<float>(m) / static_cast<float>(samplesPerSpan));
+    }
+    params.push_back(knots[span1]);
+}
+
+void BSplineTerrain::tessellateTile(int t)
+{
+    TerrainTile& tile = tiles[t];
+    int tu = t / numTilesV;
+    int tv = t % numTilesV;
+
+    std::vector<float> us, vs;
+    tileParameters(knotVectorU, tile.spanU0, tile.spanU1, tile.samplesPerSpan, us);
+    tileParameters(knotVectorV, tile.spanV0, tile.spanV1, tile.samplesPerSpan, vs);
+    int numU = static_cast<int>(us.size());
+    int numV = static_cast<int>(vs.size());
+
+    BasisTable basisU, basisV;
+    sampleBasis(polynomialsU, 1, us, basisU);
+    sampleBasis(polynomialsV, 1, vs, basisV);
+
+    std::vector<glm::vec3> points(numU * numV), normals(numU * numV);
+    for (int a = 0; a < numU; ++a)
+    {
+        int spanU = basisU.spans[a];
+        const float* Nu = basisU.derivative(a, 0);
+        const float* dNu = basisU.derivative(a, 1);
+
+        for (int b = 0; b < numV; ++b)
+        {
+            int spanV = basisV.spans[b];
+            const float* Nv = basisV.derivative(b, 0);
+            const float* dNv = basisV.derivative(b, 1);
+
+            glm::vec4 A(0.0f), Au(0.0f), Av(0.0f);
+            for (int k = 0; k <= d_u; ++k)
+            {
+                const glm::vec4* row = &homogeneousPoints[(spanU - d_u + k) * numControlPointsV + (spanV - d_v)];
+                glm::vec4 S(0.0f), Sv(0.0f);
+                for (int l = 0; l <= d_v; ++l)
+                {
+                    S += Nv[l] * row[l];
+                    Sv += dNv[l] * row[l];
+                }
+                A += Nu[k] * S;
+                Au += dNu[k] * S;
+                Av += Nu[k] * Sv;
+            }
+
+            // Rational derivative: S' = (A' - w' * S) / w
+            glm::vec3 point = glm::vec3(A) / A.w;
+            glm::vec3 du = (glm::vec3(Au) - Au.w * point) / A.w;
+            glm::vec3 dv = (glm::vec3(Av) - Av.w * point) / A.w;
+            glm::vec3 normal = glm::cross(du, dv);
+            float length = glm::length(normal);
+
+            points[a * numV + b] = point;
+            normals[a * numV + b] = length > 0.0f ? normal / length : glm::vec3(0.0f, 0.0f, 1.0f);
+        }
+    }
+
+    // Edges next to a coarser tile: the extra vertices are moved onto the neighbour's
+    // straight edge, so there are no cracks between the two resolutions
+    auto fitEdge = [&](int neighbourSamples, int first, int step, int count)
+    {
+        if (neighbourSamples <= 0 || neighbourSamples >= tile.samplesPerSpan)
+            return;
+        int ratio = tile.samplesPerSpan / neighbourSamples;
+        for (int k = 0; k < count; ++k)
+        {
+            int offset = k % ratio;
+            if (offset == 0)
+                continue;
+            int k0 = k - offset;
+            float t = static_cast<float>(offset) / static_cast<float>(ratio);
+            int i = first + k * step, i0 = first + k0 * step, i1 = first + (k0 + ratio) * step;
+            points[i] = glm::mix(points[i0], points[i1], t);
+            normals[i] = glm::normalize(glm::mix(normals[i0], normals[i1], t));
+        }
+    };
+    fitEdge(neighbourSamplesPerSpan(tu - 1, tv), 0, 1, numV);
+    fitEdge(neighbourSamplesPerSpan(tu + 1, tv), (numU - 1) * numV, 1, numV);
+    fitEdge(neighbourSamplesPerSpan(tu, tv - 1), 0, numV, numU);
+    fitEdge(neighbourSamplesPerSpan(tu, tv + 1), numV - 1, numV, numU);
+
+    tile.boundsMin = glm::vec3(FLT_MAX);
+    tile.boundsMax = glm::vec3(-FLT_MAX);
+    tile.vertexData.resize(points.size() * TERRAIN_VERTEX_FLOATS);
+    for (size_t i = 0; i < points.size(); ++i)
+    {
+        float* vertex = &tile.vertexData[i * TERRAIN_VERTEX_FLOATS];
+        vertex[0] = points[i].x;
+        vertex[1] = points[i].y;
+        vertex[2] = points[i].z;
+        vertex[3] = normals[i].x;
+        vertex[4] = normals[i].y;
+        vertex[5] = normals[i].z;
+        tile.boundsMin = glm::min(tile.boundsMin, points[i]);
+        tile.boundsMax = glm::max(tile.boundsMax, points[i]);
+    }
+
+    // Indices start at 0 in every tile, the draw call adds the tile's base vertex
+    tile.indices.clear();
+    tile.indices.reserve((numU - 1) * (numV - 1) * 6);
+    for (int i = 0; i < numU - 1; ++i)
+    {
+        for (int j = 0; j < numV - 1; ++j)
+        {
+            tile.indices.push_back(i * numV + j);
+            tile.indices.push_back((i + 1) * numV + j);
+            tile.indices.push_back(i * numV + (j + 1));
+
+            tile.indices.push_back(i * numV + (j + 1));
+            tile.indices.push_back((i + 1) * numV + j);
+            tile.indices.push_back((i + 1) * numV + (j + 1));
+        }
+    }
+}
+
+void BSplineTerrain::update()
+{
+    std::vector<int> dirtyTiles;
+    for (int t = 0; t < static_cast<int>(tiles.size()); ++t)
+        if (tiles[t].dirty)
+            dirtyTiles.push_back(t);
+    if (dirtyTiles.empty())
+        return;
+
+    // Tiles are independent, each one is enough work for a job
+    JobSystem::shared().parallelFor(0, static_cast<int>(dirtyTiles.size()), 1, [&](int first, int last)
+    {
+        for (int k = first; k < last; ++k)
+            tessellateTile(dirtyTiles[k]);
+    });
+
+    // Only the GL thread touches the buffers, each tile is written into its own part of the range
+    MeshArena& arena = MeshArena::shared();
+    for (int t : dirtyTiles)
+    {
+        TerrainTile& tile = tiles[t];
+        arena.uploadVertices(mesh, tile.baseVertex, static_cast<GLsizei>(tile.vertexData.size() / TERRAIN_VERTEX_FLOATS),
+            tile.vertexData.data());
+        arena.uploadIndices(mesh, tile.firstIndex, static_cast<GLsizei>(tile.indices.size()), tile.indices.data());
+        tile.indexCount = static_cast<GLsizei>(tile.indices.size());
+
+        std::vector<float>().swap(tile.vertexData);
+        std::vector<unsigned int>().swap(tile.indices);
+        tile.dirty = false;
+    }
+}
+
+// True when the box is completely outside one of the six frustum planes
+static bool outsideFrustum(const glm::vec4 planes[6], const glm::vec3& boundsMin, const glm::vec3& boundsMax)
+{
+    for (int p = 0; p < 6; ++p)
+    {
+        // The corner of the box furthest along the plane normal
+        glm::vec3 corner(planes[p].x >= 0.0f ? boundsMax.x : boundsMin.x,
+                         planes[p].y >= 0.0f ? boundsMax.y : boundsMin.y,
+                         planes[p].z >= 0.0f ? boundsMax.z : boundsMin.z);
+        if (glm::dot(glm::vec3(planes[p]), corner) + planes[p].w < 0.0f)
+            return true;
+    }
+    return false;
+}
+
+void BSplineTerrain::Draw(Shader& shaderProgram, RenderQueue& queue, const glm::mat4& projection, const glm::mat4& view)
+{
+    // Frustum planes from the rows of projection * view (Gribb and Hartmann)
+    glm::mat4 clip = projection * view;
+    glm::vec4 rows[4];
+    for (int i = 0; i < 4; ++i)
+        rows[i] = glm::vec4(clip[0][i], clip[1][i], clip[2][i], clip[3][i]);
+    glm::vec4 planes[6] =
+    {
+        rows[3] + rows[0], rows[3] - rows[0],
+        rows[3] + rows[1], rows[3] - rows[1],
+        rows[3] + rows[2], rows[3] - rows[2]
+    };
+
+    DrawPacket packet;
+    packet.program = &shaderProgram;
+    packet.vertexArray = MeshArena::shared().getVertexArray(mesh.format);
+    packet.mode = GL_TRIANGLES;
+    packet.indexed = true;
+
+    visibleTiles = 0;
+    for (const TerrainTile& tile : tiles)
+    {
+        if (tile.indexCount == 0 || outsideFrustum(planes, tile.boundsMin, tile.boundsMax))
+            continue;
+
+        packet.count = tile.indexCount;
+        packet.first = mesh.firstIndex + tile.firstIndex;
+        packet.baseVertex = mesh.baseVertex + tile.baseVertex;
+        queue.submit(packet, RenderPass::Opaque, 0.5f * (tile.boundsMin + tile.boundsMax));
+        ++visibleTiles;
+    }
+}
+
+glm::vec3 BSplineTerrain::evaluate(float u, float v) const
+{
+    float Nu[MAX_BSPLINE_DEGREE + 1], Nv[MAX_BSPLINE_DEGREE + 1];
+    int spanU = polynomialsU.span(u);
+    int spanV = polynomialsV.span(v);
+    evaluateSpanPolynomials(polynomialsU, spanU, u, 0, Nu);
+    evaluateSpanPolynomials(polynomialsV, spanV, v, 0, Nv);
+
+    glm::vec4 A(0.0f);
+    for (int k = 0; k <= d_u; ++k)
+        for (int l = 0; l <= d_v; ++l)
+            A += Nu[k] * Nv[l] * homogeneousPoints[(spanU - d_u + k) * numControlPointsV + (spanV - d_v + l)];
+
+    return glm::vec3(A) / A.w;
+}
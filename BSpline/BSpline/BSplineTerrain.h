@@ -0,0 +1,118 @@
+#ifndef BSPLINETERRAIN_H
+#define BSPLINETERRAIN_H
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include <vector>
+#include "shaderClass.h"
+#include "BSplineBasis.h"
+#include "MeshArena.h"
+#include "RenderQueue.h"
+
+// One rectangle of knot spans of the terrain, tessellated and drawn on its own
+struct TerrainTile
+{
+    // Knot spans covered by the tile, end exclusive, and the parameter rectangle they make
+    int spanU0 = 0, spanU1 = 0;
+    int spanV0 = 0, spanV1 = 0;
+    float u0 = 0.0f, u1 = 0.0f;
+    float v0 = 0.0f, v1 = 0.0f;
+
+    // Grid samples per knot span, a power of two up to maxSamplesPerSpan
+    int samplesPerSpan = 1;
+
+    // Bounding box of the tessellated tile, used for frustum culling
+    glm::vec3 boundsMin = glm::vec3(0.0f);
+    glm::vec3 boundsMax = glm::vec3(0.0f);
+
+    // Parts of the terrain's range in the shared buffers, reserved for the finest resolution
+    GLint baseVertex = 0;
+    GLsizei vertexCapacity = 0;
+    GLsizei firstIndex = 0;
+    GLsizei indexCapacity = 0;
+    GLsizei indexCount = 0;
+
+    // Set when the control points or the resolution (of the tile or a neighbour) change
+    bool dirty = true;
+
+    // Interleaved position and normal, kept until the tile is uploaded
+    std::vector<float> vertexData;
+    std::vector<unsigned int> indices;
+};
+
+// Large spline surface split into tiles along the knot spans
+// All tiles evaluate the same control net and knot vectors, so neighbouring tiles share
+// the d boundary rows of control points and the surface keeps its full continuity.
+// Tiles are tessellated in parallel, and every tile has its own range in one shared
+// vertex and index buffer, so a tile can be culled or tessellated again on its own
+class BSplineTerrain
+{
+public:
+	// Control points are stored row by row: controlPoints[i * numControlPointsV + j]
+	// weights may be empty for a polynomial surface
+	BSplineTerrain(const std::vector<glm::vec3>& controlPoints, const std::vector<float>& weights,
+		int numControlPointsU, int numControlPointsV,
+		const std::vector<float>& knotsU, const std::vector<float>& knotsV,
+		int degreeU, int degreeV, int spansPerTile, int maxSamplesPerSpan);
+	~BSplineTerrain();
+
+	// Submits the tiles whose bounding box is inside the view frustum to the queue, one packet per
+	// tile so the near tiles are drawn first. The program must stay alive until the queue is executed
+	void Draw(Shader& shaderProgram, RenderQueue& queue, const glm::mat4& projection, const glm::mat4& view);
+
+	// Moves a control point; only the tiles it has influence on are tessellated again
+	void setControlPoint(int i, int j, const glm::vec3& point);
+
+	// Changes the number of samples per knot span of one tile (rounded to a power of two)
+	void setTileResolution(int tile, int samplesPerSpan);
+
+	// Finer tiles near the camera: the resolution is halved every lodDistance units
+	void updateLevelOfDetail(const glm::vec3& cameraPosition, float lodDistance);
+
+	// Tessellates all dirty tiles in parallel and uploads their buffer ranges
+	void update();
+
+	glm::vec3 evaluate(float u, float v) const;
+
+	int getTileCount() const { return static_cast<int>(tiles.size()); }
+	int getVisibleTileCount() const { return visibleTiles; }
+
+private:
+    std::vector<glm::vec3> controlPoints;
+    std::vector<float> weights;
+    std::vector<glm::vec4> homogeneousPoints;
+    int numControlPointsU = 0;
+    int numControlPointsV = 0;
+
+    std::vector<float> knotVectorU;
+    std::vector<float> knotVectorV;
+    int d_u = 3;
+    int d_v = 3;
+
+    SpanPolynomials polynomialsU;
+    SpanPolynomials polynomialsV;
+
+    // Stored row by row: tiles[tu * numTilesV + tv]
+    std::vector<TerrainTile> tiles;
+    int numTilesU = 0;
+    int numTilesV = 0;
+    int maxSamplesPerSpan = 8;
+    int visibleTiles = 0;
+
+    void createTiles(int spansPerTile);
+    void markDirty(int tu, int tv);
+
+    // Samples along the neighbour's shared edge, or 0 at the border of the terrain
+    int neighbourSamplesPerSpan(int tu, int tv) const;
+
+    // Runs on the worker threads, only reads the control net and writes the tile
+    void tessellateTile(int tile);
+
+    // Parameter values of the grid on the knot spans [span0, span1)
+    static void tileParameters(const std::vector<float>& knots, int span0, int span1, int samplesPerSpan, std::vector<float>& params);
+
+    // All tiles in one range of the shared buffers
+    MeshRange mesh;
+};
+
+#endif // !BSPLINETERRAIN_H
@@ -2,19 +2,14 @@
 
 Box::Box()
 {
-	VAO = 0;
-	VBO = 0;
-	EBO = 0;
-
 	GLfloat boxvertices[] =
 	{
-		//position				//Color
+		//position
 		//Bottom wall
-		-2.0f, 0.0f, 2.0f,		1.0f, 0.0f, 0.0f,
-		 2.0f, 0.0f, 2.0f,		1.0f, 0.0f, 0.0f,
-		 2.0f, 0.0f, 0.0f,		1.0f, 0.0f, 0.0f,
-		-2.0f, 0.0f, 0.0f,		1.0f, 0.0f, 0.0f
-
+		-2.0f, 0.0f, 2.0f,
+		 2.0f, 0.0f, 2.0f,
+		 2.0f, 0.0f, 0.0f,
+		-2.0f, 0.0f, 0.0f
 	};
 
 	GLuint boxindices[] =
@@ -23,37 +18,27 @@ Box::Box()
 		0, 2, 3,
 	};
 
-	glGenVertexArrays(1, &VAO);
-	glGenBuffers(1, &VBO);
-	glGenBuffers(1, &EBO);
-
-	glBindVertexArray(VAO);
-	glBindBuffer(GL_ARRAY_BUFFER, VBO);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-
-	glBufferData(GL_ARRAY_BUFFER, sizeof(boxvertices), boxvertices, GL_STATIC_DRAW);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(boxindices), boxindices, GL_STATIC_DRAW);
-
-	// position attribute
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)0);
-	glEnableVertexAttribArray(0);
-
-	//// color attribute
-	//glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)(3 * sizeof(float)));
-	//glEnableVertexAttribArray(1);
-
-
+	//The box is a range in the shared buffers, drawn from the vertex array of its format
+	MeshArena& arena = MeshArena::shared();
+	mesh = arena.allocate(VertexFormat::Position, 4, 6);
+	arena.uploadVertices(mesh, 0, 4, boxvertices);
+	arena.uploadIndices(mesh, 0, 6, boxindices);
 }
 
 Box::~Box()
 {
-	glDeleteVertexArrays(1, &VAO);
-	glDeleteBuffers(1, &VBO);
+	MeshArena::shared().free(mesh);
 }
 
-void Box::DrawBox()
+void Box::DrawBox(Shader& shaderProgram, RenderQueue& queue)
 {
-	glBindVertexArray(VAO);
-	glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
-	glBindVertexArray(0);
+	DrawPacket packet;
+	packet.program = &shaderProgram;
+	packet.vertexArray = MeshArena::shared().getVertexArray(mesh.format);
+	packet.mode = GL_TRIANGLES;
+	packet.count = mesh.indexCount;
+	packet.indexed = true;
+	packet.first = mesh.firstIndex;
+	packet.baseVertex = mesh.baseVertex;
+	queue.submit(packet, RenderPass::Opaque, glm::vec3(0.0f, 0.0f, 1.0f)); //Middle of the bottom wall
 }
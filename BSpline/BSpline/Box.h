@@ -3,6 +3,8 @@
 
 #include <glad/glad.h>
 #include <glm/glm.hpp>
+#include "MeshArena.h"
+#include "RenderQueue.h"
 
 class Box
 {
@@ -10,9 +12,10 @@ class Box
 		Box();
 		~Box();
 
-		void DrawBox();
+		//Submits the box to the queue, the program must stay alive until the queue is executed
+		void DrawBox(Shader& shaderProgram, RenderQueue& queue);
 
 	private:
-		GLuint VAO, VBO, EBO;
+		MeshRange mesh;
 };
 #endif // !BOX_H
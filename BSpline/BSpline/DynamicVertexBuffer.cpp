@@ -0,0 +1,136 @@
+#include "DynamicVertexBuffer.h"
+#include "GLState.h"
+#include "GLExtensions.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+static const size_t WRITE_ALIGNMENT = 16;
+
+static double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+DynamicVertexBuffer::DynamicVertexBuffer(size_t regionSize)
+    : regionSize(std::max<size_t>(regionSize, WRITE_ALIGNMENT))
+{
+    createBuffer();
+}
+
+DynamicVertexBuffer::~DynamicVertexBuffer()
+{
+    destroyBuffer();
+}
+
+void DynamicVertexBuffer::createBuffer()
+{
+    GLsizeiptr totalSize = static_cast<GLsizeiptr>(regionSize * REGION_COUNT);
+
+    glGenBuffers(1, &buffer);
+    GLState::bindBuffer(GL_ARRAY_BUFFER, buffer);
+    if (hasBufferStorage())
+    {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_ARRAY_BUFFER, totalSize, NULL, flags);
+        mapped = static_cast<unsigned char*>(glMapBufferRange(GL_ARRAY_BUFFER, 0, totalSize, flags));
+        if (mapped == nullptr)
+        {
+            // Immutable storage cannot be given to glBufferData, so the fallback needs a new buffer
+            std::cout << "Error: Could not map the dynamic vertex buffer, using glBufferSubData" << std::endl;
+            GLState::deleteBuffers(1, &buffer);
+            glGenBuffers(1, &buffer);
+            GLState::bindBuffer(GL_ARRAY_BUFFER, buffer);
+        }
+    }
+    if (mapped == nullptr)
+        glBufferData(GL_ARRAY_BUFFER, totalSize, NULL, GL_STREAM_DRAW);
+    GLState::bindBuffer(GL_ARRAY_BUFFER, 0);
+
+    region = 0;
+    cursor = 0;
+    regionFree = true;
+}
+
+void DynamicVertexBuffer::destroyBuffer()
+{
+    for (GLsync& fence : fences)
+    {
+        if (fence != 0)
+            glDeleteSync(fence);
+        fence = 0;
+    }
+
+    // Deleting a mapped buffer unmaps it; draws still queued from it keep their data
+    if (buffer != 0)
+        GLState::deleteBuffers(1, &buffer);
+    buffer = 0;
+    mapped = nullptr;
+}
+
+void DynamicVertexBuffer::acquireRegion()
+{
+    GLsync& fence = fences[region];
+    if (fence != 0)
+    {
+        std::chrono::steady_clock::time_point waitStart = std::chrono::steady_clock::now();
+        while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED)
+        {
+        }
+        statistics.waitSeconds += secondsSince(waitStart);
+
+        glDeleteSync(fence);
+        fence = 0;
+    }
+    regionFree = true;
+}
+
+size_t DynamicVertexBuffer::write(const void* data, size_t size)
+{
+    std::chrono::steady_clock::time_point writeStart = std::chrono::steady_clock::now();
+
+    size_t alignedCursor = (cursor + WRITE_ALIGNMENT - 1) / WRITE_ALIGNMENT * WRITE_ALIGNMENT;
+    if (alignedCursor + size > regionSize)
+    {
+        // More than a region in one frame: new regions twice as big. The draws from the old buffer
+        // are already queued and keep it alive until they are done
+        regionSize = std::max(2 * regionSize, (size + WRITE_ALIGNMENT - 1) / WRITE_ALIGNMENT * WRITE_ALIGNMENT);
+        destroyBuffer();
+        createBuffer();
+        ++statistics.regrowths;
+        alignedCursor = 0;
+    }
+
+    if (!regionFree)
+        acquireRegion();
+
+    size_t offset = region * regionSize + alignedCursor;
+    if (mapped != nullptr)
+    {
+        // Coherent mapping, the GPU sees the data without a flush
+        memcpy(mapped + offset, data, size);
+    }
+    else
+    {
+        GLState::bindBuffer(GL_ARRAY_BUFFER, buffer);
+        glBufferSubData(GL_ARRAY_BUFFER, offset, size, data);
+    }
+    cursor = alignedCursor + size;
+
+    statistics.bytesWritten += size;
+    statistics.writeSeconds += secondsSince(writeStart);
+    return offset;
+}
+
+void DynamicVertexBuffer::endFrame()
+{
+    // Passes when every draw from this region so far is done
+    if (cursor > 0)
+        fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+    region = (region + 1) % REGION_COUNT;
+    cursor = 0;
+    regionFree = false;
+    ++statistics.frames;
+}
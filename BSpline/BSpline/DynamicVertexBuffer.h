@@ -0,0 +1,69 @@
+#ifndef DYNAMICVERTEXBUFFER_H
+#define DYNAMICVERTEXBUFFER_H
+
+#include <glad/glad.h>
+#include <cstddef>
+#include <cstdint>
+
+// Streaming statistics since the start or the last resetStatistics()
+struct DynamicVertexStatistics
+{
+    uint64_t bytesWritten = 0;
+    uint64_t frames = 0;
+    double writeSeconds = 0.0;     // CPU time spent in write(), waits included
+    double waitSeconds = 0.0;      // time spent waiting for the GPU to release a region
+    int regrowths = 0;             // frames that needed a bigger region
+};
+
+// Ring buffer for vertices that change every frame (moving objects, debug lines, paths)
+// The buffer is split in three regions, one per frame in flight: a frame writes into its own
+// region and endFrame() puts a fence behind the draws from it. A region is written again only when
+// its fence has passed, three frames later, so the GPU never reads what the CPU is writing.
+// With glBufferStorage the buffer is mapped once (persistent and coherent) and write() is a plain
+// memcpy; on OpenGL 3.3 write() goes through glBufferSubData into the same regions
+class DynamicVertexBuffer
+{
+public:
+	// regionSize is the most one frame can write before the regions grow
+	explicit DynamicVertexBuffer(size_t regionSize = 1024 * 1024);
+	~DynamicVertexBuffer();
+
+	// Copies the data into this frame's region and returns its byte offset in the buffer,
+	// for glVertexAttribPointer or the first vertex of a draw. Offsets are 16 byte aligned
+	size_t write(const void* data, size_t size);
+
+	// Call once per frame after the last draw that reads from this frame's region
+	void endFrame();
+
+	// Changes when the regions grow, drawers set their attribute pointers after every write()
+	GLuint getBuffer() const { return buffer; }
+	bool isPersistent() const { return mapped != nullptr; }
+
+	const DynamicVertexStatistics& getStatistics() const { return statistics; }
+	void resetStatistics() { statistics = DynamicVertexStatistics(); }
+
+private:
+    DynamicVertexBuffer(const DynamicVertexBuffer&);
+    DynamicVertexBuffer& operator=(const DynamicVertexBuffer&);
+
+    static const int REGION_COUNT = 3;
+
+    GLuint buffer = 0;
+    unsigned char* mapped = nullptr;
+    size_t regionSize;
+
+    int region = 0;
+    size_t cursor = 0;
+    bool regionFree = false;
+    GLsync fences[REGION_COUNT] = {};
+
+    DynamicVertexStatistics statistics;
+
+    void createBuffer();
+    void destroyBuffer();
+
+    // Waits until the GPU is done with the current region
+    void acquireRegion();
+};
+
+#endif // !DYNAMICVERTEXBUFFER_H
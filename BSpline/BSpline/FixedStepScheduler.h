@@ -0,0 +1,81 @@
+#ifndef FIXEDSTEPSCHEDULER_H
+#define FIXEDSTEPSCHEDULER_H
+
+#include <cmath>
+#include <cstdint>
+
+// Runs a simulation with a fixed time step, whatever the real time between two calls is
+// Real time is collected in an accumulator and spent in whole steps; the step function only ever
+// gets the same dt, so the result depends on the number of steps and nothing else. The same
+// number of steps gives bit identical results, in a window at any frame rate or headless
+class FixedStepScheduler
+{
+public:
+	// At most maxSubsteps steps per advance(), time beyond that is dropped so a slow step
+	// (or a breakpoint) cannot make the simulation fall further and further behind
+	FixedStepScheduler(double stepSeconds, int maxSubsteps)
+		: stepSeconds(stepSeconds > 0.0 ? stepSeconds : 1.0 / 60.0), maxSubsteps(maxSubsteps > 0 ? maxSubsteps : 1)
+	{
+	}
+
+	// Adds elapsedSeconds of real time and calls step(dt) for every step that is due
+	// Returns the number of steps taken
+	template <typename StepFunction>
+	int advance(double elapsedSeconds, StepFunction step)
+	{
+		accumulator += elapsedSeconds > 0.0 ? elapsedSeconds : 0.0;
+
+		double budget = maxSubsteps * stepSeconds;
+		if (accumulator >= budget + stepSeconds)
+		{
+			// Keep the fraction of a step, so the interpolation does not jump
+			double kept = budget + std::fmod(accumulator, stepSeconds);
+			droppedTime += accumulator - kept;
+			accumulator = kept;
+		}
+
+		int steps = 0;
+		while (accumulator >= stepSeconds)
+		{
+			step(static_cast<float>(stepSeconds));
+			accumulator -= stepSeconds;
+			++stepCount;
+			++steps;
+		}
+		return steps;
+	}
+
+	// Headless: count steps back to back, as fast as they run
+	template <typename StepFunction>
+	void runSteps(uint64_t count, StepFunction step)
+	{
+		for (uint64_t i = 0; i < count; ++i)
+		{
+			step(static_cast<float>(stepSeconds));
+			++stepCount;
+		}
+	}
+
+	// How far real time is past the last step, in steps [0, 1), for interpolating the drawing
+	double getAlpha() const { return accumulator / stepSeconds; }
+
+	// Real time that is collected but not simulated yet
+	double getPendingTime() const { return accumulator; }
+
+	double getStep() const { return stepSeconds; }
+	uint64_t getStepCount() const { return stepCount; }
+	double getSimulatedTime() const { return stepCount * stepSeconds; }
+
+	// Real time thrown away by the substep clamp
+	double getDroppedTime() const { return droppedTime; }
+
+private:
+    double stepSeconds;
+    int maxSubsteps;
+
+    double accumulator = 0.0;
+    uint64_t stepCount = 0;
+    double droppedTime = 0.0;
+};
+
+#endif // !FIXEDSTEPSCHEDULER_H
@@ -0,0 +1,30 @@
+#include "FrameUniforms.h"
+#include "GLState.h"
+
+FrameUniforms::FrameUniforms()
+{
+    glGenBuffers(1, &UBO);
+    GLState::bindBuffer(GL_UNIFORM_BUFFER, UBO);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameUniformData), NULL, GL_DYNAMIC_DRAW);
+    GLState::bindBuffer(GL_UNIFORM_BUFFER, 0);
+
+    // Bound once, nothing else uses this binding point
+    GLState::bindBufferBase(GL_UNIFORM_BUFFER, FRAME_UNIFORMS_BINDING, UBO);
+}
+
+FrameUniforms::~FrameUniforms()
+{
+    GLState::deleteBuffers(1, &UBO);
+}
+
+void FrameUniforms::update(const glm::mat4& projection, const glm::mat4& view, const glm::vec3& cameraPosition, const glm::vec2& viewportSize)
+{
+    data.projection = projection;
+    data.view = view;
+    data.viewProjection = projection * view;
+    data.cameraPosition = glm::vec4(cameraPosition, 1.0f);
+    data.viewport = glm::vec4(viewportSize, 1.0f / viewportSize.x, 1.0f / viewportSize.y);
+
+    GLState::bindBuffer(GL_UNIFORM_BUFFER, UBO);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameUniformData), &data);
+}
@@ -0,0 +1,69 @@
+#include "GLExtensions.h"
+#include <GLFW/glfw3.h>
+
+PFNGLPATCHPARAMETERIPROC glad_glPatchParameteri = nullptr;
+PFNGLBUFFERSTORAGEPROC glad_glBufferStorage = nullptr;
+PFNGLGETPROGRAMBINARYPROC glad_glGetProgramBinary = nullptr;
+PFNGLPROGRAMBINARYPROC glad_glProgramBinary = nullptr;
+PFNGLPROGRAMPARAMETERIPROC glad_glProgramParameteri = nullptr;
+PFNGLMAXSHADERCOMPILERTHREADSKHRPROC glad_glMaxShaderCompilerThreadsKHR = nullptr;
+
+static bool isVersionAtLeast(int major, int minor)
+{
+	return GLVersion.major > major || (GLVersion.major == major && GLVersion.minor >= minor);
+}
+
+void loadGLExtensions()
+{
+	if (isVersionAtLeast(4, 0))
+	{
+		glad_glPatchParameteri = (PFNGLPATCHPARAMETERIPROC)glfwGetProcAddress("glPatchParameteri");
+	}
+	if (isVersionAtLeast(4, 4) || glfwExtensionSupported("GL_ARB_buffer_storage"))
+	{
+		glad_glBufferStorage = (PFNGLBUFFERSTORAGEPROC)glfwGetProcAddress("glBufferStorage");
+	}
+	if (isVersionAtLeast(4, 1) || glfwExtensionSupported("GL_ARB_get_program_binary"))
+	{
+		glad_glGetProgramBinary = (PFNGLGETPROGRAMBINARYPROC)glfwGetProcAddress("glGetProgramBinary");
+		glad_glProgramBinary = (PFNGLPROGRAMBINARYPROC)glfwGetProcAddress("glProgramBinary");
+		glad_glProgramParameteri = (PFNGLPROGRAMPARAMETERIPROC)glfwGetProcAddress("glProgramParameteri");
+	}
+	if (glfwExtensionSupported("GL_KHR_parallel_shader_compile"))
+	{
+		glad_glMaxShaderCompilerThreadsKHR = (PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)glfwGetProcAddress("glMaxShaderCompilerThreadsKHR");
+	}
+	else if (glfwExtensionSupported("GL_ARB_parallel_shader_compile"))
+	{
+		glad_glMaxShaderCompilerThreadsKHR = (PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)glfwGetProcAddress("glMaxShaderCompilerThreadsARB");
+	}
+
+	// 0xFFFFFFFF leaves the number of compiler threads to the driver
+	if (glad_glMaxShaderCompilerThreadsKHR != nullptr)
+		glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+}
+
+bool hasTessellationShaders()
+{
+	return isVersionAtLeast(4, 0) && glad_glPatchParameteri != nullptr;
+}
+
+bool hasBufferStorage()
+{
+	return glad_glBufferStorage != nullptr;
+}
+
+bool hasProgramBinary()
+{
+	if (glad_glGetProgramBinary == nullptr || glad_glProgramBinary == nullptr || glad_glProgramParameteri == nullptr)
+		return false;
+
+	GLint formats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+	return formats > 0;
+}
+
+bool hasParallelShaderCompile()
+{
+	return glad_glMaxShaderCompilerThreadsKHR != nullptr;
+}
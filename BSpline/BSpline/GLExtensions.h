@@ -0,0 +1,91 @@
+#ifndef GLEXTENSIONS_H
+#define GLEXTENSIONS_H
+
+#include <glad/glad.h>
+
+// glad in dependencies is generated for OpenGL 3.3 core only
+// The few newer entry points we use are loaded here at runtime, and are null when the driver lacks them
+
+// OpenGL 4.0 tessellation shaders
+#ifndef GL_PATCHES
+#define GL_PATCHES 0x000E
+#endif
+#ifndef GL_PATCH_VERTICES
+#define GL_PATCH_VERTICES 0x8E72
+#endif
+#ifndef GL_MAX_PATCH_VERTICES
+#define GL_MAX_PATCH_VERTICES 0x8E7D
+#endif
+#ifndef GL_TESS_CONTROL_SHADER
+#define GL_TESS_CONTROL_SHADER 0x8E88
+#endif
+#ifndef GL_TESS_EVALUATION_SHADER
+#define GL_TESS_EVALUATION_SHADER 0x8E87
+#endif
+
+typedef void (APIENTRYP PFNGLPATCHPARAMETERIPROC)(GLenum pname, GLint value);
+extern PFNGLPATCHPARAMETERIPROC glad_glPatchParameteri;
+#define glPatchParameteri glad_glPatchParameteri
+
+// OpenGL 4.4 (or ARB_buffer_storage) immutable buffers that can stay mapped while they are drawn from
+#ifndef GL_MAP_PERSISTENT_BIT
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#endif
+#ifndef GL_MAP_COHERENT_BIT
+#define GL_MAP_COHERENT_BIT 0x0080
+#endif
+#ifndef GL_DYNAMIC_STORAGE_BIT
+#define GL_DYNAMIC_STORAGE_BIT 0x0100
+#endif
+
+typedef void (APIENTRYP PFNGLBUFFERSTORAGEPROC)(GLenum target, GLsizeiptr size, const void* data, GLbitfield flags);
+extern PFNGLBUFFERSTORAGEPROC glad_glBufferStorage;
+#define glBufferStorage glad_glBufferStorage
+
+// OpenGL 4.1 (or ARB_get_program_binary) linked programs saved and loaded as driver binaries
+#ifndef GL_PROGRAM_BINARY_RETRIEVABLE_HINT
+#define GL_PROGRAM_BINARY_RETRIEVABLE_HINT 0x8257
+#endif
+#ifndef GL_PROGRAM_BINARY_LENGTH
+#define GL_PROGRAM_BINARY_LENGTH 0x8741
+#endif
+#ifndef GL_NUM_PROGRAM_BINARY_FORMATS
+#define GL_NUM_PROGRAM_BINARY_FORMATS 0x87FE
+#endif
+
+typedef void (APIENTRYP PFNGLGETPROGRAMBINARYPROC)(GLuint program, GLsizei bufSize, GLsizei* length, GLenum* binaryFormat, void* binary);
+typedef void (APIENTRYP PFNGLPROGRAMBINARYPROC)(GLuint program, GLenum binaryFormat, const void* binary, GLsizei length);
+typedef void (APIENTRYP PFNGLPROGRAMPARAMETERIPROC)(GLuint program, GLenum pname, GLint value);
+extern PFNGLGETPROGRAMBINARYPROC glad_glGetProgramBinary;
+extern PFNGLPROGRAMBINARYPROC glad_glProgramBinary;
+extern PFNGLPROGRAMPARAMETERIPROC glad_glProgramParameteri;
+#define glGetProgramBinary glad_glGetProgramBinary
+#define glProgramBinary glad_glProgramBinary
+#define glProgramParameteri glad_glProgramParameteri
+
+// KHR_parallel_shader_compile (or the ARB version): compiles and links run on driver threads, and
+// GL_COMPLETION_STATUS_KHR tells whether they are done without waiting for them
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+
+typedef void (APIENTRYP PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)(GLuint count);
+extern PFNGLMAXSHADERCOMPILERTHREADSKHRPROC glad_glMaxShaderCompilerThreadsKHR;
+#define glMaxShaderCompilerThreadsKHR glad_glMaxShaderCompilerThreadsKHR
+
+// Loads the entry points above, call after gladLoadGL with the context current
+void loadGLExtensions();
+
+// True when the context is 4.0 or newer and glPatchParameteri was found
+bool hasTessellationShaders();
+
+// True when glBufferStorage was found, from 4.4 or the extension
+bool hasBufferStorage();
+
+// True when programs can be saved as binaries, the driver has at least one binary format
+bool hasProgramBinary();
+
+// True when the driver compiles on its own threads, loadGLExtensions lets it use as many as it wants
+bool hasParallelShaderCompile();
+
+#endif // !GLEXTENSIONS_H
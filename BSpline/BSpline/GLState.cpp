@@ -0,0 +1,228 @@
+#include "GLState.h"
+#include <unordered_map>
+
+// Not set through GLState yet (or forgotten), the next call always goes to OpenGL
+static const GLuint UNKNOWN = ~0u;
+
+static const GLuint TRACKED_TEXTURE_UNITS = 16;
+static const int TRACKED_TEXTURE_TARGETS = 2; // GL_TEXTURE_2D and GL_TEXTURE_BUFFER
+
+namespace
+{
+    struct TrackedState
+    {
+        GLuint program;
+        GLuint vertexArray;
+        GLuint arrayBuffer;
+        GLuint elementBuffer; // Of the bound vertex array
+        GLuint uniformBuffer;
+        GLuint activeUnit;
+        GLuint textures[TRACKED_TEXTURE_UNITS][TRACKED_TEXTURE_TARGETS];
+        GLenum polygonMode;
+        std::unordered_map<GLenum, bool> enabled;
+
+        TrackedState() { forget(); }
+
+        void forget()
+        {
+            program = vertexArray = arrayBuffer = elementBuffer = uniformBuffer = activeUnit = UNKNOWN;
+            for (GLuint unit = 0; unit < TRACKED_TEXTURE_UNITS; ++unit)
+                for (int target = 0; target < TRACKED_TEXTURE_TARGETS; ++target)
+                    textures[unit][target] = UNKNOWN;
+            polygonMode = UNKNOWN;
+            enabled.clear();
+        }
+    };
+}
+
+static TrackedState tracked;
+static GLStateStatistics frameStatistics;
+static GLStateStatistics lastFrameStatistics;
+static GLStateStatistics totalStatistics;
+
+// True when the value is set already, else it is remembered and the caller passes it on
+static bool alreadySet(GLuint& remembered, GLuint value)
+{
+    if (remembered == value)
+    {
+        ++frameStatistics.skipped;
+        return true;
+    }
+    remembered = value;
+    ++frameStatistics.issued;
+    return false;
+}
+
+// Where the binding of a buffer target is remembered, NULL for targets that are not
+static GLuint* trackedBuffer(GLenum target)
+{
+    switch (target)
+    {
+    case GL_ARRAY_BUFFER: return &tracked.arrayBuffer;
+    case GL_ELEMENT_ARRAY_BUFFER: return &tracked.elementBuffer;
+    case GL_UNIFORM_BUFFER: return &tracked.uniformBuffer;
+    default: return nullptr;
+    }
+}
+
+static int trackedTextureTarget(GLenum target)
+{
+    switch (target)
+    {
+    case GL_TEXTURE_2D: return 0;
+    case GL_TEXTURE_BUFFER: return 1;
+    default: return -1;
+    }
+}
+
+void GLState::useProgram(GLuint program)
+{
+    if (!alreadySet(tracked.program, program))
+        glUseProgram(program);
+}
+
+void GLState::bindVertexArray(GLuint vertexArray)
+{
+    if (alreadySet(tracked.vertexArray, vertexArray))
+        return;
+    glBindVertexArray(vertexArray);
+    tracked.elementBuffer = UNKNOWN; // The element buffer binding belongs to the vertex array
+}
+
+void GLState::bindBuffer(GLenum target, GLuint buffer)
+{
+    GLuint* remembered = trackedBuffer(target);
+    if (remembered == nullptr)
+    {
+        ++frameStatistics.issued;
+        glBindBuffer(target, buffer);
+    }
+    else if (!alreadySet(*remembered, buffer))
+    {
+        glBindBuffer(target, buffer);
+    }
+}
+
+void GLState::bindBufferBase(GLenum target, GLuint index, GLuint buffer)
+{
+    // Indexed bindings are not remembered, but the call binds the target as well
+    ++frameStatistics.issued;
+    glBindBufferBase(target, index, buffer);
+    GLuint* remembered = trackedBuffer(target);
+    if (remembered != nullptr)
+        *remembered = buffer;
+}
+
+void GLState::bindTexture(GLuint unit, GLenum target, GLuint texture)
+{
+    int targetIndex = trackedTextureTarget(target);
+    if (unit < TRACKED_TEXTURE_UNITS && targetIndex >= 0 && tracked.textures[unit][targetIndex] == texture)
+    {
+        ++frameStatistics.skipped;
+        return;
+    }
+
+    if (!alreadySet(tracked.activeUnit, unit))
+        glActiveTexture(GL_TEXTURE0 + unit);
+    ++frameStatistics.issued;
+    glBindTexture(target, texture);
+    if (unit < TRACKED_TEXTURE_UNITS && targetIndex >= 0)
+        tracked.textures[unit][targetIndex] = texture;
+}
+
+void GLState::setEnabled(GLenum capability, bool enabled)
+{
+    auto found = tracked.enabled.find(capability);
+    if (found != tracked.enabled.end() && found->second == enabled)
+    {
+        ++frameStatistics.skipped;
+        return;
+    }
+    tracked.enabled[capability] = enabled;
+    ++frameStatistics.issued;
+    if (enabled)
+        glEnable(capability);
+    else
+        glDisable(capability);
+}
+
+void GLState::polygonMode(GLenum mode)
+{
+    if (!alreadySet(tracked.polygonMode, mode))
+        glPolygonMode(GL_FRONT_AND_BACK, mode);
+}
+
+void GLState::deleteProgram(GLuint program)
+{
+    // A deleted program stays in use until another one is, but its name may come back
+    if (program != 0 && tracked.program == program)
+        tracked.program = UNKNOWN;
+    glDeleteProgram(program);
+}
+
+void GLState::deleteVertexArrays(GLsizei count, const GLuint* vertexArrays)
+{
+    // OpenGL binds 0 in place of a deleted vertex array or buffer that is bound
+    for (GLsizei i = 0; i < count; ++i)
+    {
+        if (vertexArrays[i] != 0 && tracked.vertexArray == vertexArrays[i])
+        {
+            tracked.vertexArray = 0;
+            tracked.elementBuffer = UNKNOWN;
+        }
+    }
+    glDeleteVertexArrays(count, vertexArrays);
+}
+
+void GLState::deleteBuffers(GLsizei count, const GLuint* buffers)
+{
+    for (GLsizei i = 0; i < count; ++i)
+    {
+        if (buffers[i] == 0)
+            continue;
+        if (tracked.arrayBuffer == buffers[i])
+            tracked.arrayBuffer = 0;
+        if (tracked.elementBuffer == buffers[i])
+            tracked.elementBuffer = 0;
+        if (tracked.uniformBuffer == buffers[i])
+            tracked.uniformBuffer = 0;
+    }
+    glDeleteBuffers(count, buffers);
+}
+
+void GLState::deleteTextures(GLsizei count, const GLuint* textures)
+{
+    for (GLsizei i = 0; i < count; ++i)
+    {
+        if (textures[i] == 0)
+            continue;
+        for (GLuint unit = 0; unit < TRACKED_TEXTURE_UNITS; ++unit)
+            for (int target = 0; target < TRACKED_TEXTURE_TARGETS; ++target)
+                if (tracked.textures[unit][target] == textures[i])
+                    tracked.textures[unit][target] = 0;
+    }
+    glDeleteTextures(count, textures);
+}
+
+void GLState::invalidate()
+{
+    tracked.forget();
+}
+
+void GLState::endFrame()
+{
+    totalStatistics.issued += frameStatistics.issued;
+    totalStatistics.skipped += frameStatistics.skipped;
+    lastFrameStatistics = frameStatistics;
+    frameStatistics = GLStateStatistics();
+}
+
+const GLStateStatistics& GLState::getLastFrameStatistics()
+{
+    return lastFrameStatistics;
+}
+
+const GLStateStatistics& GLState::getTotalStatistics()
+{
+    return totalStatistics;
+}
@@ -0,0 +1,53 @@
+#ifndef GLSTATE_H
+#define GLSTATE_H
+
+#include <glad/glad.h>
+#include <cstdint>
+
+// State calls of one frame, or of all frames
+struct GLStateStatistics
+{
+    uint64_t issued = 0;   // calls passed on to OpenGL
+    uint64_t skipped = 0;  // calls that would have set what was already set
+};
+
+// The OpenGL state of the render context as last set through here
+// Draw and setup code binds programs, vertex arrays, buffers and textures through GLState, which
+// only calls OpenGL when the binding changes. That lets draw functions bind what they need without
+// unbinding afterwards: the next draw that uses the same program or vertex array costs nothing.
+// Everything on the render thread has to go through here (or call invalidate() afterwards), else the
+// remembered state is wrong. Other contexts, like the upload thread's, have their own state and
+// call OpenGL directly
+class GLState
+{
+public:
+	static void useProgram(GLuint program);
+	static void bindVertexArray(GLuint vertexArray);
+
+	// GL_ARRAY_BUFFER, GL_UNIFORM_BUFFER and GL_ELEMENT_ARRAY_BUFFER are remembered, the element
+	// buffer as part of the bound vertex array. Other targets are passed on every time
+	static void bindBuffer(GLenum target, GLuint buffer);
+	static void bindBufferBase(GLenum target, GLuint index, GLuint buffer);
+
+	// Binds to a texture unit (0, 1, ...), switching the active unit only when needed
+	static void bindTexture(GLuint unit, GLenum target, GLuint texture);
+
+	static void setEnabled(GLenum capability, bool enabled);
+	static void polygonMode(GLenum mode); // For GL_FRONT_AND_BACK
+
+	// Delete and forget the bindings of the deleted names, they can be handed out again
+	static void deleteProgram(GLuint program);
+	static void deleteVertexArrays(GLsizei count, const GLuint* vertexArrays);
+	static void deleteBuffers(GLsizei count, const GLuint* buffers);
+	static void deleteTextures(GLsizei count, const GLuint* textures);
+
+	// Forgets everything, the next call of each kind goes to OpenGL
+	static void invalidate();
+
+	// Call once per frame, after the last draw
+	static void endFrame();
+	static const GLStateStatistics& getLastFrameStatistics();
+	static const GLStateStatistics& getTotalStatistics();
+};
+
+#endif // !GLSTATE_H
@@ -0,0 +1,321 @@
+#include "JobSystem.h"
+#include <algorithm>
+#include <chrono>
+
+struct Job
+{
+    std::function<void()> work;
+
+    // parallelFor pieces report to their group when they finish
+    JobHandle parent;
+
+    // The job itself plus the pieces that still run for it
+    std::atomic<int> unfinished{ 1 };
+
+    // Dependencies that are not finished yet, the job is queued when this reaches 0
+    std::atomic<int> waitingFor{ 0 };
+
+    // Guards continuations, so a continuation is either registered before finish or sees finished
+    std::mutex mutex;
+    std::atomic<bool> finished{ false };
+    std::vector<JobHandle> continuations;
+};
+
+// Workers know which system and which deque they belong to
+static thread_local const JobSystem* workerSystem = nullptr;
+static thread_local int workerIndex = -1;
+
+JobSystem::JobSystem(int numWorkers)
+{
+    if (numWorkers <= 0)
+        numWorkers = static_cast<int>(std::thread::hardware_concurrency()) - 1;
+    numWorkers = std::max(numWorkers, 1);
+
+    for (int i = 0; i < numWorkers; ++i)
+        workers.emplace_back(new Worker());
+    for (int i = 0; i <= numWorkers; ++i)
+        counters.emplace_back(new Counters());
+
+    for (int i = 0; i < numWorkers; ++i)
+        threads.emplace_back(&JobSystem::workerLoop, this, i);
+}
+
+JobSystem::~JobSystem()
+{
+    stopping = true;
+    wake(true);
+    for (auto& thread : threads)
+        thread.join();
+}
+
+JobSystem& JobSystem::shared()
+{
+    static JobSystem system;
+    return system;
+}
+
+int JobSystem::currentWorker() const
+{
+    return workerSystem == this ? workerIndex : -1;
+}
+
+void JobSystem::wake(bool all)
+{
+    // Taking the mutex orders the notify after a sleeper has checked its condition
+    if (sleepers > 0 || stopping)
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        if (all)
+            wakeCondition.notify_all();
+        else
+            wakeCondition.notify_one();
+    }
+}
+
+void JobSystem::push(const JobHandle& job)
+{
+    // Workers keep their own jobs, other threads spread theirs over the workers
+    int index = currentWorker();
+    if (index < 0)
+        index = static_cast<int>(nextExternalQueue++ % workers.size());
+
+    {
+        std::lock_guard<std::mutex> lock(workers[index]->mutex);
+        workers[index]->jobs.push_back(job);
+    }
+    ++queuedJobs;
+
+    // Any sleeper can take it, a worker or a thread in wait()
+    wake(false);
+}
+
+JobHandle JobSystem::pop(int worker)
+{
+    std::lock_guard<std::mutex> lock(workers[worker]->mutex);
+    std::deque<JobHandle>& jobs = workers[worker]->jobs;
+    if (jobs.empty())
+        return JobHandle();
+
+    JobHandle job = std::move(jobs.back());
+    jobs.pop_back();
+    --queuedJobs;
+    return job;
+}
+
+JobHandle JobSystem::steal(int thief, Counters& counter)
+{
+    // Start after the thief, so the thieves do not all go for the same deque
+    int count = static_cast<int>(workers.size());
+    for (int k = 1; k <= count; ++k)
+    {
+        int victim = (std::max(thief, 0) + k) % count;
+        if (victim == thief)
+            continue;
+
+        std::lock_guard<std::mutex> lock(workers[victim]->mutex);
+        std::deque<JobHandle>& jobs = workers[victim]->jobs;
+        if (jobs.empty())
+        {
+            counter.failedSteals.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+
+        JobHandle job = std::move(jobs.front());
+        jobs.pop_front();
+        --queuedJobs;
+        counter.stolen.fetch_add(1, std::memory_order_relaxed);
+        return job;
+    }
+    return JobHandle();
+}
+
+bool JobSystem::runOne(int worker)
+{
+    Counters& counter = *counters[worker >= 0 ? worker : workers.size()];
+
+    JobHandle job;
+    if (worker >= 0)
+        job = pop(worker);
+    if (!job && queuedJobs > 0)
+        job = steal(worker, counter);
+    if (!job)
+        return false;
+
+    run(job, counter);
+    return true;
+}
+
+void JobSystem::run(const JobHandle& job, Counters& counter)
+{
+    job->work();
+    job->work = nullptr;
+    counter.executed.fetch_add(1, std::memory_order_relaxed);
+    finish(job);
+}
+
+void JobSystem::finish(const JobHandle& job)
+{
+    if (job->unfinished.fetch_sub(1) != 1)
+        return;
+
+    std::vector<JobHandle> ready;
+    {
+        std::lock_guard<std::mutex> lock(job->mutex);
+        job->finished = true;
+        ready.swap(job->continuations);
+    }
+    for (const JobHandle& continuation : ready)
+    {
+        if (continuation->waitingFor.fetch_sub(1) == 1)
+            push(continuation);
+    }
+
+    if (job->parent)
+        finish(job->parent);
+
+    // Threads in wait() sleep on the same condition as the workers, only all of them together
+    // are sure to reach the one that waits for this job
+    if (waiters > 0)
+        wake(true);
+}
+
+void JobSystem::workerLoop(int index)
+{
+    workerSystem = this;
+    workerIndex = index;
+    Counters& counter = *counters[index];
+
+    while (!stopping)
+    {
+        if (runOne(index))
+            continue;
+
+        std::chrono::steady_clock::time_point idleStart = std::chrono::steady_clock::now();
+        {
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            ++sleepers;
+            wakeCondition.wait(lock, [this]() { return queuedJobs > 0 || stopping; });
+            --sleepers;
+        }
+        counter.idleNanoseconds.fetch_add(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - idleStart).count()), std::memory_order_relaxed);
+    }
+}
+
+JobHandle JobSystem::submit(std::function<void()> work)
+{
+    return submit(std::move(work), std::vector<JobHandle>());
+}
+
+JobHandle JobSystem::submit(std::function<void()> work, const std::vector<JobHandle>& dependencies)
+{
+    JobHandle job = std::make_shared<Job>();
+    job->work = std::move(work);
+
+    // Held by the submitter until all dependencies are registered, so the job cannot start early
+    job->waitingFor = 1;
+    for (const JobHandle& dependency : dependencies)
+    {
+        if (!dependency)
+            continue;
+
+        std::lock_guard<std::mutex> lock(dependency->mutex);
+        if (!dependency->finished)
+        {
+            ++job->waitingFor;
+            dependency->continuations.push_back(job);
+        }
+    }
+
+    if (job->waitingFor.fetch_sub(1) == 1)
+        push(job);
+    return job;
+}
+
+bool JobSystem::isFinished(const JobHandle& job)
+{
+    return !job || job->finished;
+}
+
+void JobSystem::wait(const JobHandle& job)
+{
+    int worker = currentWorker();
+    while (!isFinished(job))
+    {
+        if (runOne(worker))
+            continue;
+
+        // Nothing to run here, the job is running on another thread or waits for one
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        ++sleepers;
+        ++waiters;
+        wakeCondition.wait(lock, [&]() { return queuedJobs > 0 || isFinished(job) || stopping; });
+        --waiters;
+        --sleepers;
+        if (stopping)
+            return;
+    }
+}
+
+void JobSystem::splitRange(const JobHandle& group, int first, int last, int grainSize, const std::function<void(int, int)>& body)
+{
+    while (last - first > grainSize)
+    {
+        int middle = first + (last - first) / 2;
+
+        JobHandle piece = std::make_shared<Job>();
+        piece->parent = group;
+        ++group->unfinished;
+        piece->work = [this, group, middle, last, grainSize, &body]()
+        {
+            splitRange(group, middle, last, grainSize, body);
+        };
+        push(piece);
+
+        last = middle;
+    }
+    body(first, last);
+}
+
+void JobSystem::parallelFor(int begin, int end, int grainSize, const std::function<void(int, int)>& body)
+{
+    grainSize = std::max(grainSize, 1);
+    if (end - begin <= grainSize)
+    {
+        if (end > begin)
+            body(begin, end);
+        return;
+    }
+
+    // The group finishes when the calling thread's part and every piece are done
+    JobHandle group = std::make_shared<Job>();
+    splitRange(group, begin, end, grainSize, body);
+    finish(group);
+    wait(group);
+}
+
+JobSystemStatistics JobSystem::getStatistics() const
+{
+    JobSystemStatistics statistics;
+    uint64_t idleNanoseconds = 0;
+    for (const auto& counter : counters)
+    {
+        statistics.jobsExecuted += counter->executed.load(std::memory_order_relaxed);
+        statistics.jobsStolen += counter->stolen.load(std::memory_order_relaxed);
+        statistics.failedSteals += counter->failedSteals.load(std::memory_order_relaxed);
+        idleNanoseconds += counter->idleNanoseconds.load(std::memory_order_relaxed);
+    }
+    statistics.idleSeconds = idleNanoseconds * 1e-9;
+    return statistics;
+}
+
+void JobSystem::resetStatistics()
+{
+    for (auto& counter : counters)
+    {
+        counter->executed = 0;
+        counter->stolen = 0;
+        counter->failedSteals = 0;
+        counter->idleNanoseconds = 0;
+    }
+}
@@ -0,0 +1,108 @@
+#ifndef JOBSYSTEM_H
+#define JOBSYSTEM_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct Job;
+typedef std::shared_ptr<Job> JobHandle;
+
+// Counters summed over all threads since the start or the last resetStatistics()
+struct JobSystemStatistics
+{
+    uint64_t jobsExecuted = 0;
+    uint64_t jobsStolen = 0;      // taken from the deque of another worker
+    uint64_t failedSteals = 0;    // the deque that was tried was empty
+    double idleSeconds = 0.0;     // time the workers slept because there was nothing to do
+
+    double stealRate() const { return jobsExecuted > 0 ? static_cast<double>(jobsStolen) / jobsExecuted : 0.0; }
+};
+
+// Work stealing job system
+// Every worker has its own deque: it pushes and pops new jobs at the back (the newest job is
+// warm in the cache), and a worker that runs dry steals from the front of another deque, where
+// the oldest and, for parallelFor, the biggest pieces are. A thread that waits for a job runs
+// other jobs in the meantime, so jobs may wait for jobs without blocking a worker
+class JobSystem
+{
+public:
+	// numWorkers 0: one worker per hardware thread, less the thread that submits and waits
+	explicit JobSystem(int numWorkers = 0);
+	~JobSystem();
+
+	// The job system used by the whole program, started on first use
+	static JobSystem& shared();
+
+	int getWorkerCount() const { return static_cast<int>(workers.size()); }
+
+	JobHandle submit(std::function<void()> work);
+
+	// Continuation: work starts when all dependencies are finished (empty handles are ignored)
+	JobHandle submit(std::function<void()> work, const std::vector<JobHandle>& dependencies);
+
+	// Returns when the job is finished, the calling thread runs other jobs while it waits
+	void wait(const JobHandle& job);
+	static bool isFinished(const JobHandle& job);
+
+	// Calls body(first, last) for pieces of [begin, end) of at most grainSize elements and returns
+	// when all are done. The range is split in halves, one half is left to be stolen and the
+	// calling thread goes on with the other, so big pieces move between threads and small ones do not
+	void parallelFor(int begin, int end, int grainSize, const std::function<void(int, int)>& body);
+
+	JobSystemStatistics getStatistics() const;
+	void resetStatistics();
+
+private:
+    struct Worker
+    {
+        std::mutex mutex;
+        std::deque<JobHandle> jobs;
+    };
+
+    // One set per worker and a last one shared by all other threads
+    struct Counters
+    {
+        std::atomic<uint64_t> executed{ 0 };
+        std::atomic<uint64_t> stolen{ 0 };
+        std::atomic<uint64_t> failedSteals{ 0 };
+        std::atomic<uint64_t> idleNanoseconds{ 0 };
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::unique_ptr<Counters>> counters;
+    std::vector<std::thread> threads;
+
+    std::atomic<int> queuedJobs{ 0 };
+    std::atomic<unsigned int> nextExternalQueue{ 0 };
+
+    // Sleeping workers and waiting threads, woken by new jobs and finished jobs
+    std::mutex sleepMutex;
+    std::condition_variable wakeCondition;
+    std::atomic<int> sleepers{ 0 };
+    std::atomic<int> waiters{ 0 };
+    std::atomic<bool> stopping{ false };
+
+    void workerLoop(int index);
+
+    // Index of the calling thread's worker, -1 for threads that are not workers of this system
+    int currentWorker() const;
+
+    void push(const JobHandle& job);
+    JobHandle pop(int worker);
+    JobHandle steal(int thief, Counters& counter);
+    bool runOne(int worker);
+    void run(const JobHandle& job, Counters& counter);
+    void finish(const JobHandle& job);
+    void wake(bool all);
+
+    void splitRange(const JobHandle& group, int first, int last, int grainSize, const std::function<void(int, int)>& body);
+};
+
+#endif // !JOBSYSTEM_H
@@ -6,9 +6,30 @@
 #include <glm/gtc/type_ptr.hpp>
 
 #include "shaderClass.h"
+#include "GLExtensions.h"
 #include "Camera.h"
 //#include "Box.h"
 #include "BSplineSurface.h"
+#include "BSplineTerrain.h"
+#include "BSplineCurve.h"
+#include "SurfaceBVH.h"
+#include "RollingBalls.h"
+#include "SimulationThread.h"
+#include "FixedStepScheduler.h"
+#include "TessellationCache.h"
+#include "UploadService.h"
+#include "DynamicVertexBuffer.h"
+#include "FrameUniforms.h"
+#include "ShaderVariants.h"
+#include "GLState.h"
+#include "RenderQueue.h"
+#include "MeshArena.h"
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <random>
 
 
 using namespace std;
@@ -28,18 +49,185 @@ bool firstMouse = true;
 float deltaTime = 0.0f;	// Time between current frame and last frame
 float lastFrame = 0.0f;
 
+int viewportWidth = SCR_WIDTH;
+int viewportHeight = SCR_HEIGHT;
 
-int main()
+// Press T to switch between the CPU mesh and GPU tessellation of the surface
+bool useHardwareTessellation = true;
+
+// Press R to tessellate the CPU mesh adaptively for the current camera
+bool adaptiveTessellationRequested = false;
+
+// Press P to pick the point on the surface in the middle of the screen
+bool pickRequested = false;
+
+// Press N to show the vertex normals of the CPU mesh
+bool showNormals = false;
+
+// Press L to shade the surface with the exact spline normal per pixel, on a coarse mesh
+bool useAnalyticShading = false;
+
+// Press G to print how many state changes the last frame sent to OpenGL and how many were skipped,
+// and how many the sorting of the render queue saved
+bool stateStatisticsRequested = false;
+
+
+// Simulation rate, the same in the window and headless
+const double SIMULATION_TICKS_PER_SECOND = 120.0;
+
+void addStartBalls(RollingBalls& balls)
+{
+	for (int i = 0; i < 5; ++i)
+		balls.addBall(glm::vec3(1.6f + 0.2f * i, 0.9f + 0.05f * i, 2.5f));
+}
+
+// BSpline --headless N runs N simulation steps as fast as possible, without a window or OpenGL
+// The checksum of the final state is the same for every run of the same build
+int runHeadless(uint64_t steps)
+{
+	BSplineSurface bsplineSurface;
+	RollingBalls balls(bsplineSurface, 0.05f);
+	addStartBalls(balls);
+
+	FixedStepScheduler scheduler(1.0 / SIMULATION_TICKS_PER_SECOND, 1);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	scheduler.runSteps(steps, [&](float dt) { balls.step(dt); });
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	// Field by field, the padding in Ball is not part of the state
+	uint64_t checksum = FNV_OFFSET_BASIS;
+	for (const Ball& ball : balls.getBalls())
+	{
+		checksum = hashBytes(&ball.position, sizeof(ball.position), checksum);
+		checksum = hashBytes(&ball.velocity, sizeof(ball.velocity), checksum);
+	}
+	std::cout << "Headless: " << steps << " steps (" << scheduler.getSimulatedTime() << " s simulated) in " << seconds << " s, "
+		<< (seconds > 0.0 ? steps / seconds : 0.0) << " steps per second" << std::endl;
+	std::cout << "State checksum: " << std::hex << checksum << std::dec << std::endl;
+	return 0;
+}
+
+// BSpline --check-projection N compares projectPoints with a brute force search over a 301 x 301 grid
+// for N random queries, N queries close to the surface and N queries past its boundary, without OpenGL
+// Returns 1 when any projection is further away than the brute force one
+int runProjectionCheck(int count)
+{
+	BSplineSurface bsplineSurface;
+	float uMin, uMax, vMin, vMax;
+	bsplineSurface.getDomain(uMin, uMax, vMin, vMax);
+
+	const int GRID = 301;
+	std::vector<glm::vec3> grid(GRID * GRID);
+	glm::vec3 boundsMin(FLT_MAX), boundsMax(-FLT_MAX);
+	for (int i = 0; i < GRID; ++i)
+	{
+		for (int j = 0; j < GRID; ++j)
+		{
+			glm::vec3 point = bsplineSurface.evaluate(uMin + (uMax - uMin) * i / (GRID - 1), vMin + (vMax - vMin) * j / (GRID - 1));
+			grid[i * GRID + j] = point;
+			boundsMin = glm::min(boundsMin, point);
+			boundsMax = glm::max(boundsMax, point);
+		}
+	}
+
+	std::mt19937 random(1);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	const char* names[3] = { "random", "near", "past the boundary" };
+	bool failed = false;
+	for (int set = 0; set < 3; ++set)
+	{
+		std::vector<glm::vec3> queries(count);
+		for (glm::vec3& query : queries)
+		{
+			float u = uMin + (uMax - uMin) * unit(random);
+			float v = vMin + (vMax - vMin) * unit(random);
+			glm::vec3 point, du, dv;
+			if (set == 0)
+			{
+				// Anywhere in the bounding box grown by 1
+				glm::vec3 t(unit(random), unit(random), unit(random));
+				query = boundsMin - glm::vec3(1.0f) + t * (boundsMax - boundsMin + glm::vec3(2.0f));
+			}
+			else if (set == 1)
+			{
+				// Within 0.3 of the surface along the normal
+				bsplineSurface.evaluateDerivatives(u, v, point, du, dv);
+				query = point + (unit(random) * 0.6f - 0.3f) * glm::normalize(glm::cross(du, dv));
+			}
+			else
+			{
+				// Out from a boundary edge along the tangent that leaves the domain, and off the surface
+				// along the normal, so the closest point is mostly on the boundary
+				int edge = static_cast<int>(unit(random) * 4.0f) % 4;
+				u = edge == 0 ? uMin : edge == 1 ? uMax : u;
+				v = edge == 2 ? vMin : edge == 3 ? vMax : v;
+				bsplineSurface.evaluateDerivatives(u, v, point, du, dv);
+				glm::vec3 outwards = edge == 0 ? -du : edge == 1 ? du : edge == 2 ? -dv : dv;
+				query = point + unit(random) * glm::normalize(outwards)
+					+ (unit(random) - 0.5f) * glm::normalize(glm::cross(du, dv));
+			}
+		}
+
+		std::vector<SurfaceProjection> results;
+		bsplineSurface.projectPoints(queries, results);
+
+		int worse = 0, onBoundary = 0;
+		float worst = 0.0f;
+		for (int q = 0; q < count; ++q)
+		{
+			float nearest = FLT_MAX;
+			int nearestSample = 0;
+			for (int g = 0; g < GRID * GRID; ++g)
+			{
+				float distance = glm::length(grid[g] - queries[q]);
+				if (distance < nearest)
+				{
+					nearest = distance;
+					nearestSample = g;
+				}
+			}
+			int i = nearestSample / GRID, j = nearestSample % GRID;
+			if (i == 0 || i == GRID - 1 || j == 0 || j == GRID - 1)
+				++onBoundary;
+
+			// The grid can only be further away than the true closest point, so this allows for rounding only
+			float excess = results[q].distance - nearest;
+			if (excess > 1e-4f)
+			{
+				++worse;
+				worst = std::max(worst, excess);
+			}
+		}
+		std::cout << "Projection check, " << names[set] << ": further than brute force in " << worse << " of " << count
+			<< " (by up to " << worst << "), closest sample on the boundary for " << onBoundary << std::endl;
+		failed = failed || worse > 0;
+	}
+	return failed ? 1 : 0;
+}
+
+int main(int argc, char* argv[])
 {
+	if (argc >= 3 && strcmp(argv[1], "--headless") == 0)
+		return runHeadless(strtoull(argv[2], NULL, 10));
+	if (argc >= 3 && strcmp(argv[1], "--check-projection") == 0)
+		return runProjectionCheck(atoi(argv[2]));
+
 	glfwInit(); //Initialize GLFW
 
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3); 
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+	// Ask for OpenGL 4.0 first for the tessellation shaders, then fall back to 3.3
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4); 
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 0);
 	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
 	//glfw window creation
 	GLFWwindow* window = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, "Oblig 1", NULL, NULL);
 	if (window == NULL)
+	{
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+		window = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, "Oblig 1", NULL, NULL);
+	}
+	if (window == NULL)
 	{
 		std::cout << "Failed to create GLFW window" << std::endl;
 		glfwTerminate();
@@ -54,19 +242,94 @@ int main()
 
 	//Initialize GLAD
 	gladLoadGL();
+	loadGLExtensions();
 
 	//Set the viewport
 	glViewport(0, 0, SCR_WIDTH, SCR_HEIGHT);
 
-	Shader shaderProgram("default.vert", "default.frag");
+	// One program per vertex format, without branches for what the format does not have:
+	// curve and balls are only positions, the surface mesh has normals, and the terrain is lit and
+	// colored by its height
+	ShaderVariants defaultVariants("default.vert", "default.frag");
+	Shader& shaderProgram = defaultVariants.get({});
+	Shader& litProgram = defaultVariants.get({ "HAS_NORMALS" });
+	Shader& terrainProgram = defaultVariants.get({ "HAS_NORMALS", "COLOR_BY_HEIGHT" });
+
+	// Normal lines are made from the surface vertices by the geometry shader, only when shown
+	Shader normalProgram("normals.vert", "normals.geom", "normals.frag");
+
+	// Only the control points go to the GPU, the surface is made by the tessellation shaders
+	Shader* tessellationProgram = NULL;
+	if (hasTessellationShaders())
+		tessellationProgram = new Shader("tessellation.vert", "tessellation.tesc", "tessellation.tese", "default.frag");
+
+	// Two triangles per direction in each Bezier patch, the normal comes from the control points
+	Shader analyticProgram("analytic.vert", "analytic.frag");
+
+	// The programs above compile together; here their build times are reported and the new ones cached,
+	// also the ones that are only used later or not at all
+	Shader::finishPendingBuilds();
+	analyticProgram.Activate();
+	analyticProgram.setInt("patchPoints", 0); // The queue binds the patch points to texture unit 0
 
 	//Box box;
 
+	// Mesh buffers go to the GPU on their own thread, the first frames are drawn while they upload
+	UploadService* uploads = new UploadService(window);
+	BSplineSurface::setUploadService(uploads);
+
 	BSplineSurface bsplineSurface;
+	SurfaceBVH surfacePicker(bsplineSurface, RayPrimitive::SubPatches);
+
+	// Large bicubic terrain under the surface, split into tiles of 8 x 8 knot spans
+	const int terrainSize = 64;
+	std::vector<glm::vec3> terrainPoints;
+	for (int i = 0; i < terrainSize; ++i)
+	{
+		for (int j = 0; j < terrainSize; ++j)
+		{
+			float x = static_cast<float>(i - terrainSize / 2);
+			float y = static_cast<float>(j - terrainSize / 2);
+			float height = -4.0f + 1.5f * sin(0.21f * x) * cos(0.17f * y) + 0.5f * sin(0.53f * x + 0.31f * y);
+			terrainPoints.push_back(glm::vec3(x, y, height));
+		}
+	}
+	// Path over the surface, drawn with points at equal distances along it
+	std::vector<glm::vec3> pathPoints;
+	for (int i = 0; i < 12; ++i)
+	{
+		float angle = 0.6f * i;
+		pathPoints.push_back(glm::vec3(2.0f + 0.8f * cos(angle), 1.0f + 0.8f * sin(angle), 1.5f + 0.05f * i));
+	}
+	BSplineCurve path(pathPoints, std::vector<float>(), clampedUniformKnots(12, 3), 3);
+	path.setupBuffers(256);
+
+	BSplineTerrain terrain(terrainPoints, std::vector<float>(), terrainSize, terrainSize,
+		clampedUniformKnots(terrainSize, 3), clampedUniformKnots(terrainSize, 3), 3, 3, 8, 8);
+
+	if (!bsplineSurface.canDrawPatches())
+		std::cout << "Tessellation shaders not available, drawing the CPU mesh" << std::endl;
+	bsplineSurface.setupAnalyticShading(2);
+
+	// Balls rolling down the surface, simulated on their own thread
+	RollingBalls balls(bsplineSurface, 0.05f);
+	addStartBalls(balls);
+	SimulationThread simulation(balls, SIMULATION_TICKS_PER_SECOND);
+	simulation.start();
+
+	// Vertices that change every frame are written here instead of into buffers of their own
+	DynamicVertexBuffer* dynamicVertices = new DynamicVertexBuffer();
 
-	glEnable(GL_DEPTH_TEST);
+	// Projection and view for every program, uploaded once per frame
+	FrameUniforms* frameUniforms = new FrameUniforms();
+
+	// State changes go through GLState, which skips the ones that change nothing
+	GLState::setEnabled(GL_DEPTH_TEST, true);
 	
-	glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+	// Objects submit their draws here, they are sorted by state and drawn at the end of the frame
+	// Wireframe, except what asks to be filled
+	RenderQueue renderQueue;
+	renderQueue.setWireframe(true);
 
 	while (!glfwWindowShouldClose(window)) // Check if the window should close
 	{
@@ -80,29 +343,127 @@ int main()
 		glClearColor(0.5f, 0.3f, 0.8f, 1.0f);
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-		shaderProgram.Activate();
-
 		glm::mat4 projection = glm::perspective(glm::radians(45.0f), (float)SCR_WIDTH / (float)SCR_HEIGHT, 0.1f, 100.0f); // perspective projection matrix
-		shaderProgram.setMat4("projection", projection); // pass the projection matrix to the shader
-
 		glm::mat4 view = camera.GetViewMatrix();
-		shaderProgram.setMat4("view", view); // pass the view matrix to the shader
+		frameUniforms->update(projection, view, camera.Position, glm::vec2(viewportWidth, viewportHeight)); // shared by all the shader programs
+		renderQueue.beginFrame(camera.Position, 100.0f);
+
+		shaderProgram.Activate();
 
 		glm::mat4 model = glm::mat4(1.0f); // make sure to initialize matrix to identity matrix first
 		model = glm::scale(model, glm::vec3(1.0f, 1.0f, 1.0f)); // Adjust the scaling as necessary
 		shaderProgram.setMat4("model", model);
+
+		litProgram.Activate();
+		litProgram.setMat4("model", model);
+		litProgram.setVec3("lightDirection", glm::vec3(0.3f, 0.5f, 1.0f));
+
+		terrainProgram.Activate();
+		terrainProgram.setMat4("model", model);
+		terrainProgram.setVec3("lightDirection", glm::vec3(0.3f, 0.5f, 1.0f));
+		terrainProgram.setVec2("heightRange", glm::vec2(-6.0f, -2.0f)); // The terrain heights are -4 +- 2
 		
 		// Draw box
-		//box.DrawBox();
-
-		// Draw BSplineSurface
-		bsplineSurface.DrawBSpline(shaderProgram);
+		//box.DrawBox(shaderProgram, renderQueue);
+
+		if (adaptiveTessellationRequested)
+		{
+			size_t uniformTriangles = bsplineSurface.getTriangleCount();
+			bsplineSurface.tessellateAdaptive(projection, view, glm::vec2(viewportWidth, viewportHeight), 0.5f);
+			std::cout << "Adaptive tessellation: " << bsplineSurface.getTriangleCount() << " triangles (was " << uniformTriangles << ")" << std::endl;
+			useHardwareTessellation = false;
+			adaptiveTessellationRequested = false;
+		}
+
+		if (pickRequested)
+		{
+			Ray ray;
+			ray.origin = camera.Position;
+			ray.direction = camera.Front;
+			RayHit hit = surfacePicker.intersect(ray);
+			if (hit.hit)
+				std::cout << "Picked (u, v) = (" << hit.u << ", " << hit.v << ") at " << hit.point.x << ", " << hit.point.y << ", " << hit.point.z << std::endl;
+			else
+				std::cout << "Nothing picked" << std::endl;
+			pickRequested = false;
+		}
+
+		// Terrain tiles get coarser away from the camera, only the changed tiles are tessellated again
+		terrain.updateLevelOfDetail(camera.Position, 12.0f);
+		terrain.update();
+		terrain.Draw(terrainProgram, renderQueue, projection, view);
+
+		// Draw BSplineSurface, the CPU mesh once its upload is done
+		bsplineSurface.finishUpload();
+		if (useAnalyticShading && bsplineSurface.canDrawAnalytic())
+		{
+			analyticProgram.Activate();
+			analyticProgram.setMat4("model", model);
+			analyticProgram.setVec3("lightDirection", glm::vec3(0.3f, 0.5f, 1.0f));
+			bsplineSurface.DrawBSplineAnalytic(analyticProgram, renderQueue);
+		}
+		else if (useHardwareTessellation && tessellationProgram != NULL && bsplineSurface.canDrawPatches())
+		{
+			tessellationProgram->Activate();
+			tessellationProgram->setMat4("model", model);
+			tessellationProgram->setFloat("pixelsPerEdge", 8.0f);
+			bsplineSurface.DrawBSplinePatches(*tessellationProgram, renderQueue);
+		}
+		else
+		{
+			bsplineSurface.DrawBSpline(litProgram, renderQueue);
+		}
+
+		path.DrawCurve(shaderProgram, renderQueue);
+		simulation.DrawBalls(shaderProgram, *dynamicVertices, renderQueue);
+
+		if (showNormals)
+		{
+			normalProgram.Activate();
+			normalProgram.setMat4("model", model);
+			normalProgram.setFloat("normalLength", 0.1f);
+			bsplineSurface.DrawNormals(normalProgram, renderQueue);
+		}
+
+		renderQueue.execute();
 		
+		dynamicVertices->endFrame();
+		GLState::endFrame();
+		if (stateStatisticsRequested)
+		{
+			const GLStateStatistics& statistics = GLState::getLastFrameStatistics();
+			std::cout << "GL state calls last frame: " << statistics.issued << " issued, " << statistics.skipped << " skipped" << std::endl;
+			const RenderQueueStatistics& queueStatistics = renderQueue.getStatistics();
+			std::cout << "Render queue: " << queueStatistics.packets << " draws, " << queueStatistics.stateChangesSubmitted
+				<< " state changes in submission order, " << queueStatistics.stateChangesSorted << " sorted ("
+				<< queueStatistics.sortMilliseconds << " ms to sort)" << std::endl;
+			std::cout << "Mesh arena: " << MeshArena::shared().getUsedBytes() / 1024 << " of "
+				<< MeshArena::shared().getCapacityBytes() / 1024 << " KB used" << std::endl;
+			stateStatisticsRequested = false;
+		}
 		glfwSwapBuffers(window);
 		glfwPollEvents();
 	}
 
-	shaderProgram.Delete();
+	simulation.stop();
+	delete dynamicVertices;
+	delete frameUniforms;
+
+	defaultVariants.Delete();
+	normalProgram.Delete();
+	analyticProgram.Delete();
+	if (tessellationProgram != NULL)
+	{
+		tessellationProgram->Delete();
+		delete tessellationProgram;
+	}
+
+	// The surface, terrain and path still hold ranges, their frees after this are ignored
+	MeshArena::shared().destroy();
+
+	// Its window shares the context of the main window and goes first
+	BSplineSurface::setUploadService(NULL);
+	delete uploads;
 
 	glfwDestroyWindow(window);
 	glfwTerminate();
@@ -122,11 +483,50 @@ void processInput(GLFWwindow* window)
 		camera.ProcessKeyboard(LEFT, deltaTime);
 	if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS)
 		camera.ProcessKeyboard(RIGHT, deltaTime);
+
+	// Toggle once per key press, not once per frame
+	static bool tWasPressed = false;
+	bool tPressed = glfwGetKey(window, GLFW_KEY_T) == GLFW_PRESS;
+	if (tPressed && !tWasPressed)
+		useHardwareTessellation = !useHardwareTessellation;
+	tWasPressed = tPressed;
+
+	static bool rWasPressed = false;
+	bool rPressed = glfwGetKey(window, GLFW_KEY_R) == GLFW_PRESS;
+	if (rPressed && !rWasPressed)
+		adaptiveTessellationRequested = true;
+	rWasPressed = rPressed;
+
+	static bool pWasPressed = false;
+	bool pPressed = glfwGetKey(window, GLFW_KEY_P) == GLFW_PRESS;
+	if (pPressed && !pWasPressed)
+		pickRequested = true;
+	pWasPressed = pPressed;
+
+	static bool nWasPressed = false;
+	bool nPressed = glfwGetKey(window, GLFW_KEY_N) == GLFW_PRESS;
+	if (nPressed && !nWasPressed)
+		showNormals = !showNormals;
+	nWasPressed = nPressed;
+
+	static bool lWasPressed = false;
+	bool lPressed = glfwGetKey(window, GLFW_KEY_L) == GLFW_PRESS;
+	if (lPressed && !lWasPressed)
+		useAnalyticShading = !useAnalyticShading;
+	lWasPressed = lPressed;
+
+	static bool gWasPressed = false;
+	bool gPressed = glfwGetKey(window, GLFW_KEY_G) == GLFW_PRESS;
+	if (gPressed && !gWasPressed)
+		stateStatisticsRequested = true;
+	gWasPressed = gPressed;
 }
 
 void framebuffer_size_callback(GLFWwindow* window, int SCR_WIDTH, int SCR_HEIGHT)
 {
 	glViewport(0, 0, SCR_WIDTH, SCR_HEIGHT);
+	viewportWidth = SCR_WIDTH;
+	viewportHeight = SCR_HEIGHT;
 	std::cout << "Window resized with " << SCR_WIDTH << "Height" << SCR_HEIGHT << std::endl;
 }
 
@@ -0,0 +1,293 @@
+#include "MeshArena.h"
+#include "GLState.h"
+#include <algorithm>
+#include <iostream>
+
+// First sizes of the buffers, they grow when a mesh does not fit
+static const size_t INITIAL_VERTICES = 64 * 1024;
+static const size_t INITIAL_INDICES = 256 * 1024;
+
+static GLsizei strideOf(VertexFormat format)
+{
+    return format == VertexFormat::Position ? 3 * sizeof(float) : 6 * sizeof(float);
+}
+
+RangeAllocator::RangeAllocator(size_t capacity)
+{
+    grow(capacity);
+}
+
+void RangeAllocator::addFree(size_t start, size_t size)
+{
+    freeByStart[start] = size;
+    freeBySize.insert(std::make_pair(size, start));
+}
+
+void RangeAllocator::removeFree(std::map<size_t, size_t>::iterator range)
+{
+    auto sizes = freeBySize.equal_range(range->second);
+    for (auto it = sizes.first; it != sizes.second; ++it)
+    {
+        if (it->second == range->first)
+        {
+            freeBySize.erase(it);
+            break;
+        }
+    }
+    freeByStart.erase(range);
+}
+
+size_t RangeAllocator::allocate(size_t size)
+{
+    if (size == 0)
+        return NO_RANGE;
+
+    // The smallest free range that fits, so large ranges stay whole for large meshes
+    auto best = freeBySize.lower_bound(size);
+    if (best == freeBySize.end())
+        return NO_RANGE;
+
+    size_t start = best->second;
+    size_t freeSize = best->first;
+    removeFree(freeByStart.find(start));
+    if (freeSize > size)
+        addFree(start + size, freeSize - size);
+    used += size;
+    return start;
+}
+
+void RangeAllocator::free(size_t start, size_t size)
+{
+    if (size == 0)
+        return;
+    used -= size;
+
+    // Merge with the free ranges right after and right before
+    auto next = freeByStart.lower_bound(start);
+    if (next != freeByStart.end() && next->first == start + size)
+    {
+        size += next->second;
+        auto after = std::next(next);
+        removeFree(next);
+        next = after;
+    }
+    if (next != freeByStart.begin())
+    {
+        auto previous = std::prev(next);
+        if (previous->first + previous->second == start)
+        {
+            start = previous->first;
+            size += previous->second;
+            removeFree(previous);
+        }
+    }
+    addFree(start, size);
+}
+
+void RangeAllocator::grow(size_t newCapacity)
+{
+    if (newCapacity <= capacity)
+        return;
+    size_t oldCapacity = capacity;
+    capacity = newCapacity;
+    used += newCapacity - oldCapacity; // free() takes it off again
+    free(oldCapacity, newCapacity - oldCapacity);
+}
+
+MeshArena& MeshArena::shared()
+{
+    static MeshArena arena;
+    return arena;
+}
+
+MeshArena::MeshArena()
+{
+}
+
+MeshRange MeshArena::allocate(VertexFormat format, GLsizei vertexCount, GLsizei indexCount)
+{
+    MeshRange range;
+    range.format = format;
+    if (destroyed)
+    {
+        std::cout << "Error: MeshArena::allocate after the arena was destroyed" << std::endl;
+        return range;
+    }
+    if (vertexCount <= 0)
+        return range;
+
+    VertexArena& arena = arenas[static_cast<int>(format)];
+    if (arena.vertexArray == 0)
+    {
+        // The first mesh of the format creates its buffer and vertex array
+        if (indexBuffer == 0)
+            growIndices(INITIAL_INDICES);
+        growVertices(format, INITIAL_VERTICES);
+    }
+
+    size_t vertexStart = arena.vertices.allocate(vertexCount);
+    if (vertexStart == RangeAllocator::NO_RANGE)
+    {
+        growVertices(format, arena.vertices.getCapacity() + vertexCount);
+        vertexStart = arena.vertices.allocate(vertexCount);
+    }
+
+    size_t indexStart = 0;
+    if (indexCount > 0)
+    {
+        indexStart = indices.allocate(indexCount);
+        if (indexStart == RangeAllocator::NO_RANGE)
+        {
+            growIndices(indices.getCapacity() + indexCount);
+            indexStart = indices.allocate(indexCount);
+        }
+    }
+
+    range.baseVertex = static_cast<GLint>(vertexStart);
+    range.vertexCount = vertexCount;
+    range.firstIndex = indexStart;
+    range.indexCount = std::max(indexCount, 0);
+    return range;
+}
+
+void MeshArena::free(MeshRange& range)
+{
+    if (range.isValid() && !destroyed)
+    {
+        arenas[static_cast<int>(range.format)].vertices.free(range.baseVertex, range.vertexCount);
+        indices.free(range.firstIndex, range.indexCount);
+    }
+    range = MeshRange();
+}
+
+void MeshArena::uploadVertices(const MeshRange& range, GLsizei firstVertex, GLsizei count, const void* data)
+{
+    if (count <= 0 || destroyed)
+        return;
+    if (firstVertex < 0 || firstVertex + count > range.vertexCount)
+    {
+        std::cout << "Error: MeshArena::uploadVertices outside the range of the mesh" << std::endl;
+        return;
+    }
+
+    // The copy target changes no vertex array or array buffer binding that draws rely on
+    GLsizei stride = strideOf(range.format);
+    GLState::bindBuffer(GL_COPY_WRITE_BUFFER, arenas[static_cast<int>(range.format)].buffer);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, static_cast<GLintptr>(range.baseVertex + firstVertex) * stride,
+        static_cast<GLsizeiptr>(count) * stride, data);
+}
+
+void MeshArena::uploadIndices(const MeshRange& range, size_t firstIndex, GLsizei count, const unsigned int* data)
+{
+    if (count <= 0 || destroyed)
+        return;
+    if (firstIndex + count > static_cast<size_t>(range.indexCount))
+    {
+        std::cout << "Error: MeshArena::uploadIndices outside the range of the mesh" << std::endl;
+        return;
+    }
+
+    GLState::bindBuffer(GL_COPY_WRITE_BUFFER, indexBuffer);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, static_cast<GLintptr>(range.firstIndex + firstIndex) * sizeof(unsigned int),
+        static_cast<GLsizeiptr>(count) * sizeof(unsigned int), data);
+}
+
+size_t MeshArena::getUsedBytes() const
+{
+    size_t bytes = indices.getUsed() * sizeof(unsigned int);
+    for (int i = 0; i < VERTEX_FORMAT_COUNT; ++i)
+        bytes += arenas[i].vertices.getUsed() * strideOf(static_cast<VertexFormat>(i));
+    return bytes;
+}
+
+size_t MeshArena::getCapacityBytes() const
+{
+    size_t bytes = indices.getCapacity() * sizeof(unsigned int);
+    for (int i = 0; i < VERTEX_FORMAT_COUNT; ++i)
+        bytes += arenas[i].vertices.getCapacity() * strideOf(static_cast<VertexFormat>(i));
+    return bytes;
+}
+
+void MeshArena::destroy()
+{
+    for (VertexArena& arena : arenas)
+    {
+        if (arena.vertexArray != 0)
+        {
+            GLState::deleteVertexArrays(1, &arena.vertexArray);
+            GLState::deleteBuffers(1, &arena.buffer);
+        }
+        arena = VertexArena();
+    }
+    if (indexBuffer != 0)
+        GLState::deleteBuffers(1, &indexBuffer);
+    indexBuffer = 0;
+    indices = RangeAllocator();
+    destroyed = true;
+}
+
+// A new buffer of the new size gets the contents of the old one, copied on the GPU
+static GLuint growBuffer(GLuint oldBuffer, size_t oldBytes, size_t newBytes)
+{
+    GLuint buffer;
+    glGenBuffers(1, &buffer);
+    GLState::bindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+    glBufferData(GL_COPY_WRITE_BUFFER, newBytes, NULL, GL_DYNAMIC_DRAW);
+    if (oldBuffer != 0)
+    {
+        if (oldBytes > 0)
+        {
+            GLState::bindBuffer(GL_COPY_READ_BUFFER, oldBuffer);
+            glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, oldBytes);
+        }
+        GLState::deleteBuffers(1, &oldBuffer);
+    }
+    return buffer;
+}
+
+void MeshArena::growVertices(VertexFormat format, size_t minCapacity)
+{
+    VertexArena& arena = arenas[static_cast<int>(format)];
+    size_t oldCapacity = arena.vertices.getCapacity();
+    size_t newCapacity = std::max(std::max(oldCapacity * 2, minCapacity), INITIAL_VERTICES);
+    GLsizei stride = strideOf(format);
+
+    arena.buffer = growBuffer(arena.buffer, oldCapacity * stride, newCapacity * stride);
+    arena.vertices.grow(newCapacity);
+    setupVertexArray(format);
+}
+
+void MeshArena::growIndices(size_t minCapacity)
+{
+    size_t oldCapacity = indices.getCapacity();
+    size_t newCapacity = std::max(std::max(oldCapacity * 2, minCapacity), INITIAL_INDICES);
+
+    indexBuffer = growBuffer(indexBuffer, oldCapacity * sizeof(unsigned int), newCapacity * sizeof(unsigned int));
+    indices.grow(newCapacity);
+
+    // Every vertex array has the index buffer bound
+    for (int i = 0; i < VERTEX_FORMAT_COUNT; ++i)
+    {
+        if (arenas[i].vertexArray != 0)
+            setupVertexArray(static_cast<VertexFormat>(i));
+    }
+}
+
+void MeshArena::setupVertexArray(VertexFormat format)
+{
+    VertexArena& arena = arenas[static_cast<int>(format)];
+    if (arena.vertexArray == 0)
+        glGenVertexArrays(1, &arena.vertexArray);
+
+    GLsizei stride = strideOf(format);
+    GLState::bindVertexArray(arena.vertexArray);
+    GLState::bindBuffer(GL_ARRAY_BUFFER, arena.buffer);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, (void*)0);
+    glEnableVertexAttribArray(0);
+    if (format == VertexFormat::PositionAndVec3)
+    {
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, stride, (void*)(3 * sizeof(float)));
+        glEnableVertexAttribArray(1);
+    }
+    GLState::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+}
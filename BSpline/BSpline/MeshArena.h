@@ -0,0 +1,111 @@
+#ifndef MESHARENA_H
+#define MESHARENA_H
+
+#include <glad/glad.h>
+#include <cstddef>
+#include <map>
+
+// Vertex layouts of the arena, every layout has one buffer and one vertex array for all its meshes
+enum class VertexFormat
+{
+    Position,        // vec3 at attribute 0
+    PositionAndVec3  // vec3 at attributes 0 and 1, interleaved (normals, patch parameters)
+};
+
+const int VERTEX_FORMAT_COUNT = 2;
+
+// Hands out ranges of [0, capacity) in whatever unit the caller counts in, best fit
+// Free ranges are kept by start, so a freed range is merged with free neighbours, and by size for
+// the best fit; both are O(log n) in the number of free ranges
+class RangeAllocator
+{
+public:
+	static const size_t NO_RANGE = ~size_t(0);
+
+	explicit RangeAllocator(size_t capacity = 0);
+
+	// Start of the range, NO_RANGE when no free range is large enough
+	size_t allocate(size_t size);
+	void free(size_t start, size_t size);
+
+	// The new part at the end is free
+	void grow(size_t newCapacity);
+
+	size_t getCapacity() const { return capacity; }
+	size_t getUsed() const { return used; }
+
+private:
+    std::map<size_t, size_t> freeByStart;      // start -> size
+    std::multimap<size_t, size_t> freeBySize;  // size -> start
+    size_t capacity = 0;
+    size_t used = 0;
+
+    void addFree(size_t start, size_t size);
+    void removeFree(std::map<size_t, size_t>::iterator range);
+};
+
+// Where a mesh is in the arena. Its indices count from its own first vertex and are drawn with
+// baseVertex, so they do not change when the mesh lands somewhere else
+struct MeshRange
+{
+    VertexFormat format = VertexFormat::Position;
+    GLint baseVertex = 0;
+    GLsizei vertexCount = 0;
+    size_t firstIndex = 0;
+    GLsizei indexCount = 0;
+
+    bool isValid() const { return vertexCount > 0; }
+};
+
+// Shared vertex and index buffers that meshes get ranges of instead of buffers of their own
+// There is one vertex buffer and vertex array per VertexFormat and one index buffer, bound as the
+// element buffer of every vertex array. All meshes of a format are drawn from the same vertex array
+// with their base vertex and first index, so changing between them binds nothing and they can be
+// drawn together. A full buffer is replaced by one twice as big and the old contents are copied on
+// the GPU, the ranges stay where they were. Render thread only
+class MeshArena
+{
+public:
+	static MeshArena& shared();
+
+	// Ranges for the vertices and indices of one mesh, indexCount may be 0
+	MeshRange allocate(VertexFormat format, GLsizei vertexCount, GLsizei indexCount);
+	void free(MeshRange& range);
+
+	// Vertices in the layout of the format, from firstVertex on inside the range
+	void uploadVertices(const MeshRange& range, GLsizei firstVertex, GLsizei count, const void* data);
+	void uploadIndices(const MeshRange& range, size_t firstIndex, GLsizei count, const unsigned int* indices);
+
+	GLuint getVertexArray(VertexFormat format) const { return arenas[static_cast<int>(format)].vertexArray; }
+
+	size_t getUsedBytes() const;
+	size_t getCapacityBytes() const;
+
+	// Deletes the buffers and vertex arrays, call before the context goes; frees after that are ignored
+	void destroy();
+
+private:
+    MeshArena();
+    MeshArena(const MeshArena&);
+    MeshArena& operator=(const MeshArena&);
+
+    struct VertexArena
+    {
+        GLuint vertexArray = 0;
+        GLuint buffer = 0;
+        RangeAllocator vertices;
+    };
+
+    VertexArena arenas[VERTEX_FORMAT_COUNT];
+    GLuint indexBuffer = 0;
+    RangeAllocator indices;
+    bool destroyed = false;
+
+    void growVertices(VertexFormat format, size_t minCapacity);
+    void growIndices(size_t minCapacity);
+
+    // Binds the vertex array of the format with its buffer, attributes and the index buffer
+    void setupVertexArray(VertexFormat format);
+};
+
+#endif // !MESHARENA_H
@@ -0,0 +1,131 @@
+#include "ProgramCache.h"
+#include "GLExtensions.h"
+#include "TessellationCache.h"
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+static const char CACHE_MAGIC[8] = { 'B', 'S', 'P', 'P', 'R', 'O', 'G', '1' };
+static const uint32_t CACHE_VERSION = 1;
+
+struct ProgramCacheHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t binaryFormat;
+    uint64_t key;
+    uint64_t binaryLength;
+};
+
+static uint64_t hashString(const char* text, uint64_t hash)
+{
+    // Length first, so "ab" + "c" and "a" + "bc" do not hash the same
+    uint64_t length = text != NULL ? strlen(text) : 0;
+    hash = hashBytes(&length, sizeof(length), hash);
+    return length > 0 ? hashBytes(text, length, hash) : hash;
+}
+
+uint64_t ProgramCache::keyFor(const std::vector<GLenum>& stageTypes, const std::vector<std::string>& sources)
+{
+    uint64_t key = hashBytes(CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    key = hashString(reinterpret_cast<const char*>(glGetString(GL_VENDOR)), key);
+    key = hashString(reinterpret_cast<const char*>(glGetString(GL_RENDERER)), key);
+    key = hashString(reinterpret_cast<const char*>(glGetString(GL_VERSION)), key);
+    for (size_t i = 0; i < stageTypes.size() && i < sources.size(); ++i)
+    {
+        key = hashBytes(&stageTypes[i], sizeof(GLenum), key);
+        key = hashString(sources[i].c_str(), key);
+    }
+    return key;
+}
+
+std::string ProgramCache::pathFor(uint64_t key)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "bspline_%016llx.glprog", static_cast<unsigned long long>(key));
+    return name;
+}
+
+bool ProgramCache::load(uint64_t key, GLuint program)
+{
+    if (!hasProgramBinary())
+        return false;
+
+    FILE* in = fopen(pathFor(key).c_str(), "rb");
+    if (in == NULL)
+        return false;
+
+    ProgramCacheHeader header;
+    bool valid = fread(&header, sizeof(header), 1, in) == 1
+        && memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) == 0
+        && header.version == CACHE_VERSION && header.key == key
+        && header.binaryLength > 0 && header.binaryLength < (1u << 30);
+
+    std::vector<unsigned char> binary;
+    if (valid)
+    {
+        binary.resize(static_cast<size_t>(header.binaryLength));
+        valid = fread(binary.data(), 1, binary.size(), in) == binary.size();
+    }
+    fclose(in);
+
+    if (!valid)
+    {
+        std::cout << "Error: Program cache " << pathFor(key) << " is damaged, compiling again" << std::endl;
+        return false;
+    }
+
+    // The driver may still refuse a binary it made itself, then the program is compiled as usual
+    glProgramBinary(program, header.binaryFormat, binary.data(), static_cast<GLsizei>(binary.size()));
+    GLint linked = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    return linked == GL_TRUE;
+}
+
+bool ProgramCache::store(uint64_t key, GLuint program)
+{
+    if (!hasProgramBinary())
+        return false;
+
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0)
+        return false;
+
+    std::vector<unsigned char> binary(length);
+    GLenum binaryFormat = 0;
+    GLsizei written = 0;
+    glGetProgramBinary(program, length, &written, &binaryFormat, binary.data());
+    if (written <= 0)
+        return false;
+
+    ProgramCacheHeader header;
+    memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.version = CACHE_VERSION;
+    header.binaryFormat = binaryFormat;
+    header.key = key;
+    header.binaryLength = static_cast<uint64_t>(written);
+
+    // Same as the tessellation cache: a temporary file that is renamed, never a half written binary
+    std::string path = pathFor(key);
+    std::string temporary = path + ".tmp";
+    FILE* out = fopen(temporary.c_str(), "wb");
+    if (out == NULL)
+    {
+        std::cout << "Error: Could not write program cache " << temporary << std::endl;
+        return false;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+    ok = ok && fwrite(binary.data(), 1, written, out) == static_cast<size_t>(written);
+    ok = fclose(out) == 0 && ok;
+
+    std::remove(path.c_str());
+    if (!ok || std::rename(temporary.c_str(), path.c_str()) != 0)
+    {
+        std::cout << "Error: Could not write program cache " << path << std::endl;
+        std::remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,27 @@
+#ifndef PROGRAMCACHE_H
+#define PROGRAMCACHE_H
+
+#include <glad/glad.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Linked shader programs stored as driver binaries, one file per key
+// The key covers the sources of all stages and the driver (vendor, renderer and version), so a
+// new driver or a changed shader gives a new file instead of a binary that no longer fits
+class ProgramCache
+{
+public:
+	// Key for the stage types and their sources, for the driver of the current context
+	static uint64_t keyFor(const std::vector<GLenum>& stageTypes, const std::vector<std::string>& sources);
+
+	// Loads the binary into the program; false when there is none or the driver refuses it
+	static bool load(uint64_t key, GLuint program);
+
+	// Saves the binary of a linked program, created with GL_PROGRAM_BINARY_RETRIEVABLE_HINT
+	static bool store(uint64_t key, GLuint program);
+
+	static std::string pathFor(uint64_t key);
+};
+
+#endif // !PROGRAMCACHE_H
@@ -0,0 +1,153 @@
+#include "RenderQueue.h"
+#include "GLExtensions.h"
+#include "GLState.h"
+#include <algorithm>
+#include <chrono>
+
+// Sort key from the most to the least significant bits:
+//   63-62 pass, 61 filled, 60-45 program, 44-29 vertex array, 28-0 depth
+// Only the low 16 bits of the program and vertex array names are used, which only matters for
+// the grouping and not for what is drawn
+static const int DEPTH_BITS = 29;
+static const uint64_t DEPTH_MAX = (uint64_t(1) << DEPTH_BITS) - 1;
+
+static GLuint programID(const DrawPacket& packet)
+{
+    return packet.program != nullptr ? packet.program->ID : 0;
+}
+
+void RenderQueue::beginFrame(const glm::vec3& cameraPosition, float farDistance)
+{
+    this->cameraPosition = cameraPosition;
+    this->farDistance = std::max(farDistance, 1e-6f);
+    packets.clear();
+    entries.clear();
+}
+
+uint64_t RenderQueue::makeKey(const DrawPacket& packet, RenderPass pass, const glm::vec3& center) const
+{
+    float depth = glm::clamp(glm::length(center - cameraPosition) / farDistance, 0.0f, 1.0f);
+    uint64_t depthBits = static_cast<uint64_t>(depth * static_cast<float>(DEPTH_MAX));
+    if (pass == RenderPass::Transparent)
+        depthBits = DEPTH_MAX - depthBits;
+
+    uint64_t key = static_cast<uint64_t>(pass) << 62;
+    key |= static_cast<uint64_t>(packet.filled ? 1 : 0) << 61;
+    key |= static_cast<uint64_t>(programID(packet) & 0xFFFF) << 45;
+    key |= static_cast<uint64_t>(packet.vertexArray & 0xFFFF) << 29;
+    key |= depthBits;
+    return key;
+}
+
+void RenderQueue::submit(const DrawPacket& packet, RenderPass pass, const glm::vec3& center)
+{
+    if (packet.program == nullptr || packet.count == 0)
+        return;
+
+    SortEntry entry;
+    entry.key = makeKey(packet, pass, center);
+    entry.packet = static_cast<uint32_t>(packets.size());
+    entries.push_back(entry);
+    packets.push_back(packet);
+}
+
+void RenderQueue::radixSort()
+{
+    size_t count = entries.size();
+    if (count < 2)
+        return;
+    sortBuffer.resize(count);
+
+    // Stable, so packets with the same key are drawn in the order they came
+    for (int shift = 0; shift < 64; shift += 8)
+    {
+        size_t histogram[256] = {};
+        for (const SortEntry& entry : entries)
+            ++histogram[(entry.key >> shift) & 0xFF];
+        if (histogram[(entries[0].key >> shift) & 0xFF] == count)
+            continue;
+
+        size_t offset = 0;
+        for (int digit = 0; digit < 256; ++digit)
+        {
+            size_t digitCount = histogram[digit];
+            histogram[digit] = offset;
+            offset += digitCount;
+        }
+        for (const SortEntry& entry : entries)
+            sortBuffer[histogram[(entry.key >> shift) & 0xFF]++] = entry;
+        entries.swap(sortBuffer);
+    }
+}
+
+int RenderQueue::countStateChanges() const
+{
+    DrawPacket none;
+    const DrawPacket* previous = &none;
+    int changes = 0;
+    for (const SortEntry& entry : entries)
+    {
+        const DrawPacket& packet = packets[entry.packet];
+        changes += programID(packet) != programID(*previous) ? 1 : 0;
+        changes += packet.vertexArray != previous->vertexArray ? 1 : 0;
+        changes += packet.bufferTexture != 0 && packet.bufferTexture != previous->bufferTexture ? 1 : 0;
+        changes += packet.filled != previous->filled ? 1 : 0;
+        changes += packet.pointSize != previous->pointSize ? 1 : 0;
+        previous = &packet;
+    }
+    return changes;
+}
+
+void RenderQueue::execute()
+{
+    statistics = RenderQueueStatistics();
+    statistics.packets = packets.size();
+    statistics.stateChangesSubmitted = countStateChanges();
+
+    std::chrono::steady_clock::time_point sortStart = std::chrono::steady_clock::now();
+    radixSort();
+    statistics.sortMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - sortStart).count();
+    statistics.stateChangesSorted = countStateChanges();
+
+    GLint patchVertices = 0;
+    float pointSize = 1.0f;
+    for (const SortEntry& entry : entries)
+    {
+        const DrawPacket& packet = packets[entry.packet];
+
+        GLState::polygonMode(packet.filled || !wireframe ? GL_FILL : GL_LINE);
+        packet.program->Activate();
+        GLState::bindVertexArray(packet.vertexArray);
+        if (packet.bufferTexture != 0)
+            GLState::bindTexture(0, GL_TEXTURE_BUFFER, packet.bufferTexture);
+        if (packet.mode == GL_PATCHES && packet.patchVertices != patchVertices)
+        {
+            glPatchParameteri(GL_PATCH_VERTICES, packet.patchVertices);
+            patchVertices = packet.patchVertices;
+        }
+        if (packet.pointSize != pointSize)
+        {
+            glPointSize(packet.pointSize);
+            pointSize = packet.pointSize;
+        }
+
+        if (!packet.indexed)
+        {
+            glDrawArrays(packet.mode, static_cast<GLint>(packet.first), packet.count);
+        }
+        else if (packet.baseVertex != 0)
+        {
+            glDrawElementsBaseVertex(packet.mode, packet.count, GL_UNSIGNED_INT,
+                (void*)(packet.first * sizeof(unsigned int)), packet.baseVertex);
+        }
+        else
+        {
+            glDrawElements(packet.mode, packet.count, GL_UNSIGNED_INT, (void*)(packet.first * sizeof(unsigned int)));
+        }
+    }
+    if (pointSize != 1.0f)
+        glPointSize(1.0f);
+
+    packets.clear();
+    entries.clear();
+}
@@ -0,0 +1,93 @@
+#ifndef RENDERQUEUE_H
+#define RENDERQUEUE_H
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <vector>
+#include "shaderClass.h"
+
+// Passes in the order they are drawn, the highest bits of the sort key
+enum class RenderPass
+{
+    Opaque,      // Front to back, so hidden fragments fail the depth test early
+    Overlay,     // Debug geometry such as the normal lines, after the scene
+    Transparent  // Back to front
+};
+
+// Everything needed to issue one draw later in the frame
+// Uniforms belong to the program and are set before RenderQueue::execute(), so packets with the
+// same program share them
+struct DrawPacket
+{
+    Shader* program = nullptr;
+    GLuint vertexArray = 0;
+    GLenum mode = GL_TRIANGLES;
+    GLsizei count = 0;
+    bool indexed = false;      // glDrawElements with unsigned int indices
+    size_t first = 0;          // First vertex, or first index when indexed
+    GLint baseVertex = 0;      // Added to the indices
+    GLuint bufferTexture = 0;  // Bound to texture unit 0 as GL_TEXTURE_BUFFER when not 0
+    GLint patchVertices = 0;   // Vertices per patch for GL_PATCHES
+    bool filled = false;       // Filled even when the queue draws wireframe
+    float pointSize = 1.0f;
+};
+
+// Statistics of the last executed frame
+struct RenderQueueStatistics
+{
+    size_t packets = 0;
+    int stateChangesSubmitted = 0;  // Program, vertex array, texture, fill and point size changes in submission order
+    int stateChangesSorted = 0;     // The same in the sorted order that was drawn
+    double sortMilliseconds = 0.0;
+};
+
+// Draws of one frame, sorted by state before they are issued
+// Objects submit packets while the frame is built instead of drawing right away. execute() sorts
+// them by a 64 bit key (pass, fill, program, vertex array, depth) with a radix sort and draws them
+// in that order through GLState, so draws with the same program and vertex array follow each
+// other and the opaque ones go front to back within them
+class RenderQueue
+{
+public:
+	// Camera of the frame, the depth in the keys is the distance from it up to farDistance
+	void beginFrame(const glm::vec3& cameraPosition, float farDistance);
+
+	// center is where the depth is measured, for example the middle of the bounding box
+	void submit(const DrawPacket& packet, RenderPass pass, const glm::vec3& center);
+
+	// Sorts and draws the packets submitted since beginFrame, then empties the queue
+	void execute();
+
+	// Packets that are not filled are drawn as lines
+	void setWireframe(bool wireframe) { this->wireframe = wireframe; }
+
+	const RenderQueueStatistics& getStatistics() const { return statistics; }
+
+private:
+    struct SortEntry
+    {
+        uint64_t key;
+        uint32_t packet;
+    };
+
+    std::vector<DrawPacket> packets;
+    std::vector<SortEntry> entries;
+    std::vector<SortEntry> sortBuffer;
+
+    glm::vec3 cameraPosition = glm::vec3(0.0f);
+    float farDistance = 100.0f;
+    bool wireframe = false;
+
+    RenderQueueStatistics statistics;
+
+    uint64_t makeKey(const DrawPacket& packet, RenderPass pass, const glm::vec3& center) const;
+
+    // Least significant byte first, bytes that are the same in every key are skipped
+    void radixSort();
+
+    // Changes between consecutive packets in the current order of the entries
+    int countStateChanges() const;
+};
+
+#endif // !RENDERQUEUE_H
@@ -0,0 +1,69 @@
+#include "RollingBalls.h"
+#include "JobSystem.h"
+
+// A ball that falls this far below its start is taken as lost and starts again
+static const float RESET_DROP = 10.0f;
+
+RollingBalls::RollingBalls(const BSplineSurface& surface, float radius)
+    : surface(surface), radius(radius)
+{
+}
+
+void RollingBalls::addBall(const glm::vec3& position, const glm::vec3& velocity)
+{
+    Ball ball;
+    ball.position = position;
+    ball.velocity = velocity;
+    balls.push_back(ball);
+    startStates.push_back(ball);
+}
+
+void RollingBalls::step(float dt)
+{
+    // The balls do not touch each other, so the order they are moved in does not change the result
+    JobSystem::shared().parallelFor(0, static_cast<int>(balls.size()), 64, [&](int first, int last)
+    {
+        for (int i = first; i < last; ++i)
+            stepBall(i, dt);
+    });
+}
+
+void RollingBalls::stepBall(int i, float dt)
+{
+    Ball& ball = balls[i];
+
+    // Semi-implicit Euler, the contact from the last step decides the acceleration
+    glm::vec3 acceleration = gravity;
+    if (ball.onSurface)
+    {
+        // A solid ball rolling without slipping gets 5/7 of the gravity along the surface
+        glm::vec3 tangential = gravity - glm::dot(gravity, ball.contactNormal) * ball.contactNormal;
+        acceleration -= (2.0f / 7.0f) * tangential;
+    }
+    ball.velocity += acceleration * dt;
+    ball.position += ball.velocity * dt;
+
+    // Contact with the closest point on the surface, the normal is taken to point up
+    SurfaceProjection contact = surface.projectPoint(ball.position);
+    glm::vec3 normal = contact.normal.z < 0.0f ? -contact.normal : contact.normal;
+    glm::vec3 offset = ball.position - contact.point;
+    float height = glm::dot(offset, normal);
+
+    // Past the edge of the surface the closest point is on the border, beside the ball
+    bool overSurface = glm::length(offset - height * normal) < 0.5f * radius;
+    ball.onSurface = overSurface && height <= radius * 1.01f;
+    if (ball.onSurface)
+    {
+        ball.contactNormal = normal;
+        if (height < radius)
+            ball.position += (radius - height) * normal;
+
+        // The surface only pushes, the ball may still leave it over a crest
+        float normalSpeed = glm::dot(ball.velocity, normal);
+        if (normalSpeed < 0.0f)
+            ball.velocity -= normalSpeed * normal;
+    }
+
+    if (ball.position.z < startStates[i].position.z - RESET_DROP)
+        ball = startStates[i];
+}
@@ -0,0 +1,48 @@
+#ifndef ROLLINGBALLS_H
+#define ROLLINGBALLS_H
+
+#include <glm/glm.hpp>
+#include <vector>
+#include "BSplineSurface.h"
+
+struct Ball
+{
+    glm::vec3 position = glm::vec3(0.0f);
+    glm::vec3 velocity = glm::vec3(0.0f);
+
+    // Contact after the last step
+    bool onSurface = false;
+    glm::vec3 contactNormal = glm::vec3(0.0f, 0.0f, 1.0f);
+};
+
+// Balls that roll on a BSplineSurface under gravity
+// The contact point and normal come from the closest point on the surface, so the balls follow
+// the exact spline and not the triangle mesh. Only reads the surface; the surface must not get a
+// new control net while the balls are simulated
+class RollingBalls
+{
+public:
+	RollingBalls(const BSplineSurface& surface, float radius);
+
+	void addBall(const glm::vec3& position, const glm::vec3& velocity = glm::vec3(0.0f));
+
+	// Moves all balls dt seconds forward
+	void step(float dt);
+
+	const std::vector<Ball>& getBalls() const { return balls; }
+	float getRadius() const { return radius; }
+
+private:
+    const BSplineSurface& surface;
+    float radius;
+    glm::vec3 gravity = glm::vec3(0.0f, 0.0f, -9.81f);
+
+    std::vector<Ball> balls;
+
+    // Balls that fall off the surface start again from here
+    std::vector<Ball> startStates;
+
+    void stepBall(int i, float dt);
+};
+
+#endif // !ROLLINGBALLS_H
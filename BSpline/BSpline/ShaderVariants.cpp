@@ -0,0 +1,29 @@
+#include "ShaderVariants.h"
+#include <algorithm>
+
+ShaderVariants::ShaderVariants(const char* vertexFile, const char* fragmentFile)
+    : vertexFile(vertexFile), fragmentFile(fragmentFile)
+{
+}
+
+Shader& ShaderVariants::get(const std::vector<std::string>& defines)
+{
+    std::vector<std::string> key = defines;
+    std::sort(key.begin(), key.end());
+    key.erase(std::unique(key.begin(), key.end()), key.end());
+
+    auto found = variants.find(key);
+    if (found != variants.end())
+        return found->second;
+
+    // Compiles on the driver's threads where it can, the program is checked on first use
+    Shader variant(vertexFile.c_str(), fragmentFile.c_str(), key);
+    return variants.insert(std::make_pair(key, variant)).first->second;
+}
+
+void ShaderVariants::Delete()
+{
+    for (auto& variant : variants)
+        variant.second.Delete();
+    variants.clear();
+}
@@ -0,0 +1,35 @@
+#ifndef SHADERVARIANTS_H
+#define SHADERVARIANTS_H
+
+#include "shaderClass.h"
+#include <map>
+#include <string>
+#include <vector>
+
+// Specialized programs made from one pair of shader files
+// Each set of defines gives its own program, built the first time it is asked for and kept after
+// that. The shaders use #ifdef for what only some vertex formats have (normals, color by height),
+// so every draw runs a program without branches or unused attributes for its exact format
+class ShaderVariants
+{
+public:
+	ShaderVariants(const char* vertexFile, const char* fragmentFile);
+
+	// The program for these defines, in any order ("NAME" or "NAME value"); {} is the plain shader
+	// The reference stays valid until Delete()
+	Shader& get(const std::vector<std::string>& defines);
+
+	size_t getVariantCount() const { return variants.size(); }
+
+	// Deletes the programs of all the variants
+	void Delete();
+
+private:
+    std::string vertexFile;
+    std::string fragmentFile;
+
+    // Keyed by the sorted defines, so the same set in another order is the same program
+    std::map<std::vector<std::string>, Shader> variants;
+};
+
+#endif // !SHADERVARIANTS_H
@@ -0,0 +1,134 @@
+#include "SimulationThread.h"
+#include "GLState.h"
+#include <algorithm>
+
+// A thread that wakes up later than this many ticks drops the rest instead of catching up
+static const int MAX_SUBSTEPS = 8;
+
+SimulationThread::SimulationThread(RollingBalls& world, double ticksPerSecond)
+    : world(world), scheduler(1.0 / std::max(ticksPerSecond, 1.0), MAX_SUBSTEPS)
+{
+}
+
+SimulationThread::~SimulationThread()
+{
+    stop();
+
+    if (VAO != 0)
+    {
+        GLState::deleteVertexArrays(1, &VAO);
+    }
+}
+
+void SimulationThread::start()
+{
+    if (running)
+        return;
+
+    // Tick 0 is the start state, so there is something to draw before the first tick
+    SimulationSnapshot& snapshot = snapshots.writeBuffer();
+    snapshot.tick = 0;
+    snapshot.tickTime = std::chrono::steady_clock::now();
+    snapshot.positions.clear();
+    for (const Ball& ball : world.getBalls())
+        snapshot.positions.push_back(ball.position);
+    snapshot.previousPositions = snapshot.positions;
+    snapshots.publish();
+
+    running = true;
+    thread = std::thread(&SimulationThread::run, this);
+}
+
+void SimulationThread::stop()
+{
+    running = false;
+    if (thread.joinable())
+        thread.join();
+}
+
+void SimulationThread::run()
+{
+    std::vector<glm::vec3> previousPositions;
+    for (const Ball& ball : world.getBalls())
+        previousPositions.push_back(ball.position);
+
+    std::chrono::steady_clock::time_point lastTime = std::chrono::steady_clock::now();
+    while (running)
+    {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        double elapsed = std::chrono::duration<double>(now - lastTime).count();
+        lastTime = now;
+
+        // Several steps if the thread woke up late, only the last two are needed for the drawing
+        int steps = scheduler.advance(elapsed, [&](float dt)
+        {
+            for (size_t i = 0; i < previousPositions.size(); ++i)
+                previousPositions[i] = world.getBalls()[i].position;
+            world.step(dt);
+        });
+
+        std::chrono::duration<double> pending(scheduler.getPendingTime());
+        if (steps > 0)
+        {
+            // The buffer comes back with an old tick in it, every field is written again
+            SimulationSnapshot& snapshot = snapshots.writeBuffer();
+            snapshot.tick = scheduler.getStepCount();
+            snapshot.tickTime = now - std::chrono::duration_cast<std::chrono::steady_clock::duration>(pending);
+            snapshot.previousPositions = previousPositions;
+            snapshot.positions.resize(world.getBalls().size());
+            for (size_t i = 0; i < snapshot.positions.size(); ++i)
+                snapshot.positions[i] = world.getBalls()[i].position;
+            snapshots.publish();
+        }
+
+        // Until the next step is due
+        std::chrono::duration<double> untilNextStep(scheduler.getStep() - pending.count());
+        std::this_thread::sleep_until(now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(untilNextStep));
+    }
+}
+
+void SimulationThread::interpolate(std::vector<glm::vec3>& positions)
+{
+    snapshots.update();
+    const SimulationSnapshot& snapshot = snapshots.readBuffer();
+
+    // The snapshot moves from the previous to the new positions during the tick after it
+    float alpha = std::chrono::duration<float>(std::chrono::steady_clock::now() - snapshot.tickTime).count()
+        / static_cast<float>(scheduler.getStep());
+    alpha = std::min(std::max(alpha, 0.0f), 1.0f);
+
+    positions.resize(snapshot.positions.size());
+    for (size_t i = 0; i < positions.size(); ++i)
+        positions[i] = glm::mix(snapshot.previousPositions[i], snapshot.positions[i], alpha);
+}
+
+void SimulationThread::DrawBalls(Shader& shaderProgram, DynamicVertexBuffer& dynamicVertices, RenderQueue& queue)
+{
+    interpolate(drawPositions);
+    if (drawPositions.empty())
+        return;
+
+    if (VAO == 0)
+        glGenVertexArrays(1, &VAO);
+
+    // New positions every frame, into this frame's part of the ring buffer
+    size_t offset = dynamicVertices.write(drawPositions.data(), drawPositions.size() * sizeof(glm::vec3));
+
+    GLState::bindVertexArray(VAO);
+    GLState::bindBuffer(GL_ARRAY_BUFFER, dynamicVertices.getBuffer());
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void*)offset);
+    glEnableVertexAttribArray(0);
+
+    glm::vec3 center(0.0f);
+    for (const glm::vec3& position : drawPositions)
+        center += position;
+    center /= static_cast<float>(drawPositions.size());
+
+    DrawPacket packet;
+    packet.program = &shaderProgram;
+    packet.vertexArray = VAO;
+    packet.mode = GL_POINTS;
+    packet.count = static_cast<GLsizei>(drawPositions.size());
+    packet.pointSize = 8.0f;
+    queue.submit(packet, RenderPass::Opaque, center);
+}
@@ -0,0 +1,66 @@
+#ifndef SIMULATIONTHREAD_H
+#define SIMULATIONTHREAD_H
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+#include <vector>
+#include "shaderClass.h"
+#include "RollingBalls.h"
+#include "TripleBuffer.h"
+#include "FixedStepScheduler.h"
+#include "DynamicVertexBuffer.h"
+#include "RenderQueue.h"
+
+// The ball positions after one tick, with the positions of the tick before for interpolation
+struct SimulationSnapshot
+{
+    uint64_t tick = 0;
+    std::chrono::steady_clock::time_point tickTime;
+    std::vector<glm::vec3> previousPositions;
+    std::vector<glm::vec3> positions;
+};
+
+// Runs RollingBalls on its own thread with a FixedStepScheduler, independent of the frame rate
+// Every tick is published through a triple buffer; the render loop takes the newest one and
+// interpolates between its two ticks, so the balls move smoothly at any frame rate. The drawing
+// is one tick behind the simulation in exchange. The world must not be touched from other
+// threads between start() and stop()
+class SimulationThread
+{
+public:
+	SimulationThread(RollingBalls& world, double ticksPerSecond);
+	~SimulationThread();
+
+	void start();
+	void stop();
+
+	// Render thread: ball positions for the current time, between the last two ticks
+	void interpolate(std::vector<glm::vec3>& positions);
+
+	// Render thread: newest tick seen by interpolate()
+	uint64_t getTick() const { return snapshots.readBuffer().tick; }
+
+	// Render thread: interpolates the balls and submits them as points, from the frame's dynamic vertices
+	// The queue has to be executed before the dynamic vertices end the frame
+	void DrawBalls(Shader& shaderProgram, DynamicVertexBuffer& dynamicVertices, RenderQueue& queue);
+
+private:
+    void run();
+
+    RollingBalls& world;
+    FixedStepScheduler scheduler;
+
+    std::thread thread;
+    std::atomic<bool> running{ false };
+
+    TripleBuffer<SimulationSnapshot> snapshots;
+
+    std::vector<glm::vec3> drawPositions;
+    GLuint VAO = 0;
+};
+
+#endif // !SIMULATIONTHREAD_H
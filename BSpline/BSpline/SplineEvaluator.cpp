@@ -0,0 +1,183 @@
+#include "SplineEvaluator.h"
+#include "JobSystem.h"
+#include <algorithm>
+
+template <typename Precision>
+void SplineSurfaceEvaluator<Precision>::setup(const std::vector<glm::dvec3>& controlPoints, const std::vector<float>& weights,
+    int numControlPointsU, int numControlPointsV,
+    const std::vector<float>& knotsU, const std::vector<float>& knotsV,
+    int degreeU, int degreeV, const glm::dvec3& origin)
+{
+    this->origin = origin;
+    this->numControlPointsU = numControlPointsU;
+    this->numControlPointsV = numControlPointsV;
+    d_u = degreeU;
+    d_v = degreeV;
+
+    // The offset is taken away in double before the points are rounded to Real
+    size_t count = controlPoints.size();
+    netX.resize(count);
+    netY.resize(count);
+    netZ.resize(count);
+    netW.resize(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        double w = i < weights.size() ? weights[i] : 1.0;
+        glm::dvec3 local = controlPoints[i] - origin;
+        netX[i] = static_cast<Real>(w * local.x);
+        netY[i] = static_cast<Real>(w * local.y);
+        netZ[i] = static_cast<Real>(w * local.z);
+        netW[i] = static_cast<Real>(w);
+    }
+
+    std::vector<Real> realKnotsU(knotsU.begin(), knotsU.end());
+    std::vector<Real> realKnotsV(knotsV.begin(), knotsV.end());
+    buildSpanPolynomials(numControlPointsU, d_u, realKnotsU, polynomialsU);
+    buildSpanPolynomials(numControlPointsV, d_v, realKnotsV, polynomialsV);
+}
+
+template <typename Precision>
+typename Precision::Vec3 SplineSurfaceEvaluator<Precision>::evaluate(Real u, Real v) const
+{
+    Vec3 point, du, dv;
+    evaluateDerivatives(u, v, point, du, dv);
+    return point;
+}
+
+template <typename Precision>
+void SplineSurfaceEvaluator<Precision>::evaluateDerivatives(Real u, Real v, Vec3& point, Vec3& du, Vec3& dv) const
+{
+    Real Nu[2 * (MAX_BSPLINE_DEGREE + 1)], Nv[2 * (MAX_BSPLINE_DEGREE + 1)];
+    int spanU = polynomialsU.span(u);
+    int spanV = polynomialsV.span(v);
+    evaluateSpanPolynomials(polynomialsU, spanU, u, 1, Nu);
+    evaluateSpanPolynomials(polynomialsV, spanV, v, 1, Nv);
+    const Real* dNu = Nu + d_u + 1;
+    const Real* dNv = Nv + d_v + 1;
+
+    glm::vec<4, Real> A(0), Au(0), Av(0);
+    for (int k = 0; k <= d_u; ++k)
+    {
+        for (int l = 0; l <= d_v; ++l)
+        {
+            int c = (spanU - d_u + k) * numControlPointsV + (spanV - d_v + l);
+            glm::vec<4, Real> Pw(netX[c], netY[c], netZ[c], netW[c]);
+            A += Nu[k] * Nv[l] * Pw;
+            Au += dNu[k] * Nv[l] * Pw;
+            Av += Nu[k] * dNv[l] * Pw;
+        }
+    }
+
+    point = Vec3(A) / A.w;
+    du = (Vec3(Au) - Au.w * point) / A.w;
+    dv = (Vec3(Av) - Av.w * point) / A.w;
+}
+
+template <typename Precision>
+void SplineSurfaceEvaluator<Precision>::evaluateGrid(const std::vector<Real>& us, const std::vector<Real>& vs,
+    std::vector<glm::vec3>* points, std::vector<glm::vec3>* normals) const
+{
+    const int numU = static_cast<int>(us.size());
+    const int numV = static_cast<int>(vs.size());
+    if (points) points->resize(us.size() * vs.size());
+    if (normals) normals->resize(us.size() * vs.size());
+    if (numU == 0 || numV == 0)
+        return;
+
+    // Basis functions once per row and column of the grid
+    bool derivatives = normals != nullptr;
+    BasisTableT<Real> basisU, basisV;
+    sampleBasis(polynomialsU, derivatives ? 1 : 0, us, basisU);
+    sampleBasis(polynomialsV, derivatives ? 1 : 0, vs, basisV);
+
+    const int n = numControlPointsV;
+
+    // Grid row a: the net contracted in u gives a curve in v (and its u derivative), then every
+    // sample of the row only needs the d_v + 1 points of that curve
+    auto evaluateRow = [&](int a, std::vector<Real>& row)
+    {
+        Real* rx = &row[0];
+        Real* ry = rx + n;
+        Real* rz = ry + n;
+        Real* rw = rz + n;
+        Real* ux = rw + n;
+        Real* uy = ux + n;
+        Real* uz = uy + n;
+        Real* uw = uz + n;
+        std::fill(row.begin(), row.end(), Real(0));
+
+        const Real* Nu = basisU.derivative(a, 0);
+        const Real* dNu = derivatives ? basisU.derivative(a, 1) : nullptr;
+        int firstU = basisU.spans[a] - d_u;
+        for (int k = 0; k <= d_u; ++k)
+        {
+            const Real* px = &netX[(firstU + k) * n];
+            const Real* py = &netY[(firstU + k) * n];
+            const Real* pz = &netZ[(firstU + k) * n];
+            const Real* pw = &netW[(firstU + k) * n];
+            const Real b = Nu[k];
+            for (int j = 0; j < n; ++j)
+            {
+                rx[j] += b * px[j];
+                ry[j] += b * py[j];
+                rz[j] += b * pz[j];
+                rw[j] += b * pw[j];
+            }
+            if (derivatives)
+            {
+                const Real db = dNu[k];
+                for (int j = 0; j < n; ++j)
+                {
+                    ux[j] += db * px[j];
+                    uy[j] += db * py[j];
+                    uz[j] += db * pz[j];
+                    uw[j] += db * pw[j];
+                }
+            }
+        }
+
+        for (int b = 0; b < numV; ++b)
+        {
+            const Real* Nv = basisV.derivative(b, 0);
+            int firstV = basisV.spans[b] - d_v;
+            glm::vec<4, Real> A(0);
+            for (int l = 0; l <= d_v; ++l)
+                A += Nv[l] * glm::vec<4, Real>(rx[firstV + l], ry[firstV + l], rz[firstV + l], rw[firstV + l]);
+
+            // Homogeneous division, w = 1 for polynomial surfaces
+            Vec3 point = Vec3(A) / A.w;
+            if (points)
+                (*points)[a * numV + b] = glm::vec3(point);
+
+            if (normals)
+            {
+                const Real* dNv = basisV.derivative(b, 1);
+                glm::vec<4, Real> Au(0), Av(0);
+                for (int l = 0; l <= d_v; ++l)
+                {
+                    Au += Nv[l] * glm::vec<4, Real>(ux[firstV + l], uy[firstV + l], uz[firstV + l], uw[firstV + l]);
+                    Av += dNv[l] * glm::vec<4, Real>(rx[firstV + l], ry[firstV + l], rz[firstV + l], rw[firstV + l]);
+                }
+
+                // Rational derivative: S' = (A' - w' * S) / w
+                Vec3 du = (Vec3(Au) - Au.w * point) / A.w;
+                Vec3 dv = (Vec3(Av) - Av.w * point) / A.w;
+                Vec3 normal = glm::cross(du, dv);
+                Real length = glm::length(normal);
+                (*normals)[a * numV + b] = length > Real(0) ? glm::vec3(normal / length) : glm::vec3(0.0f, 0.0f, 1.0f);
+            }
+        }
+    };
+
+    // Rows in pieces of a few thousand samples, each piece with its own scratch row
+    const size_t rowSize = 8 * static_cast<size_t>(n);
+    JobSystem::shared().parallelFor(0, numU, std::max(1, 4096 / numV), [&](int first, int last)
+    {
+        std::vector<Real> row(rowSize);
+        for (int a = first; a < last; ++a)
+            evaluateRow(a, row);
+    });
+}
+
+template class SplineSurfaceEvaluator<SinglePrecision>;
+template class SplineSurfaceEvaluator<DoublePrecision>;
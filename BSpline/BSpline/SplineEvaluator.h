@@ -0,0 +1,67 @@
+#ifndef SPLINEEVALUATOR_H
+#define SPLINEEVALUATOR_H
+
+#include <glm/glm.hpp>
+#include <vector>
+#include "BSplineBasis.h"
+
+// Precision policy for the spline evaluators
+// Real is used for the control points and for all the evaluation arithmetic
+template <typename T>
+struct SplinePrecision
+{
+    typedef T Real;
+    typedef glm::vec<3, T> Vec3;
+    typedef glm::vec<4, T> Vec4;
+};
+
+typedef SplinePrecision<float> SinglePrecision;
+typedef SplinePrecision<double> DoublePrecision;
+
+// Rational tensor product B-Spline surface evaluated in the precision of the policy
+// The control points are given in world coordinates (for example UTM) and stored relative
+// to a local origin, so the large offset never takes part in the arithmetic. Results are
+// relative to the origin; the grid is handed out as float, which is what the GPU takes
+template <typename Precision>
+class SplineSurfaceEvaluator
+{
+public:
+	typedef typename Precision::Real Real;
+	typedef typename Precision::Vec3 Vec3;
+
+	// Control points are stored row by row: controlPoints[i * numControlPointsV + j]
+	// The net and knot vectors must be consistent, BSplineSurface checks them before this
+	void setup(const std::vector<glm::dvec3>& controlPoints, const std::vector<float>& weights,
+		int numControlPointsU, int numControlPointsV,
+		const std::vector<float>& knotsU, const std::vector<float>& knotsV,
+		int degreeU, int degreeV, const glm::dvec3& origin);
+
+	const glm::dvec3& getOrigin() const { return origin; }
+
+	// Point relative to the origin
+	Vec3 evaluate(Real u, Real v) const;
+
+	// Point relative to the origin and first partial derivatives
+	void evaluateDerivatives(Real u, Real v, Vec3& point, Vec3& du, Vec3& dv) const;
+
+	// The whole grid us x vs, rows on several threads; points/normals may be null
+	// The rows of the net are contracted once per grid row, in loops over separate
+	// coordinate arrays that the compiler vectorizes for float and double alike
+	void evaluateGrid(const std::vector<Real>& us, const std::vector<Real>& vs,
+		std::vector<glm::vec3>* points, std::vector<glm::vec3>* normals) const;
+
+private:
+    glm::dvec3 origin = glm::dvec3(0.0);
+    int numControlPointsU = 0;
+    int numControlPointsV = 0;
+    int d_u = 0;
+    int d_v = 0;
+
+    // Homogeneous control points (w * (P - origin), w), one array per coordinate
+    std::vector<Real> netX, netY, netZ, netW;
+
+    SpanPolynomialsT<Real> polynomialsU;
+    SpanPolynomialsT<Real> polynomialsV;
+};
+
+#endif // !SPLINEEVALUATOR_H
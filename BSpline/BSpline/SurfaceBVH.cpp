@@ -0,0 +1,468 @@
+#include "SurfaceBVH.h"
+#include "BSplineSurface.h"
+#include "JobSystem.h"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+// Primitives per leaf; a few more make the tree smaller, fewer make the leaves cheaper
+static const int BVH_LEAF_SIZE = 4;
+
+// Kind of primitive, stored next to its corners
+static const int SUB_PATCH = -1;
+static const int LOWER_TRIANGLE = 0;   // Corners 00, 10, 01 of the cell
+static const int UPPER_TRIANGLE = 1;   // Corners 01, 10, 11 of the cell
+
+// Splits a Bezier net in the u direction at t with de Casteljau's algorithm
+// points[i * (dv + 1) + j], the left part covers [0, t] and the right part [t, 1]
+static void splitU(const std::vector<glm::vec4>& points, int du, int dv, float t,
+    std::vector<glm::vec4>& left, std::vector<glm::vec4>& right)
+{
+    left.resize(points.size());
+    right.resize(points.size());
+    std::vector<glm::vec4> column(du + 1);
+    for (int j = 0; j <= dv; ++j)
+    {
+        for (int i = 0; i <= du; ++i)
+            column[i] = points[i * (dv + 1) + j];
+        for (int r = 0; r <= du; ++r)
+        {
+            left[r * (dv + 1) + j] = column[0];
+            right[(du - r) * (dv + 1) + j] = column[du - r];
+            for (int i = 0; i < du - r; ++i)
+                column[i] = glm::mix(column[i], column[i + 1], t);
+        }
+    }
+}
+
+// Same as splitU, in the v direction
+static void splitV(const std::vector<glm::vec4>& points, int du, int dv, float t,
+    std::vector<glm::vec4>& left, std::vector<glm::vec4>& right)
+{
+    left.resize(points.size());
+    right.resize(points.size());
+    std::vector<glm::vec4> row(dv + 1);
+    for (int i = 0; i <= du; ++i)
+    {
+        for (int j = 0; j <= dv; ++j)
+            row[j] = points[i * (dv + 1) + j];
+        for (int r = 0; r <= dv; ++r)
+        {
+            left[i * (dv + 1) + r] = row[0];
+            right[i * (dv + 1) + dv - r] = row[dv - r];
+            for (int j = 0; j < dv - r; ++j)
+                row[j] = glm::mix(row[j], row[j + 1], t);
+        }
+    }
+}
+
+// Ray against triangle (Moller-Trumbore), gives t and the barycentric coordinates of p1 and p2
+// tolerance > 0 lets the hit be a little outside, used when the triangle is only a guess
+static bool intersectTriangle(const Ray& ray, const glm::vec3& p0, const glm::vec3& p1, const glm::vec3& p2,
+    float tolerance, float& t, float& b1, float& b2)
+{
+    glm::vec3 e1 = p1 - p0;
+    glm::vec3 e2 = p2 - p0;
+    glm::vec3 h = glm::cross(ray.direction, e2);
+    float a = glm::dot(e1, h);
+    if (std::fabs(a) < 1e-12f)
+        return false;
+
+    float f = 1.0f / a;
+    glm::vec3 s = ray.origin - p0;
+    b1 = f * glm::dot(s, h);
+    glm::vec3 q = glm::cross(s, e1);
+    b2 = f * glm::dot(ray.direction, q);
+    if (b1 < -tolerance || b2 < -tolerance || b1 + b2 > 1.0f + tolerance)
+        return false;
+
+    t = f * glm::dot(e2, q);
+    return true;
+}
+
+// Entry distance of the ray into the box, or FLT_MAX when it misses
+static float intersectBox(const glm::vec3& origin, const glm::vec3& inverseDirection, float tMin, float tMax,
+    const glm::vec3& boundsMin, const glm::vec3& boundsMax)
+{
+    glm::vec3 t0 = (boundsMin - origin) * inverseDirection;
+    glm::vec3 t1 = (boundsMax - origin) * inverseDirection;
+    glm::vec3 nearest = glm::min(t0, t1);
+    glm::vec3 furthest = glm::max(t0, t1);
+    float enter = std::max(std::max(nearest.x, nearest.y), std::max(nearest.z, tMin));
+    float exit = std::min(std::min(furthest.x, furthest.y), std::min(furthest.z, tMax));
+    return enter <= exit ? enter : FLT_MAX;
+}
+
+SurfaceBVH::SurfaceBVH(const BSplineSurface& surface, RayPrimitive primitive, int subdivisions)
+    : surface(surface), primitive(primitive)
+{
+    if (subdivisions < 1)
+        subdivisions = 1;
+
+    if (primitive == RayPrimitive::SubPatches)
+        buildSubPatches(subdivisions);
+    else
+        buildTriangles(subdivisions);
+
+    buildHierarchy();
+}
+
+void SurfaceBVH::buildSubPatches(int subdivisions)
+{
+    std::vector<glm::vec4> strip, rest, piece, left, right;
+    for (const BezierPatch& patch : surface.getBezierPatches())
+    {
+        int du = patch.degreeU, dv = patch.degreeV;
+        for (int a = 0; a < subdivisions; ++a)
+        {
+            // Cut off the strip [a, a + 1] / subdivisions in u
+            float s0 = static_cast<float>(a) / subdivisions;
+            float s1 = static_cast<float>(a + 1) / subdivisions;
+            splitU(patch.points, du, dv, s1, left, right);
+            if (a > 0)
+                splitU(left, du, dv, s0 / s1, rest, strip);
+            else
+                strip = left;
+
+            for (int b = 0; b < subdivisions; ++b)
+            {
+                float t0 = static_cast<float>(b) / subdivisions;
+                float t1 = static_cast<float>(b + 1) / subdivisions;
+                splitV(strip, du, dv, t1, left, right);
+                if (b > 0)
+                    splitV(left, du, dv, t0 / t1, rest, piece);
+                else
+                    piece = left;
+
+                // With positive weights the piece lies inside the hull of its control points
+                glm::vec3 boundsMin(FLT_MAX), boundsMax(-FLT_MAX);
+                for (const glm::vec4& Pw : piece)
+                {
+                    glm::vec3 P = glm::vec3(Pw) / Pw.w;
+                    boundsMin = glm::min(boundsMin, P);
+                    boundsMax = glm::max(boundsMax, P);
+                }
+
+                float u0 = patch.u0 + (patch.u1 - patch.u0) * s0;
+                float u1 = patch.u0 + (patch.u1 - patch.u0) * s1;
+                float v0 = patch.v0 + (patch.v1 - patch.v0) * t0;
+                float v1 = patch.v0 + (patch.v1 - patch.v0) * t1;
+
+                // The corner control points are on the surface
+                primitiveMin.push_back(boundsMin);
+                primitiveMax.push_back(boundsMax);
+                primitiveRect.push_back(glm::vec4(u0, u1, v0, v1));
+                primitiveKind.push_back(SUB_PATCH);
+                primitiveCorners.push_back(glm::vec3(piece[0]) / piece[0].w);
+                primitiveCorners.push_back(glm::vec3(piece[du * (dv + 1)]) / piece[du * (dv + 1)].w);
+                primitiveCorners.push_back(glm::vec3(piece[dv]) / piece[dv].w);
+                primitiveCorners.push_back(glm::vec3(piece.back()) / piece.back().w);
+            }
+        }
+    }
+}
+
+void SurfaceBVH::buildTriangles(int subdivisions)
+{
+    for (const BezierPatch& patch : surface.getBezierPatches())
+    {
+        for (int a = 0; a < subdivisions; ++a)
+        {
+            for (int b = 0; b < subdivisions; ++b)
+            {
+                float u0 = patch.u0 + (patch.u1 - patch.u0) * a / subdivisions;
+                float u1 = patch.u0 + (patch.u1 - patch.u0) * (a + 1) / subdivisions;
+                float v0 = patch.v0 + (patch.v1 - patch.v0) * b / subdivisions;
+                float v1 = patch.v0 + (patch.v1 - patch.v0) * (b + 1) / subdivisions;
+                glm::vec3 p00 = surface.evaluate(u0, v0), p10 = surface.evaluate(u1, v0);
+                glm::vec3 p01 = surface.evaluate(u0, v1), p11 = surface.evaluate(u1, v1);
+
+                // Same split of the cell as the surface mesh
+                for (int kind = LOWER_TRIANGLE; kind <= UPPER_TRIANGLE; ++kind)
+                {
+                    glm::vec3 q0 = kind == LOWER_TRIANGLE ? p00 : p01;
+                    glm::vec3 q2 = kind == LOWER_TRIANGLE ? p01 : p11;
+                    primitiveMin.push_back(glm::min(glm::min(q0, p10), q2));
+                    primitiveMax.push_back(glm::max(glm::max(q0, p10), q2));
+                    primitiveRect.push_back(glm::vec4(u0, u1, v0, v1));
+                    primitiveKind.push_back(kind);
+                    primitiveCorners.push_back(p00);
+                    primitiveCorners.push_back(p10);
+                    primitiveCorners.push_back(p01);
+                    primitiveCorners.push_back(p11);
+                }
+            }
+        }
+    }
+}
+
+void SurfaceBVH::buildHierarchy()
+{
+    int count = static_cast<int>(primitiveMin.size());
+    std::vector<int> order(count);
+    std::vector<glm::vec3> centroids(count);
+    for (int p = 0; p < count; ++p)
+    {
+        order[p] = p;
+        centroids[p] = 0.5f * (primitiveMin[p] + primitiveMax[p]);
+    }
+
+    nodes.clear();
+    nodes.reserve(2 * count / BVH_LEAF_SIZE + 1);
+    if (count > 0)
+        buildNode(order, centroids, 0, count);
+
+    // Primitives in leaf order, so a leaf reads one contiguous range
+    std::vector<glm::vec3> sortedMin(count), sortedMax(count), sortedCorners(primitiveCorners.size());
+    std::vector<glm::vec4> sortedRect(count);
+    std::vector<int> sortedKind(count);
+    for (int p = 0; p < count; ++p)
+    {
+        int q = order[p];
+        sortedMin[p] = primitiveMin[q];
+        sortedMax[p] = primitiveMax[q];
+        sortedRect[p] = primitiveRect[q];
+        sortedKind[p] = primitiveKind[q];
+        for (int c = 0; c < 4; ++c)
+            sortedCorners[p * 4 + c] = primitiveCorners[q * 4 + c];
+    }
+    primitiveMin.swap(sortedMin);
+    primitiveMax.swap(sortedMax);
+    primitiveRect.swap(sortedRect);
+    primitiveKind.swap(sortedKind);
+    primitiveCorners.swap(sortedCorners);
+}
+
+int SurfaceBVH::buildNode(std::vector<int>& order, std::vector<glm::vec3>& centroids, int first, int count)
+{
+    int index = static_cast<int>(nodes.size());
+    nodes.push_back(Node());
+
+    glm::vec3 boundsMin(FLT_MAX), boundsMax(-FLT_MAX);
+    glm::vec3 centroidMin(FLT_MAX), centroidMax(-FLT_MAX);
+    for (int p = first; p < first + count; ++p)
+    {
+        boundsMin = glm::min(boundsMin, primitiveMin[order[p]]);
+        boundsMax = glm::max(boundsMax, primitiveMax[order[p]]);
+        centroidMin = glm::min(centroidMin, centroids[order[p]]);
+        centroidMax = glm::max(centroidMax, centroids[order[p]]);
+    }
+    nodes[index].boundsMin = boundsMin;
+    nodes[index].boundsMax = boundsMax;
+
+    if (count <= BVH_LEAF_SIZE)
+    {
+        nodes[index].first = first;
+        nodes[index].count = count;
+        return index;
+    }
+
+    // Median split along the longest axis of the centroids
+    glm::vec3 extent = centroidMax - centroidMin;
+    int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+    int half = count / 2;
+    std::nth_element(order.begin() + first, order.begin() + first + half, order.begin() + first + count,
+        [&](int a, int b) { return centroids[a][axis] < centroids[b][axis]; });
+
+    // The left child directly follows its parent, the right child comes after the whole left subtree
+    buildNode(order, centroids, first, half);
+    int right = buildNode(order, centroids, first + half, count - half);
+    nodes[index].first = right;
+    nodes[index].count = 0;
+    return index;
+}
+
+bool SurfaceBVH::startValues(int p, const Ray& ray, float& u, float& v, float& t) const
+{
+    const glm::vec3* corners = &primitiveCorners[p * 4];
+    const glm::vec4& rect = primitiveRect[p];
+    float b1, b2;
+
+    if (primitiveKind[p] == LOWER_TRIANGLE || primitiveKind[p] == UPPER_TRIANGLE)
+    {
+        bool lower = primitiveKind[p] == LOWER_TRIANGLE;
+        if (!intersectTriangle(ray, lower ? corners[0] : corners[2], corners[1], lower ? corners[2] : corners[3], 0.0f, t, b1, b2))
+            return false;
+
+        // Barycentric coordinates back to the parameters of the cell corners
+        float su = lower ? b1 : b1 + b2;
+        float sv = lower ? b2 : 1.0f - b1;
+        u = rect.x + (rect.y - rect.x) * su;
+        v = rect.z + (rect.w - rect.z) * sv;
+        return true;
+    }
+
+    // Sub-patch: the flat quad through the corners, with some slack since it is only a guess
+    if (intersectTriangle(ray, corners[0], corners[1], corners[2], 0.25f, t, b1, b2))
+    {
+        u = rect.x + (rect.y - rect.x) * b1;
+        v = rect.z + (rect.w - rect.z) * b2;
+        return true;
+    }
+    if (intersectTriangle(ray, corners[2], corners[1], corners[3], 0.25f, t, b1, b2))
+    {
+        u = rect.x + (rect.y - rect.x) * (b1 + b2);
+        v = rect.z + (rect.w - rect.z) * (1.0f - b1);
+        return true;
+    }
+
+    // Curved piece seen from the side: start in the middle, at the closest point of the ray
+    u = 0.5f * (rect.x + rect.y);
+    v = 0.5f * (rect.z + rect.w);
+    glm::vec3 centre = 0.5f * (primitiveMin[p] + primitiveMax[p]);
+    t = glm::dot(centre - ray.origin, ray.direction) / glm::dot(ray.direction, ray.direction);
+    return true;
+}
+
+bool SurfaceBVH::refine(const Ray& ray, const glm::vec4& rect, float& u, float& v, float& t) const
+{
+    float uMin, uMax, vMin, vMax;
+    surface.getDomain(uMin, uMax, vMin, vMax);
+
+    // Steps are kept near the piece, a wild step on a grazing ray would otherwise land on another
+    // part of the surface; triangles are only an approximation, so their hit may be in the next cell
+    float reach = primitive == RayPrimitive::Triangles ? 1.0f : 0.5f;
+    float lowU = std::max(rect.x - reach * (rect.y - rect.x), uMin);
+    float highU = std::min(rect.y + reach * (rect.y - rect.x), uMax);
+    float lowV = std::max(rect.z - reach * (rect.w - rect.z), vMin);
+    float highV = std::min(rect.w + reach * (rect.w - rect.z), vMax);
+    u = glm::clamp(u, lowU, highU);
+    v = glm::clamp(v, lowV, highV);
+
+    // Newton on F(u, v, t) = S(u, v) - origin - t * direction, the Jacobian columns are Su, Sv, -direction
+    glm::vec3 point, du, dv;
+    for (int iteration = 0; iteration < 12; ++iteration)
+    {
+        surface.evaluateDerivatives(u, v, point, du, dv);
+        glm::vec3 F = point - ray.origin - t * ray.direction;
+        float scale = glm::length(du) * (rect.y - rect.x) + glm::length(dv) * (rect.w - rect.z);
+        if (glm::length(F) <= 1e-5f * scale + 1e-7f)
+        {
+            // Accept when the hit is on this piece (with a small margin) and inside the ray interval
+            float marginU = (primitive == RayPrimitive::Triangles ? 1.0f : 0.01f) * (rect.y - rect.x);
+            float marginV = (primitive == RayPrimitive::Triangles ? 1.0f : 0.01f) * (rect.w - rect.z);
+            return u >= rect.x - marginU && u <= rect.y + marginU && v >= rect.z - marginV && v <= rect.w + marginV
+                && t >= ray.tMin && t <= ray.tMax;
+        }
+
+        // Cramer's rule for J * delta = -F
+        glm::vec3 c = -ray.direction;
+        float determinant = glm::dot(du, glm::cross(dv, c));
+        if (std::fabs(determinant) < 1e-20f)
+            return false;
+        float deltaU = -glm::dot(F, glm::cross(dv, c)) / determinant;
+        float deltaV = -glm::dot(du, glm::cross(F, c)) / determinant;
+        float deltaT = -glm::dot(du, glm::cross(dv, F)) / determinant;
+
+        u = glm::clamp(u + deltaU, lowU, highU);
+        v = glm::clamp(v + deltaV, lowV, highV);
+        t += deltaT;
+    }
+    return false;
+}
+
+RayHit SurfaceBVH::intersect(const Ray& ray) const
+{
+    RayHit result;
+    if (nodes.empty())
+        return result;
+
+    glm::vec3 inverseDirection = 1.0f / ray.direction;
+    float closest = ray.tMax;
+    bool flatHit = false;
+
+    int stack[64];
+    int stackSize = 0;
+    int node = 0;
+    if (intersectBox(ray.origin, inverseDirection, ray.tMin, closest, nodes[0].boundsMin, nodes[0].boundsMax) == FLT_MAX)
+        return result;
+
+    while (true)
+    {
+        const Node& current = nodes[node];
+        if (current.count > 0)
+        {
+            for (int p = current.first; p < current.first + current.count; ++p)
+            {
+                if (intersectBox(ray.origin, inverseDirection, ray.tMin, closest, primitiveMin[p], primitiveMax[p]) == FLT_MAX)
+                    continue;
+
+                float u, v, t;
+                if (!startValues(p, ray, u, v, t))
+                    continue;
+
+                Ray limited = ray;
+                limited.tMax = closest;
+                float flatT = t;
+                if (refine(limited, primitiveRect[p], u, v, t))
+                {
+                    closest = t;
+                    result.hit = true;
+                    result.t = t;
+                    result.u = u;
+                    result.v = v;
+                    flatHit = false;
+                }
+                else if (primitive == RayPrimitive::Triangles && flatT >= ray.tMin && flatT < closest)
+                {
+                    // Newton did not settle, keep the hit on the triangle itself
+                    startValues(p, ray, u, v, t);
+                    closest = t;
+                    result.hit = true;
+                    result.t = t;
+                    result.u = u;
+                    result.v = v;
+                    flatHit = true;
+                }
+            }
+        }
+        else
+        {
+            // Nearest child first, the other one waits on the stack
+            int left = node + 1;
+            int right = current.first;
+            float tLeft = intersectBox(ray.origin, inverseDirection, ray.tMin, closest, nodes[left].boundsMin, nodes[left].boundsMax);
+            float tRight = intersectBox(ray.origin, inverseDirection, ray.tMin, closest, nodes[right].boundsMin, nodes[right].boundsMax);
+            if (tLeft > tRight)
+            {
+                std::swap(left, right);
+                std::swap(tLeft, tRight);
+            }
+            if (tLeft != FLT_MAX)
+            {
+                if (tRight != FLT_MAX && stackSize < 64)
+                    stack[stackSize++] = right;
+                node = left;
+                continue;
+            }
+        }
+
+        if (stackSize == 0)
+            break;
+        node = stack[--stackSize];
+    }
+
+    if (result.hit)
+    {
+        glm::vec3 point, du, dv;
+        surface.evaluateDerivatives(result.u, result.v, point, du, dv);
+        glm::vec3 normal = glm::cross(du, dv);
+        float length = glm::length(normal);
+        result.point = flatHit ? ray.origin + result.t * ray.direction : point;
+        result.normal = length > 0.0f ? normal / length : glm::vec3(0.0f, 0.0f, 1.0f);
+    }
+    return result;
+}
+
+void SurfaceBVH::intersectRays(const std::vector<Ray>& rays, std::vector<RayHit>& hits) const
+{
+    hits.resize(rays.size());
+
+    // Pieces big enough to hide the job overhead, small enough to balance the load
+    const int grainSize = 1024;
+    JobSystem::shared().parallelFor(0, static_cast<int>(rays.size()), grainSize, [&](int first, int last)
+    {
+        for (int r = first; r < last; ++r)
+            hits[r] = intersect(rays[r]);
+    });
+}
@@ -0,0 +1,85 @@
+#ifndef SURFACEBVH_H
+#define SURFACEBVH_H
+
+#include <glm/glm.hpp>
+#include <vector>
+
+class BSplineSurface;
+
+// What the leaves of the hierarchy hold
+enum class RayPrimitive
+{
+    SubPatches, // Bezier sub-patches with exact bounds from their control points
+    Triangles   // Triangles of a uniform tessellation of every patch
+};
+
+struct Ray
+{
+    glm::vec3 origin = glm::vec3(0.0f);
+    glm::vec3 direction = glm::vec3(0.0f, 0.0f, -1.0f);
+    float tMin = 0.0f;
+    float tMax = 1e30f;
+};
+
+struct RayHit
+{
+    bool hit = false;
+    float t = 0.0f;     // Distance along the ray, in units of the direction length
+    float u = 0.0f;
+    float v = 0.0f;
+    glm::vec3 point = glm::vec3(0.0f);
+    glm::vec3 normal = glm::vec3(0.0f, 0.0f, 1.0f);
+};
+
+// Bounding volume hierarchy over a BSplineSurface for picking and line of sight tests
+// A leaf gives the start values, and Newton iteration on S(u, v) = origin + t * direction
+// moves the hit onto the exact surface
+class SurfaceBVH
+{
+public:
+    // Every Bezier patch is cut into subdivisions x subdivisions pieces (or two triangles per piece)
+    SurfaceBVH(const BSplineSurface& surface, RayPrimitive primitive, int subdivisions = 4);
+
+    // Closest hit in [ray.tMin, ray.tMax]
+    RayHit intersect(const Ray& ray) const;
+
+    // Many rays at once, split into batches that run on several threads
+    void intersectRays(const std::vector<Ray>& rays, std::vector<RayHit>& hits) const;
+
+    size_t getPrimitiveCount() const { return primitiveMin.size(); }
+    size_t getNodeCount() const { return nodes.size(); }
+
+private:
+    struct Node
+    {
+        glm::vec3 boundsMin;
+        int first;          // Left child, or the first primitive of a leaf
+        glm::vec3 boundsMax;
+        int count;          // Number of primitives, 0 for an inner node
+    };
+
+    const BSplineSurface& surface;
+    RayPrimitive primitive;
+
+    // Per primitive, in leaf order after the build
+    std::vector<glm::vec3> primitiveMin;
+    std::vector<glm::vec3> primitiveMax;
+    std::vector<glm::vec4> primitiveRect;   // (u0, u1, v0, v1) of the piece of the surface
+    std::vector<int> primitiveKind;         // Sub-patch, or which half of the cell a triangle is
+    std::vector<glm::vec3> primitiveCorners; // 4 per primitive: surface points at the corners of the rect
+
+    std::vector<Node> nodes;
+
+    void buildSubPatches(int subdivisions);
+    void buildTriangles(int subdivisions);
+    void buildHierarchy();
+    int buildNode(std::vector<int>& order, std::vector<glm::vec3>& centroids, int first, int count);
+
+    // Start values (u, v, t) from the flat primitive; false when the ray misses it
+    bool startValues(int p, const Ray& ray, float& u, float& v, float& t) const;
+
+    // Newton iteration for the exact hit, false when it leaves the primitive or does not converge
+    bool refine(const Ray& ray, const glm::vec4& rect, float& u, float& v, float& t) const;
+};
+
+#endif // !SURFACEBVH_H
@@ -0,0 +1,215 @@
+#include "TessellationCache.h"
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Bumped whenever the file layout or the tessellation itself changes, old files are then ignored
+static const char CACHE_MAGIC[8] = { 'B', 'S', 'P', 'T', 'E', 'S', 'S', '1' };
+static const uint32_t CACHE_VERSION = 1;
+
+struct CacheHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t vertexSize;    // sizeof(glm::vec3), guards against a different float layout
+    uint64_t key;
+    uint64_t vertexCount;
+    uint64_t indexCount;
+};
+
+uint64_t hashBytes(const void* data, size_t size, uint64_t hash)
+{
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+bool MappedFile::open(const std::string& path)
+{
+    close();
+
+#ifdef _WIN32
+    HANDLE handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (handle == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(handle, &fileSize) || fileSize.QuadPart == 0)
+    {
+        CloseHandle(handle);
+        return false;
+    }
+
+    HANDLE mapping = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL)
+    {
+        CloseHandle(handle);
+        return false;
+    }
+
+    void* address = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (address == NULL)
+    {
+        CloseHandle(mapping);
+        CloseHandle(handle);
+        return false;
+    }
+
+    fileHandle = handle;
+    mappingHandle = mapping;
+    view = static_cast<const unsigned char*>(address);
+    length = static_cast<size_t>(fileSize.QuadPart);
+#else
+    int descriptor = ::open(path.c_str(), O_RDONLY);
+    if (descriptor < 0)
+        return false;
+
+    struct stat status;
+    if (fstat(descriptor, &status) != 0 || status.st_size == 0)
+    {
+        ::close(descriptor);
+        return false;
+    }
+
+    void* address = mmap(NULL, static_cast<size_t>(status.st_size), PROT_READ, MAP_PRIVATE, descriptor, 0);
+    ::close(descriptor);
+    if (address == MAP_FAILED)
+        return false;
+
+    view = static_cast<const unsigned char*>(address);
+    length = static_cast<size_t>(status.st_size);
+#endif
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (view == nullptr)
+        return;
+
+#ifdef _WIN32
+    UnmapViewOfFile(view);
+    CloseHandle(static_cast<HANDLE>(mappingHandle));
+    CloseHandle(static_cast<HANDLE>(fileHandle));
+    mappingHandle = nullptr;
+    fileHandle = nullptr;
+#else
+    munmap(const_cast<unsigned char*>(view), length);
+#endif
+    view = nullptr;
+    length = 0;
+}
+
+std::string TessellationCache::pathFor(uint64_t key)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "bspline_%016llx.tess", static_cast<unsigned long long>(key));
+    return name;
+}
+
+bool TessellationCache::load(uint64_t key)
+{
+    release();
+    if (!file.open(pathFor(key)))
+        return false;
+
+    CacheHeader header;
+    if (file.size() < sizeof(header))
+    {
+        release();
+        return false;
+    }
+    memcpy(&header, file.data(), sizeof(header));
+
+    size_t expected = sizeof(header) + 2 * header.vertexCount * sizeof(glm::vec3) + header.indexCount * sizeof(unsigned int);
+    if (memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 || header.version != CACHE_VERSION
+        || header.vertexSize != sizeof(glm::vec3) || header.key != key || file.size() != expected)
+    {
+        std::cout << "Error: Tessellation cache " << pathFor(key) << " is damaged or out of date, tessellating again" << std::endl;
+        release();
+        return false;
+    }
+
+    // The header is a multiple of 8 bytes, so the float arrays after it are aligned in the mapping
+    const unsigned char* data = file.data() + sizeof(header);
+    numVertices = static_cast<size_t>(header.vertexCount);
+    numIndices = static_cast<size_t>(header.indexCount);
+    loadedVertices = reinterpret_cast<const glm::vec3*>(data);
+    loadedNormals = reinterpret_cast<const glm::vec3*>(data + numVertices * sizeof(glm::vec3));
+    loadedIndices = reinterpret_cast<const unsigned int*>(data + 2 * numVertices * sizeof(glm::vec3));
+    return true;
+}
+
+void TessellationCache::release()
+{
+    file.close();
+    loadedVertices = nullptr;
+    loadedNormals = nullptr;
+    loadedIndices = nullptr;
+    numVertices = 0;
+    numIndices = 0;
+}
+
+bool TessellationCache::store(uint64_t key, const std::vector<glm::vec3>& vertices,
+    const std::vector<glm::vec3>& normals, const std::vector<unsigned int>& indices)
+{
+    if (vertices.size() != normals.size())
+        return false;
+
+    CacheHeader header;
+    memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.version = CACHE_VERSION;
+    header.vertexSize = sizeof(glm::vec3);
+    header.key = key;
+    header.vertexCount = vertices.size();
+    header.indexCount = indices.size();
+
+    std::string path = pathFor(key);
+    std::string temporary = path + ".tmp";
+    FILE* out = fopen(temporary.c_str(), "wb");
+    if (out == NULL)
+    {
+        std::cout << "Error: Could not write tessellation cache " << temporary << std::endl;
+        return false;
+    }
+
+    bool written = fwrite(&header, sizeof(header), 1, out) == 1;
+    if (!vertices.empty())
+    {
+        written = written && fwrite(vertices.data(), sizeof(glm::vec3), vertices.size(), out) == vertices.size();
+        written = written && fwrite(normals.data(), sizeof(glm::vec3), normals.size(), out) == normals.size();
+    }
+    if (!indices.empty())
+        written = written && fwrite(indices.data(), sizeof(unsigned int), indices.size(), out) == indices.size();
+    written = fclose(out) == 0 && written;
+
+    // rename does not replace an existing file on Windows
+    std::remove(path.c_str());
+    if (!written || std::rename(temporary.c_str(), path.c_str()) != 0)
+    {
+        std::cout << "Error: Could not write tessellation cache " << path << std::endl;
+        std::remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,77 @@
+#ifndef TESSELLATIONCACHE_H
+#define TESSELLATIONCACHE_H
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+// 64 bit FNV-1a hash, call again with the previous result to hash several blocks
+const uint64_t FNV_OFFSET_BASIS = 14695981039346656037ull;
+uint64_t hashBytes(const void* data, size_t size, uint64_t hash = FNV_OFFSET_BASIS);
+
+template <typename T>
+uint64_t hashVector(const std::vector<T>& values, uint64_t hash)
+{
+    return values.empty() ? hash : hashBytes(values.data(), values.size() * sizeof(T), hash);
+}
+
+// Read only view of a whole file, mapped into memory (Win32 or POSIX)
+class MappedFile
+{
+public:
+    MappedFile() {}
+    ~MappedFile();
+
+    bool open(const std::string& path);
+    void close();
+
+    const unsigned char* data() const { return view; }
+    size_t size() const { return length; }
+
+private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+    const unsigned char* view = nullptr;
+    size_t length = 0;
+#ifdef _WIN32
+    void* fileHandle = nullptr;
+    void* mappingHandle = nullptr;
+#endif
+};
+
+// Tessellated surfaces stored in binary files, one file per key
+// The file is mapped and the arrays are used in place, so loading costs no more than reading the file
+class TessellationCache
+{
+public:
+    // Maps the file for the key; false when there is none or it does not match
+    bool load(uint64_t key);
+
+    // Valid after a successful load, until release
+    const glm::vec3* vertices() const { return loadedVertices; }
+    const glm::vec3* normals() const { return loadedNormals; }
+    const unsigned int* indices() const { return loadedIndices; }
+    size_t vertexCount() const { return numVertices; }
+    size_t indexCount() const { return numIndices; }
+
+    void release();
+
+    // Writes to a temporary file and renames it, so a half written file is never loaded
+    static bool store(uint64_t key, const std::vector<glm::vec3>& vertices,
+        const std::vector<glm::vec3>& normals, const std::vector<unsigned int>& indices);
+
+    static std::string pathFor(uint64_t key);
+
+private:
+    MappedFile file;
+    const glm::vec3* loadedVertices = nullptr;
+    const glm::vec3* loadedNormals = nullptr;
+    const unsigned int* loadedIndices = nullptr;
+    size_t numVertices = 0;
+    size_t numIndices = 0;
+};
+
+#endif // !TESSELLATIONCACHE_H
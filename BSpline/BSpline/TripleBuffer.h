@@ -0,0 +1,49 @@
+#ifndef TRIPLEBUFFER_H
+#define TRIPLEBUFFER_H
+
+#include <atomic>
+
+// Hands the newest value from one writer thread to one reader thread without locks
+// The writer fills writeBuffer() and publishes it, the reader picks up the newest published
+// buffer with update(). Neither side ever waits for the other: there is always a third buffer
+// for the writer while the reader holds one and the last published one waits in the middle.
+// Values the reader did not pick up in time are overwritten, only the newest one counts
+template <typename T>
+class TripleBuffer
+{
+public:
+	// Writer side. The buffer comes back with old contents, so fill all of it before publish()
+	T& writeBuffer() { return buffers[writeIndex]; }
+	void publish()
+	{
+		// Release makes the writes to the buffer visible to the reader that takes it
+		unsigned int previous = middle.exchange(writeIndex | FRESH, std::memory_order_acq_rel);
+		writeIndex = previous & INDEX_MASK;
+	}
+
+	// Reader side. Returns true if a newer buffer was published since the last call
+	bool update()
+	{
+		if ((middle.load(std::memory_order_relaxed) & FRESH) == 0)
+			return false;
+
+		unsigned int previous = middle.exchange(readIndex, std::memory_order_acq_rel);
+		readIndex = previous & INDEX_MASK;
+		return true;
+	}
+	const T& readBuffer() const { return buffers[readIndex]; }
+
+private:
+    static const unsigned int INDEX_MASK = 3;
+    static const unsigned int FRESH = 4;
+
+    T buffers[3];
+
+    // Each index is owned by one thread; kept on separate cache lines so the two threads
+    // do not invalidate each other's line on every tick and frame
+    alignas(64) unsigned int writeIndex = 0;
+    alignas(64) std::atomic<unsigned int> middle{ 1 };
+    alignas(64) unsigned int readIndex = 2;
+};
+
+#endif // !TRIPLEBUFFER_H
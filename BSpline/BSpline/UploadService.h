@@ -0,0 +1,103 @@
+#ifndef UPLOADSERVICE_H
+#define UPLOADSERVICE_H
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct BufferUpload;
+typedef std::shared_ptr<BufferUpload> UploadHandle;
+
+// One piece of the data for a buffer, the pieces are put one after the other
+struct UploadSource
+{
+    const void* data = nullptr;
+    size_t size = 0;
+};
+
+// Uploads buffers on a thread of its own, so a big glBufferData does not stop the render loop
+// The thread has a hidden window whose context shares objects with the main window. The data is
+// copied in chunks through two staging buffers, each refilled only when the fence after its last
+// copy has passed, and a fence after the last chunk tells the render thread that the buffer is done.
+// Without the shared context (the hidden window could not be made) uploads run on the calling thread
+class UploadService
+{
+public:
+	// Call on the main thread with the context of mainWindow current
+	explicit UploadService(GLFWwindow* mainWindow, size_t chunkSize = 4 * 1024 * 1024);
+
+	// Stops the upload thread and destroys its window, before the main window is destroyed
+	~UploadService();
+
+	// The data must stay valid until the upload is ready or discarded
+	UploadHandle uploadBuffer(const void* data, size_t size);
+	UploadHandle uploadBuffer(const std::vector<UploadSource>& sources);
+
+	// The service keeps the vector until its data is on the GPU
+	template <typename T>
+	UploadHandle uploadBuffer(std::vector<T> data)
+	{
+		std::shared_ptr<std::vector<T>> owner = std::make_shared<std::vector<T>>(std::move(data));
+		UploadSource source;
+		source.data = owner->data();
+		source.size = owner->size() * sizeof(T);
+		return enqueue(std::vector<UploadSource>(1, source), owner);
+	}
+
+	// Render thread: true once the fence after the last copy has passed (or the upload failed,
+	// then getBuffer is 0). Never blocks; from then on the buffer can be bound, binding it in this
+	// context makes the new data visible here. The caller owns the buffer from then on
+	static bool isReady(const UploadHandle& upload);
+
+	// Render thread: blocks until the upload is ready, for code that needs the buffer right away
+	static void wait(const UploadHandle& upload);
+
+	// The buffer object once the upload is ready, 0 before that or when it failed
+	static GLuint getBuffer(const UploadHandle& upload);
+
+	// Render thread: drops an upload that is no longer wanted and deletes its buffer
+	// Returns once the upload thread is done with the data, so the data may be freed after it
+	static void discard(const UploadHandle& upload);
+
+	// True when uploads run on the background thread
+	bool isBackground() const { return uploadWindow != NULL; }
+
+private:
+    UploadService(const UploadService&);
+    UploadService& operator=(const UploadService&);
+
+    GLFWwindow* uploadWindow = NULL;
+    size_t chunkSize;
+
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable queueChanged;   // new upload or stopping
+    std::deque<UploadHandle> queue;
+    std::atomic<bool> stopping{ false };
+
+    // Owned by the upload thread
+    GLuint stagingBuffers[2] = { 0, 0 };
+    GLsync stagingFences[2] = { 0, 0 };
+
+    UploadHandle enqueue(const std::vector<UploadSource>& sources, std::shared_ptr<void> owner);
+
+    void uploadLoop();
+
+    // Copies all sources into a new buffer through the staging buffers and sets the fence
+    void copyThroughStaging(BufferUpload& upload);
+
+    // Plain glBufferData on the calling thread, when there is no upload thread
+    void uploadDirectly(BufferUpload& upload);
+
+    // The upload thread is done with the data; wakes wait() and discard()
+    static void finishCopy(BufferUpload& upload, bool succeeded);
+};
+
+#endif // !UPLOADSERVICE_H
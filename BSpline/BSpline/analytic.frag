@@ -0,0 +1,59 @@
+#version 330 core
+out vec4 FragColor;
+
+in vec2 vParam;
+flat in int vPatch;
+flat in mat3 vNormalMatrix;
+
+// Bicubic Bezier patches, 16 homogeneous control points each, stored as points[i * 4 + j]
+uniform samplerBuffer patchPoints;
+
+uniform vec3 lightDirection; // Towards the light, in world space
+
+// Cubic Bernstein polynomials and their derivatives
+void bernstein(float t, out vec4 B, out vec4 dB)
+{
+    float s = 1.0 - t;
+    B = vec4(s * s * s, 3.0 * t * s * s, 3.0 * t * t * s, t * t * t);
+    dB = 3.0 * vec4(-s * s, s * s - 2.0 * t * s, 2.0 * t * s - t * t, t * t);
+}
+
+void main()
+{
+    float s = clamp(vParam.x, 0.0, 1.0);
+    float t = clamp(vParam.y, 0.0, 1.0);
+
+    vec4 Bu, dBu, Bv, dBv;
+    bernstein(s, Bu, dBu);
+    bernstein(t, Bv, dBv);
+
+    // Point and partial derivatives of the homogeneous patch
+    int base = vPatch * 16;
+    vec4 A = vec4(0.0);
+    vec4 Au = vec4(0.0);
+    vec4 Av = vec4(0.0);
+    for (int i = 0; i < 4; ++i)
+    {
+        vec4 row = vec4(0.0);
+        vec4 rowDv = vec4(0.0);
+        for (int j = 0; j < 4; ++j)
+        {
+            vec4 Pw = texelFetch(patchPoints, base + i * 4 + j);
+            row += Bv[j] * Pw;
+            rowDv += dBv[j] * Pw;
+        }
+        A += Bu[i] * row;
+        Au += dBu[i] * row;
+        Av += Bu[i] * rowDv;
+    }
+
+    // Rational derivative: S' = (A' - w' * S) / w, the length of the patch in (u, v) only scales it
+    vec3 S = A.xyz / A.w;
+    vec3 Su = (Au.xyz - Au.w * S) / A.w;
+    vec3 Sv = (Av.xyz - Av.w * S) / A.w;
+    vec3 normal = normalize(vNormalMatrix * cross(Su, Sv));
+
+    // Two sided, the surface has no inside
+    float diffuse = abs(dot(normal, normalize(lightDirection)));
+    FragColor = vec4(vec3(0.15 + 0.85 * diffuse), 1.0);
+}
\ No newline at end of file
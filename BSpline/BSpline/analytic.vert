@@ -0,0 +1,21 @@
+#version 330 core
+
+layout (location = 0) in vec3 aPos;
+layout (location = 1) in vec3 aPatchParam; // Parameters (s, t) inside the Bezier patch, and the patch index
+
+#include "frame.glsl"
+
+uniform mat4 model;
+
+out vec2 vParam;
+flat out int vPatch;
+flat out mat3 vNormalMatrix;
+
+void main()
+{
+    // Only the parameters are needed for shading, they are linear over the coarse grid
+    vParam = aPatchParam.xy;
+    vPatch = int(aPatchParam.z + 0.5);
+    vNormalMatrix = mat3(transpose(inverse(model)));
+    gl_Position = viewProjection * model * vec4(aPos, 1.0);
+}
\ No newline at end of file
@@ -1,7 +1,27 @@
 #version 330 core
 out vec4 FragColor;
 
+#ifdef HAS_NORMALS
+in vec3 vNormal;
+uniform vec3 lightDirection; // Towards the light, in world space
+#endif
+
+#ifdef COLOR_BY_HEIGHT
+in float vHeight;
+uniform vec2 heightRange; // World z drawn with the low and the high color
+#endif
+
 void main()
 {
-    FragColor = vec4(1.0f, 1.0f, 1.0f, 1.0f); // Set to any color you prefer for the surface
+    vec3 color = vec3(1.0f, 1.0f, 1.0f); // Set to any color you prefer for the surface
+#ifdef COLOR_BY_HEIGHT
+    float height = clamp((vHeight - heightRange.x) / (heightRange.y - heightRange.x), 0.0, 1.0);
+    color = mix(vec3(0.25, 0.45, 0.2), vec3(0.75, 0.65, 0.5), height);
+#endif
+#ifdef HAS_NORMALS
+    // Two sided, like the analytic shading
+    float diffuse = abs(dot(normalize(vNormal), normalize(lightDirection)));
+    color *= 0.15 + 0.85 * diffuse;
+#endif
+    FragColor = vec4(color, 1.0f);
 }
\ No newline at end of file
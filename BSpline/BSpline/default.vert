@@ -1,12 +1,32 @@
 #version 330 core
 
+// Variants, built by ShaderVariants with these defined:
+//   HAS_NORMALS      the vertices have a normal in attribute 1, lit from lightDirection
+//   COLOR_BY_HEIGHT  colored from low to high world z over heightRange
+
 layout (location = 0) in vec3 aPos;
+#ifdef HAS_NORMALS
+layout (location = 1) in vec3 aNormal;
+#endif
+
+#include "frame.glsl"
 
 uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+
+#ifdef HAS_NORMALS
+out vec3 vNormal;
+#endif
+#ifdef COLOR_BY_HEIGHT
+out float vHeight;
+#endif
 
 void main()
 {
-    gl_Position = projection * view * model * vec4(aPos, 1.0);
+#ifdef HAS_NORMALS
+    vNormal = mat3(transpose(inverse(model))) * aNormal;
+#endif
+#ifdef COLOR_BY_HEIGHT
+    vHeight = (model * vec4(aPos, 1.0)).z;
+#endif
+    gl_Position = viewProjection * model * vec4(aPos, 1.0);
 }
\ No newline at end of file
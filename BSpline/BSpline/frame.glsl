@@ -0,0 +1,10 @@
+// Camera for the whole frame, shared by every program (FrameUniforms.h)
+// Included by the shaders with #include "frame.glsl", see Shader in shaderClass.h
+layout (std140) uniform FrameUniforms
+{
+    mat4 projection;
+    mat4 view;
+    mat4 viewProjection;
+    vec4 cameraPosition;
+    vec4 viewport;
+};
@@ -0,0 +1,15 @@
+#version 330 core
+
+layout (location = 0) in vec3 aPos;
+layout (location = 1) in vec3 aNormal;
+
+uniform mat4 model;
+
+out vec3 vNormal;
+
+void main()
+{
+    // World space here, the geometry shader applies view and projection to both ends of the line
+    gl_Position = model * vec4(aPos, 1.0);
+    vNormal = normalize(mat3(transpose(inverse(model))) * aNormal);
+}
@@ -1,4 +1,9 @@
 #include"shaderClass.h"
+#include "FrameUniforms.h"
+#include "GLState.h"
+#include "ProgramCache.h"
+#include <algorithm>
+#include <thread>
 
 string get_file_contents(const char* filename)
 {
@@ -17,41 +22,349 @@ string get_file_contents(const char* filename)
 	throw(errno);
 }
 
+static const int MAX_INCLUDE_DEPTH = 16;
+
+//The directory of a file with its separator, empty for a file in the working directory
+static string directoryOf(const string& file)
+{
+	size_t separator = file.find_last_of("/\\");
+	return separator == string::npos ? string() : file.substr(0, separator + 1);
+}
+
+//Puts the included files in the place of their #include lines. Every file read is a source string
+//number in the #line directives, sourceFiles[number], so the compiler's errors point at the right file
+static string preprocessFile(const string& file, const string& code, std::vector<string>& sourceFiles, int depth)
+{
+	int sourceNumber = (int)sourceFiles.size();
+	sourceFiles.push_back(file);
+
+	istringstream lines(code);
+	ostringstream out;
+	string line;
+	int lineNumber = 0;
+	while (getline(lines, line))
+	{
+		++lineNumber;
+		size_t first = line.find_first_not_of(" \t");
+		if (first == string::npos || line.compare(first, 8, "#include") != 0)
+		{
+			out << line << '\n';
+			continue;
+		}
+
+		out << '\n'; //The #include line itself, the file goes after it
+		size_t open = line.find('"', first + 8);
+		size_t close = open == string::npos ? string::npos : line.find('"', open + 1);
+		if (close == string::npos)
+		{
+			std::cout << "Error: " << file << " line " << lineNumber << ": #include needs a file name in quotes" << std::endl;
+			continue;
+		}
+
+		string includeFile = directoryOf(file) + line.substr(open + 1, close - open - 1);
+		if (std::find(sourceFiles.begin(), sourceFiles.end(), includeFile) != sourceFiles.end())
+			continue; //Already in this stage, the blocks and functions can only be declared once
+		if (depth >= MAX_INCLUDE_DEPTH)
+		{
+			std::cout << "Error: " << file << " line " << lineNumber << ": includes nested too deep at " << includeFile << std::endl;
+			continue;
+		}
+
+		string includeCode;
+		try
+		{
+			includeCode = get_file_contents(includeFile.c_str());
+		}
+		catch (int)
+		{
+			std::cout << "Error: " << file << " line " << lineNumber << ": could not open " << includeFile << std::endl;
+			continue;
+		}
+		out << "#line 1 " << sourceFiles.size() << '\n';
+		out << preprocessFile(includeFile, includeCode, sourceFiles, depth + 1);
+		out << "#line " << lineNumber + 1 << ' ' << sourceNumber << '\n';
+	}
+	return out.str();
+}
+
+//The defines go right after #version, which has to come first, and #line gives back the file's own line numbers
+static string injectDefines(const string& code, const std::vector<string>& defines)
+{
+	if (defines.empty())
+		return code;
+
+	size_t insertAt = 0;
+	size_t version = code.find("#version");
+	if (version != string::npos)
+	{
+		size_t lineEnd = code.find('\n', version);
+		insertAt = lineEnd == string::npos ? code.size() : lineEnd + 1;
+	}
+	int nextLine = (int)std::count(code.begin(), code.begin() + insertAt, '\n') + 1;
+
+	string defineLines;
+	for (const string& define : defines)
+		defineLines += "#define " + define + "\n";
+	defineLines += "#line " + std::to_string(nextLine) + " 0\n";
+	return code.substr(0, insertAt) + defineLines + code.substr(insertAt);
+}
+
+//Create and compile one shader stage, the status is checked after the link
+static GLuint compileShaderSource(GLenum type, const string& code)
+{
+	const char* source = code.c_str();
+
+	GLuint shader = glCreateShader(type); //Create the shader
+	glShaderSource(shader, 1, &source, NULL); //Attach the source code to the shader
+	glCompileShader(shader); //Compile the shader
+	return shader;
+}
+
+static double millisecondsBetween(std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end)
+{
+	return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
 Shader::Shader(const char* vertexFile, const char* fragmentFile)
 {
-	string vertexCode = get_file_contents(vertexFile);
-	string fragmentCode = get_file_contents(fragmentFile);
+	build({ GL_VERTEX_SHADER, GL_FRAGMENT_SHADER }, { vertexFile, fragmentFile });
+}
+
+Shader::Shader(const char* vertexFile, const char* fragmentFile, const std::vector<std::string>& defines)
+{
+	build({ GL_VERTEX_SHADER, GL_FRAGMENT_SHADER }, { vertexFile, fragmentFile }, defines);
+}
+
+Shader::Shader(const char* vertexFile, const char* tessControlFile, const char* tessEvaluationFile, const char* fragmentFile)
+{
+	build({ GL_VERTEX_SHADER, GL_TESS_CONTROL_SHADER, GL_TESS_EVALUATION_SHADER, GL_FRAGMENT_SHADER },
+		{ vertexFile, tessControlFile, tessEvaluationFile, fragmentFile });
+}
 
-	const char* vertexSource = vertexCode.c_str();
-	const char* fragmentSource = fragmentCode.c_str();
+Shader::Shader(const char* vertexFile, const char* geometryFile, const char* fragmentFile)
+{
+	build({ GL_VERTEX_SHADER, GL_GEOMETRY_SHADER, GL_FRAGMENT_SHADER }, { vertexFile, geometryFile, fragmentFile });
+}
 
-	GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER); //Create a vertex shader	
-	glShaderSource(vertexShader, 1, &vertexSource, NULL); //Attach the vertex shader source code to the shader
-	glCompileShader(vertexShader); //Compile the vertex shader
+void Shader::build(const std::vector<GLenum>& types, const std::vector<const char*>& files, const std::vector<std::string>& defines)
+{
+	state = std::make_shared<BuildState>();
+	state->start = std::chrono::steady_clock::now();
 
-	GLuint fragmentShader = glCreateShader(GL_FRAGMENT_SHADER); //Create a fragment shader
-	glShaderSource(fragmentShader, 1, &fragmentSource, NULL); //Attach the fragment shader source code to the shader
-	glCompileShader(fragmentShader); //Compile the fragment shader
+	std::vector<string> sources;
+	for (const char* file : files)
+	{
+		std::vector<string> sourceFiles;
+		sources.push_back(injectDefines(preprocessFile(file, get_file_contents(file), sourceFiles, 0), defines));
+		state->stageFiles.push_back(file);
+		state->stageSourceFiles.push_back(sourceFiles);
+		state->name += (state->name.empty() ? "" : " + ") + string(file);
+	}
+	if (!defines.empty())
+	{
+		state->name += " [";
+		for (size_t i = 0; i < defines.size(); ++i)
+			state->name += (i == 0 ? "" : " ") + defines[i];
+		state->name += "]";
+	}
 
 	ID = glCreateProgram(); //Create a shader program to link the shaders
+	state->program = ID;
+
+	//Programs that were checked on first use or deleted leave their entries behind until here
+	std::vector<std::weak_ptr<BuildState>>& pending = pendingBuilds();
+	pending.erase(std::remove_if(pending.begin(), pending.end(), [](const std::weak_ptr<BuildState>& entry)
+	{
+		std::shared_ptr<BuildState> build = entry.lock();
+		return !build || !build->pending;
+	}), pending.end());
+	pending.push_back(state);
 
-	glAttachShader(ID, vertexShader); //Attach the vertex shader to the shader program
-	glAttachShader(ID, fragmentShader); //Attach the fragment shader to the shader program
-	glLinkProgram(ID); //Link the shader program
+	//The same sources on the same driver were linked before
+	state->cacheKey = ProgramCache::keyFor(types, sources);
+	if (ProgramCache::load(state->cacheKey, ID))
+	{
+		state->fromCache = true;
+		return;
+	}
 
-	glDeleteShader(vertexShader); //Delete the vertex shader
-	glDeleteShader(fragmentShader); //Delete the fragment shader
+	for (size_t i = 0; i < types.size(); ++i)
+	{
+		GLuint shader = compileShaderSource(types[i], sources[i]);
+		glAttachShader(ID, shader); //Attach the stage to the shader program
+		state->stages.push_back(shader);
+	}
+
+	//The binary can only be read back afterwards if the driver is told before the link
+	if (hasProgramBinary())
+		glProgramParameteri(ID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	glLinkProgram(ID); //Link the shader program, on the driver's threads with parallel compile
+}
+
+std::vector<std::weak_ptr<Shader::BuildState>>& Shader::pendingBuilds()
+{
+	static std::vector<std::weak_ptr<BuildState>> builds;
+	return builds;
+}
+
+void Shader::finishPendingBuilds()
+{
+	std::vector<std::shared_ptr<BuildState>> builds;
+	for (const std::weak_ptr<BuildState>& pending : pendingBuilds())
+	{
+		std::shared_ptr<BuildState> build = pending.lock();
+		if (build && build->pending)
+			builds.push_back(build);
+	}
+	pendingBuilds().clear();
+
+	//Without the extension there is nothing to poll, the link status below waits for each program
+	if (hasParallelShaderCompile())
+	{
+		size_t remaining = builds.size();
+		while (remaining > 0)
+		{
+			remaining = 0;
+			for (const std::shared_ptr<BuildState>& build : builds)
+			{
+				if (build->completed)
+					continue;
+				GLint done = GL_FALSE;
+				glGetProgramiv(build->program, GL_COMPLETION_STATUS_KHR, &done);
+				if (done == GL_TRUE)
+				{
+					build->completed = true;
+					build->end = std::chrono::steady_clock::now();
+				}
+				else
+				{
+					++remaining;
+				}
+			}
+			if (remaining > 0)
+				std::this_thread::yield();
+		}
+	}
+
+	for (const std::shared_ptr<BuildState>& build : builds)
+		finishBuild(*build);
+}
+
+void Shader::finishBuild(BuildState& build)
+{
+	build.pending = false;
+
+	GLint linked = GL_FALSE;
+	glGetProgramiv(build.program, GL_LINK_STATUS, &linked); //Waits for the compile and link
+	build.linked = linked == GL_TRUE;
+	if (!build.completed)
+	{
+		build.completed = true;
+		build.end = std::chrono::steady_clock::now();
+	}
+
+	char log[4096];
+	for (size_t i = 0; i < build.stages.size(); ++i)
+	{
+		GLint compiled = GL_FALSE;
+		glGetShaderiv(build.stages[i], GL_COMPILE_STATUS, &compiled);
+		if (compiled != GL_TRUE)
+		{
+			glGetShaderInfoLog(build.stages[i], sizeof(log), NULL, log);
+			std::cout << "Error: Shader " << build.stageFiles[i] << " did not compile:\n" << log;
+			const std::vector<string>& sourceFiles = build.stageSourceFiles[i];
+			if (sourceFiles.size() > 1)
+			{
+				//The first number in the log is the file
+				std::cout << "Source strings:";
+				for (size_t j = 0; j < sourceFiles.size(); ++j)
+					std::cout << (j == 0 ? " " : ", ") << j << " = " << sourceFiles[j];
+				std::cout << "\n";
+			}
+			std::cout << std::endl;
+		}
+		glDetachShader(build.program, build.stages[i]);
+		glDeleteShader(build.stages[i]); //The program keeps what it needs
+	}
+	build.stages.clear();
+
+	if (!build.linked)
+	{
+		glGetProgramInfoLog(build.program, sizeof(log), NULL, log);
+		std::cout << "Error: Program " << build.name << " did not link:\n" << log << std::endl;
+		return;
+	}
+
+	//From the constructor until the driver was seen done with the program
+	double milliseconds = millisecondsBetween(build.start, build.end);
+	if (build.fromCache)
+	{
+		std::cout << "Shader " << build.name << ": loaded from the program cache in " << milliseconds << " ms" << std::endl;
+	}
+	else
+	{
+		std::cout << "Shader " << build.name << ": compiled and linked in " << milliseconds << " ms"
+			<< (hasParallelShaderCompile() ? " (driver threads)" : "") << std::endl;
+		ProgramCache::store(build.cacheKey, build.program);
+	}
+
+	setupUniforms(build);
 }
 
+bool Shader::isLinked() const
+{
+	if (state->pending)
+		finishBuild(*state);
+	return state->linked;
+}
+
+void Shader::setupUniforms(BuildState& build)
+{
+	std::unordered_map<std::string, GLint>& locations = build.uniformLocations;
+
+	GLint count = 0;
+	GLint maxLength = 0;
+	glGetProgramiv(build.program, GL_ACTIVE_UNIFORMS, &count);
+	glGetProgramiv(build.program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+	std::string name(std::max(maxLength, 1), '\0');
+	for (GLint i = 0; i < count; ++i)
+	{
+		GLsizei length = 0;
+		GLint size = 0;
+		GLenum type = 0;
+		glGetActiveUniform(build.program, i, maxLength, &length, &size, &type, &name[0]);
+		std::string uniformName(name.c_str(), length);
+
+		//Members of uniform blocks have no location
+		GLint location = glGetUniformLocation(build.program, uniformName.c_str());
+		if (location < 0)
+			continue;
+		locations[uniformName] = location;
+
+		//Arrays are reported as "name[0]", and are set by their plain name as well
+		if (uniformName.size() > 3 && uniformName.compare(uniformName.size() - 3, 3, "[0]") == 0)
+			locations[uniformName.substr(0, uniformName.size() - 3)] = location;
+	}
+
+	GLuint frameBlock = glGetUniformBlockIndex(build.program, "FrameUniforms");
+	if (frameBlock != GL_INVALID_INDEX)
+		glUniformBlockBinding(build.program, frameBlock, FRAME_UNIFORMS_BINDING);
+}
 
-//Activate the shader
+//Activate the shader, nothing is sent to OpenGL if it is active already
 void Shader::Activate()
 {
-	glUseProgram(ID);
+	if (state->pending)
+		finishBuild(*state);
+	GLState::useProgram(ID);
 }
 
 //Delete the shader
 void Shader::Delete()
 {
-	glDeleteProgram(ID);
+	for (GLuint stage : state->stages)
+		glDeleteShader(stage);
+	state->stages.clear();
+	state->pending = false;
+	GLState::deleteProgram(ID);
 }
@@ -6,37 +6,122 @@
 #include <sstream>
 #include <iostream>
 #include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
 #include <glm/glm.hpp>
 #include <glm/gtc/type_ptr.hpp>
+#include "GLExtensions.h"
 
 using namespace std;
 
 string get_file_contents(const char* filename); //Function to read the shader files
 
 //Shader class
+//The stages are compiled and the program linked in the constructor, but the result is only checked
+//in finishPendingBuilds, or on first use (Activate, or a uniform) if that comes earlier. With
+//KHR_parallel_shader_compile the driver compiles on its own threads meanwhile, so programs made one
+//after the other compile in parallel. Linked programs are kept in the ProgramCache and loaded from
+//there on the next run
+//The sources are preprocessed first: #include "file" puts the file in its place (relative to the file
+//that includes it, once per stage), and the defines of a variant are put right after the #version line
 class Shader
 {
 	public:
 		GLuint ID;
 		Shader(const char* vertexFile, const char* fragmentFile);
+		//Variant of the program with these defined, each "NAME" or "NAME value" (see ShaderVariants)
+		Shader(const char* vertexFile, const char* fragmentFile, const std::vector<std::string>& defines);
+		//Program with tessellation control and evaluation stages (needs OpenGL 4.0)
+		Shader(const char* vertexFile, const char* tessControlFile, const char* tessEvaluationFile, const char* fragmentFile);
+		//Program with a geometry shader between the vertex and fragment stages
+		Shader(const char* vertexFile, const char* geometryFile, const char* fragmentFile);
 
 		void Activate();
 		void Delete();
 
+		//Waits for the link if it is not checked yet; false if a stage did not compile or it did not link
+		bool isLinked() const;
+
+		//Checks every program that is not checked yet, reports its build time and caches it
+		//Call when the programs of startup are made, so programs that are used late or never are cached
+		//too and their time is not stretched to their first use. With parallel compile the programs are
+		//polled with GL_COMPLETION_STATUS_KHR and each time ends when its program is seen done
+		static void finishPendingBuilds();
+
+		//Location of a uniform from the table made when the program was linked, -1 if it is not used
+		GLint getUniformLocation(const std::string& name) const
+		{
+			if (state->pending)
+				finishBuild(*state);
+			auto found = state->uniformLocations.find(name);
+			return found != state->uniformLocations.end() ? found->second : -1;
+		}
+
+		void setInt(const std::string& name, int value) const
+		{
+			glUniform1i(getUniformLocation(name), value);
+		}
+
+		void setFloat(const std::string& name, float value) const
+		{
+			glUniform1f(getUniformLocation(name), value);
+		}
+
+		void setVec2(const std::string& name, const glm::vec2& value) const
+		{
+			glUniform2fv(getUniformLocation(name), 1, &value[0]);
+		}
+
 		void setVec3(const std::string& name, const glm::vec3& value) const
 		{
-			glUniform3fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+			glUniform3fv(getUniformLocation(name), 1, &value[0]);
 		}
 
 		void setMat4(const std::string& name, const glm::mat4& mat) const
 		{
-			glUniformMatrix4fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+			glUniformMatrix4fv(getUniformLocation(name), 1, GL_FALSE, &mat[0][0]);
 		}
 
 		void SetMatrix4(const char* name, glm::mat4 matrix)
 		{
-			glUniformMatrix4fv(glGetUniformLocation(ID, name), 1, GL_FALSE, glm::value_ptr(matrix));
+			glUniformMatrix4fv(getUniformLocation(name), 1, GL_FALSE, glm::value_ptr(matrix));
 		}
+
+	private:
+		//Shared by the copies of the Shader, the programs are passed around by value
+		struct BuildState
+		{
+			std::string name; //The files of the stages, for messages
+			std::vector<GLuint> stages; //Compiled stages, until the link is checked
+			std::vector<std::string> stageFiles;
+			std::vector<std::vector<std::string>> stageSourceFiles; //Files of the #line source numbers, for errors
+			GLuint program = 0;
+			uint64_t cacheKey = 0;
+			bool pending = true; //Link not checked yet
+			bool fromCache = false;
+			bool linked = false;
+			bool completed = false; //The driver is done, end is set
+			std::chrono::steady_clock::time_point start;
+			std::chrono::steady_clock::time_point end;
+			std::unordered_map<std::string, GLint> uniformLocations;
+		};
+		std::shared_ptr<BuildState> state;
+
+		//Reads and preprocesses the stages, then loads the program from the cache or compiles and links it
+		void build(const std::vector<GLenum>& types, const std::vector<const char*>& files,
+			const std::vector<std::string>& defines = std::vector<std::string>());
+
+		//Builds that finishPendingBuilds has not seen yet
+		static std::vector<std::weak_ptr<BuildState>>& pendingBuilds();
+
+		//Checks the stages and the link, reports the build time, stores the binary and sets up the uniforms
+		static void finishBuild(BuildState& build);
+
+		//After linking: the location of every active uniform, and the FrameUniforms block binding
+		static void setupUniforms(BuildState& build);
 };
 
 #endif
@@ -0,0 +1,11 @@
+#version 400 core
+
+layout (location = 0) in vec4 aControlPoint; // Homogeneous control point (w * P, w)
+
+out vec4 vControlPoint;
+
+void main()
+{
+    // The control points are only passed on, the surface is evaluated in the evaluation shader
+    vControlPoint = aControlPoint;
+}